@@ -12,6 +12,12 @@ use File::Copy;
 use MIME::Base64;
 use File::Slurp;
 use Regexp::Common qw/URI/;
+use IO::Handle;
+
+# We ship a copy of exiftool; use its library directly, instead of starting
+#  up a whole new perl to run it for every image.
+BEGIN { unshift @INC, dirname($0) . '/exiftool/lib'; }
+use Image::ExifTool;
 
 my $VERSION = '0.0.1';
 
@@ -59,6 +65,11 @@ my $allow_thumbnails = 1;
 my $ios_archive = 0;
 my $archive_version = 0;
 my $mbox = 0;
+my $media_jobs = 1;
+my $bake_orientation = 0;
+my $media_cache_mb = 256;
+my $video_preview = 'gif';  # or 'poster'
+my $video_preview_seconds = undef;  # for 'gif'; undef for the whole clip.
 
 sub usage {
     print STDERR "USAGE: $0 [...options...] <messagedir> <maildir>\n";
@@ -73,6 +84,10 @@ sub usage {
     print STDERR "    --gap-time=NUM: treat NUM minutes of silence as the end of a conversation.\n";
     print STDERR "    --mbox: email archive should be in mbox format instead of Maildir.\n";
     print STDERR "    --maildir: email archive should be in Maildir format instead of mbox.\n";
+    print STDERR "    --jobs=NUM: process up to NUM images/videos at once.\n";
+    print STDERR "    --bake-orientation: rotate scaled images instead of tagging them with EXIF orientation.\n";
+    print STDERR "    --video-preview=gif[:SECONDS]|poster: show videos as an animated gif (of the first SECONDS) or a still frame.\n";
+    print STDERR "    --cache-size=NUM: keep up to NUM megabytes of scaled images/videos between runs (0 for none, default 256).\n";
     print STDERR "    messagedir: Directory holding iPhone backup or Messages chat.db database.\n";
     print STDERR "    maildir: Path of Maildir/mbox where we write archives and metadata.\n";
     print STDERR "\n";
@@ -94,8 +109,15 @@ foreach (@ARGV) {
     $allow_thumbnails = 0, next if $_ eq '--no-thumbnails';
     $mbox = 1, next if $_ eq '--mbox';
     $mbox = 0, next if $_ eq '--maildir';
+    $bake_orientation = 1, next if $_ eq '--bake-orientation';
+    $bake_orientation = 0, next if $_ eq '--no-bake-orientation';
     $attachment_shrink_percent = int($1), next if /\A--attachments-shrink-percent=(\d+)\Z/;
     $gaptime = int($1) * 60, next if /\A--gap-time=(\d+)\Z/;
+    $media_jobs = int($1), next if /\A--jobs=(\d+)\Z/;
+    $media_cache_mb = int($1), next if /\A--cache-size=(\d+)\Z/;
+    ($video_preview, $video_preview_seconds) = ('gif', undef), next if $_ eq '--video-preview=gif';
+    ($video_preview, $video_preview_seconds) = ('gif', int($1)), next if /\A--video-preview=gif:(\d+)\Z/;
+    ($video_preview, $video_preview_seconds) = ('poster', undef), next if $_ eq '--video-preview=poster';
     $archivedir = $_, next if not defined $archivedir;
     $maildir = $_, next if (not defined $maildir);
     usage();
@@ -109,6 +131,9 @@ if ((defined $attachment_shrink_percent) && ($attachment_shrink_percent == 100))
     fail("--attachments-shrink-percent must be between 1 and 100.");
 }
 
+fail("--jobs must be at least 1.") if ($media_jobs < 1);
+fail("--video-preview=gif:SECONDS needs at least one second.") if ((defined $video_preview_seconds) && ($video_preview_seconds < 1));
+
 dbgprint("\$now is $now.\n");
 
 sub archive_fname {
@@ -207,80 +232,698 @@ sub slurp_archived_file {
     return 1;
 }
 
+my $exiftool = Image::ExifTool->new;
+$exiftool->Options(PrintConv => 0);  # same as exiftool's -n: we want the number, not "Rotate 90 CW".
+
 sub get_image_orientation {
     my $fname = shift;
-    my $cmdline = "$program_dir/exiftool/exiftool -n -Orientation '$fname' 2>/dev/null";
-    my $orientation = `$cmdline`;
-    fail("exiftool failed ('$cmdline')") if ($? != 0);
-    chomp($orientation);
-    $orientation =~ s/\AOrientation\s*\:\s*(\d*)\s*\Z/$1/;
+    my $info = $exiftool->ImageInfo($fname, 'Orientation', 'Error');
+    fail("exiftool failed on '$fname': $$info{Error}") if (defined $$info{Error});
+    my $orientation = $$info{Orientation};
+    $orientation = '' if ((not defined $orientation) or ($orientation !~ /\A\d+\Z/));
     dbgprint("File '$fname' has an Orientation of '$orientation'.\n");
     return ($orientation eq '') ? undef : int($orientation);
 }
 
+# $fname can also be a reference to the image data itself, which is tagged
+#  in memory.
 sub set_image_orientation {
     my $fname = shift;
     my $orientation = shift;
     my $trash = shift;
     if (defined $orientation) {
-        my $cmdline = "$program_dir/exiftool/exiftool -overwrite_original_in_place -q -n -Orientation=$orientation '$fname'";
-        dbgprint("marking image orientation: $cmdline\n");
-        if (system($cmdline) != 0) {
-            unlink($fname) if $trash;
-            fail("exiftool failed ('$cmdline')")
+        my $name = ref($fname) ? 'scaled image' : $fname;
+        dbgprint("marking image orientation: '$name' Orientation=$orientation\n");
+        $exiftool->SetNewValue();  # forget anything set for the last file.
+        $exiftool->SetNewValue('Orientation', $orientation);
+        my $tagged = undef;
+        if (not $exiftool->WriteInfo($fname, ref($fname) ? \$tagged : undef)) {
+            my $err = $exiftool->GetValue('Error');
+            $err = 'unknown error' if not defined $err;
+            unlink($fname) if ($trash && not ref($fname));
+            fail("exiftool failed to set Orientation=$orientation on '$name': $err");
         }
+        $$fname = $tagged if (ref($fname) && defined $tagged);
+    }
+}
+
+# Runs $cmdline and puts everything it writes to stdout in $$dataref. Returns
+#  false if the command failed or wrote nothing.
+sub read_pipe {
+    my ($cmdline, $dataref) = @_;
+    my $fh = undef;
+    return 0 if (not open($fh, '-|', $cmdline));
+    binmode($fh);
+    local $/ = undef;
+    $$dataref = <$fh>;
+    close($fh);
+    return ($? == 0) && (defined $$dataref) && ($$dataref ne '');
+}
+
+# Runs $cmdline and encodes what it writes to stdout as it comes in, so a
+#  scaled image never has to be written to $maildir/tmp and read back. If
+#  $orientation is given, the image is tagged with it (in memory) first.
+#  Returns the base64 text, or undef if the command failed or wrote nothing.
+sub pipe_to_base64 {
+    my $cmdline = shift;
+    my $orientation = shift;
+    my $fh = undef;
+    return undef if (not open($fh, '-|', $cmdline));
+    binmode($fh);
+    my $base64 = '';
+    my $data = '';
+    my $buf = undef;
+    while (read($fh, $buf, 57 * 1024)) {
+        $data .= $buf;
+        next if defined $orientation;  # exiftool needs the whole thing.
+        # encode_base64() makes lines of 57 input bytes, so as long as it's
+        #  given whole lines, the pieces join up into the same text.
+        my $whole = length($data) - (length($data) % 57);
+        $base64 .= encode_base64(substr($data, 0, $whole, '')) if ($whole > 0);
     }
+    close($fh);
+    return undef if ($? != 0);
+    return undef if (($base64 eq '') && ($data eq ''));
+    set_image_orientation(\$data, $orientation);
+    return $base64 . encode_base64($data);
+}
+
+# With --bake-orientation, ffmpeg turns the pixels the way the EXIF Orientation
+#  says they should be shown, before it scales them, so the result needs no
+#  tag (and no second rewrite to add one), and looks right in mail clients
+#  that ignore EXIF. Returns the filters to put in front of the scale filter.
+sub orientation_filters {
+    my $orientation = shift;
+    return '' if not defined $orientation;
+    my %filters = (
+        2 => 'hflip,',
+        3 => 'hflip,vflip,',
+        4 => 'vflip,',
+        5 => 'transpose=0,',  # flip along the top-left to bottom-right diagonal.
+        6 => 'transpose=1,',  # 90 degrees clockwise.
+        7 => 'transpose=3,',  # flip along the top-right to bottom-left diagonal.
+        8 => 'transpose=2,',  # 90 degrees counterclockwise.
+    );
+    return defined $filters{$orientation} ? $filters{$orientation} : '';
 }
 
 # I ran into an attachment that iOS labeled as 'image/png' but it was actually
-#  a legal (and not weird as far as I can tell) .jpg file. So read the first
-#  few bytes and see if it's a jpeg magic number. Maybe we should do this for
-#  other formats too?
-sub check_jpegness {
-    my $mimetype = shift;
+#  a legal (and not weird as far as I can tell) .jpg file, so we don't trust
+#  the label: this reads the first few bytes of the file, once, and says what
+#  it really is: 'cgbi' (an iPhone PNG, which needs defrying), 'png', 'jpeg',
+#  'gif', 'heic', 'mp4' (which covers .mov, too), or '' if it's none of these.
+sub sniff_media {
     my $fname = shift;
-    return 1 if $mimetype eq 'image/jpeg';  # we'll believe them for now.
-    return 0 if not open my $fh, '<:raw', $fname;  # oh well.
-    my $bytes_read = read $fh, my $bytes, 2;
+    return '' if not open my $fh, '<:raw', $fname;  # oh well.
+    my $bytes_read = read $fh, my $bytes, 16;
     close $fh;
-    return 0 if $bytes_read != 2;
-    my ($b1, $b2) = unpack 'C C', $bytes;
-    return $b1 == 0xFF && $b2 == 0xD8;
+    return '' if ((not defined $bytes_read) or ($bytes_read < 12));
+
+    if (substr($bytes, 0, 8) eq "\x89PNG\x0D\x0A\x1A\x0A") {
+        # CgBI is the first chunk, ahead of IHDR, in an iPhone PNG.
+        return (substr($bytes, 12, 4) eq 'CgBI') ? 'cgbi' : 'png';
+    }
+    return 'jpeg' if (substr($bytes, 0, 2) eq "\xFF\xD8");
+    return 'gif' if ($bytes =~ /\AGIF8[79]a/);
+
+    # ISO media files (and QuickTime ones) are a series of boxes, starting
+    #  with 'ftyp', which names the brand. Older .mov files might start
+    #  straight in with the movie instead.
+    my $box = substr($bytes, 4, 4);
+    if ($box eq 'ftyp') {
+        my $brand = substr($bytes, 8, 4);
+        return 'heic' if ($brand =~ /\A(heic|heix|heim|heis|hevc|hevx|mif1|msf1)\Z/);
+        return 'mp4';
+    }
+    return 'mp4' if ($box =~ /\A(moov|mdat|wide|free|skip)\Z/);
+    return '';
+}
+
+# ffmpeg's input options for a file sniff_media() has looked at. Naming the
+#  format skips ffmpeg's own probing, and for a JPEG the iPhone called
+#  something else, it keeps ffmpeg from believing the file extension.
+sub media_input_format {
+    my $memo = shift;
+    my $format = $$memo{format};
+    return '-f mjpeg' if ($format eq 'jpeg');
+    return '-f gif' if ($format eq 'gif');
+    return '-f mov' if ($format eq 'mp4');
+    return '';
 }
 
+# pngdefry can shrink PNGs (iPhone ones or not) itself, which is a lot cheaper
+#  than starting up ffmpeg for every image. An older pngdefry binary doesn't
+#  know -t or -o-, though, so look at its usage text once, up front, instead
+#  of having it fail (and then running ffmpeg anyway) for every image.
+sub pngdefry_knows_thumbnails {
+    my $usage = `$program_dir/pngdefry 2>/dev/null`;
+    return ((defined $usage) && ($usage =~ /^\s+-t\(width\)/m)) ? 1 : 0;
+}
+
+my $pngdefry_thumbnails = $allow_thumbnails && pngdefry_knows_thumbnails();
+dbgprint("pngdefry " . ($pngdefry_thumbnails ? "makes" : "won't make") . " thumbnails.\n");
+
+# Returns the thumbnail as base64, or undef if pngdefry couldn't make it, so
+#  the caller can fall back.
+sub pngdefry_thumbnail {
+    my $fname = shift;
+    my $width = shift;
+    my $orientation = shift;
+    my $cmdline = "$program_dir/pngdefry -t$width -o- '$fname' 2>/dev/null";
+    dbgprint("generating thumbnail: $cmdline\n");
+    return pipe_to_base64($cmdline, $orientation);
+}
+
+# Temporary hack to make iPhone PNGs ( http://iphonedevwiki.net/index.php/CgBI_file_format ) look like normal PNGs.
+#  The suffix has our pid in it, so --jobs workers that get the same file at
+#  the same time don't move each other's half-written output into place.
+sub defry_png {
+    my $fname = shift;
+    my $suffix = "-defried-$$";
+    system("$program_dir/pngdefry -s$suffix '$fname' >/dev/null");
+    move("$fname$suffix.png", $fname) if ( -f "$fname$suffix.png");
+}
+
+# What we learn about an image or video, and what we make from it, is kept
+#  for the rest of the run, keyed by its path, size and modification time.
+#  A photo that gets a thumbnail and goes out as an attachment, or one that
+#  was forwarded a dozen times, is only defried, looked at and scaled once.
+#  Shrunk attachments the media cache doesn't keep, and the thumbnails'
+#  HTML, stay in memory, but only up to $media_memo_max_bytes between them;
+#  past that, the least recently used go (and come from the media cache, or
+#  get made again, if they're wanted after all). The memo only lives in the
+#  parent: what --jobs workers learn comes back with their results, so
+#  nothing is lost when a worker exits.
+my %media_memo = ();
+my $media_memo_files = 0;
+my $media_memo_uses = 0;
+my $media_memo_bytes = 0;  # thumbnails' HTML, and shrunk attachments in memory.
+my $media_memo_max_bytes = 64 * 1024 * 1024;
+my $media_parent_pid = $$;  # --jobs workers are forked copies; this is the real one.
+
+END {
+    return if ($$ != $media_parent_pid);  # a worker on its way out; the files are the parent's.
+    foreach (values %media_memo) {
+        unlink($$_{shrunkfname}) if ((defined $$_{shrunkfname}) && (not $$_{shrunk_cached}));
+    }
+    trim_media_cache();  # even if we died partway.
+}
+
+sub media_memo_key {
+    my $fname = shift;
+    my @st = stat($fname);
+    return undef if not @st;
+    return "$fname\0$st[7]\0$st[9]";
+}
+
+sub media_memo_add_bytes {
+    my ($memo, $bytes) = @_;
+    $$memo{bytes} = 0 if not defined $$memo{bytes};
+    $$memo{bytes} += $bytes;
+    $media_memo_bytes += $bytes;
+}
+
+# Drops the thumbnails and shrunk attachments used least recently, until
+#  the memo is back under $media_memo_max_bytes. Only called between
+#  conversations, when no job still needs any of them.
+sub trim_media_memo {
+    return if ($media_memo_bytes <= $media_memo_max_bytes);
+    my %seen = ();
+    my @memos = grep { $$_{bytes} && !$seen{$_}++ } values %media_memo;  # a memo can be under two keys.
+    foreach my $memo (sort { $$a{used} <=> $$b{used} } @memos) {
+        last if ($media_memo_bytes <= $media_memo_max_bytes);
+        dbgprint("Forgetting the thumbnail and shrunk attachment of memo $$memo{used}.\n");
+        delete $$memo{shrunk};
+        delete $$memo{thumbnail};
+        $media_memo_bytes -= $$memo{bytes};
+        $$memo{bytes} = 0;
+    }
+}
+
+# The hash of a file's contents, for media_cache_fname(); undef if it can't
+#  be read.
+sub media_sha1 {
+    my $fname = shift;
+    open(my $fh, '<:raw', $fname) or return undef;
+    my $sha1 = Digest::SHA1->new->addfile($fh)->hexdigest;
+    close($fh);
+    return $sha1;
+}
+
+# The looking itself: sniffs the file and defries it if it's an iPhone PNG,
+#  reads its orientation, and hashes it for the media cache, as asked. This
+#  can be as much work as scaling it, so it can run in a --jobs worker, too;
+#  what it found comes back as "name=value" lines, for remember_media().
+sub look_at_media {
+    my ($hashedfname, $mimetype, $want_format, $want_orientation, $want_sha1) = @_;
+    my $found = '';
+    if ($want_format) {
+        my $format = sniff_media($hashedfname);
+        dbgprint("'$hashedfname' is labeled '$mimetype', and looks like '$format'.\n");
+        if ($format eq 'cgbi') {
+            defry_png($hashedfname);
+            $format = sniff_media($hashedfname);  # still 'cgbi' if pngdefry couldn't.
+        }
+        $found .= "format=$format\n";
+    }
+    if ($want_orientation) {
+        my $orientation = get_image_orientation($hashedfname);
+        $found .= 'orientation=' . ((defined $orientation) ? $orientation : '') . "\n";
+    }
+    if ($want_sha1) {
+        my $sha1 = media_sha1($hashedfname);
+        $found .= "sha1=$sha1\n" if defined $sha1;
+    }
+    return $found;
+}
+
+# Puts what look_at_media() found in the memo for $key, and returns the memo.
+sub remember_media {
+    my ($key, $hashedfname, $found) = @_;
+    my $memo = $media_memo{$key};
+    $memo = $media_memo{$key} = {} if not defined $memo;
+    foreach (split /\n/, ((defined $found) ? $found : '')) {
+        next if not /\A(\w+)=(.*)\Z/;
+        my ($field, $value) = ($1, $2);
+        $value = undef if (($field eq 'orientation') && ($value eq ''));
+        $$memo{$field} = $value;
+    }
+    $key = media_memo_key($hashedfname);  # defrying rewrites the file.
+    $media_memo{$key} = $memo if defined $key;
+    return $memo;
+}
+
+# Returns the memo for an image or video, defrying it if this is the first
+#  look; undef if the file is missing. $want_orientation is false when we
+#  only send the file along as-is, so exiftool doesn't have to like it.
+#  probe_conversation_media() has usually done the looking already.
+sub probe_media {
+    my ($hashedfname, $mimetype, $want_orientation) = @_;
+    my $key = media_memo_key($hashedfname);
+    return undef if not defined $key;
+
+    my $memo = $media_memo{$key};
+    dbgprint("Already looked at '$hashedfname' this run.\n") if defined $memo;
+    my $want_format = not defined $memo;
+    $want_orientation = $want_orientation && !((defined $memo) && (exists $$memo{orientation}));
+    if ($want_format || $want_orientation) {
+        $memo = remember_media($key, $hashedfname, look_at_media($hashedfname, $mimetype, $want_format, $want_orientation, 0));
+    }
+    $$memo{used} = ++$media_memo_uses;
+    return $memo;
+}
+
+# Thumbnails and shrunk attachments are also kept between runs, in
+#  $maildir/imessage_media_cache, named for a hash of the source file's
+#  contents and of the settings that made them. So conversations that get
+#  archived again, or a fresh run into the same maildir, don't need ffmpeg for
+#  anything it already did. Files are written under a temporary name and
+#  renamed into place, so a crash can't leave half of one behind. Whenever
+#  a conversation leaves it bigger than --cache-size, and when we exit, the
+#  least recently used ones go until it fits again.
+my $media_cache_dir = undef;  # undef if --cache-size=0.
+my $media_cache_bytes = 0;  # as of the last trim_media_cache(), plus what's been added since.
+
+sub media_cache_fname {
+    my ($memo, $hashedfname, $settings) = @_;
+    return undef if not defined $media_cache_dir;
+    $$memo{sha1} = media_sha1($hashedfname) if (not defined $$memo{sha1});
+    return undef if not defined $$memo{sha1};
+    return "$media_cache_dir/" . sha1_hex("$$memo{sha1} $settings bake=$bake_orientation");
+}
+
+sub read_media_cache {
+    my ($cachefname, $dataref) = @_;
+    return 0 if ((not defined $cachefname) or (not -f $cachefname));
+    return 0 if (not defined read_file($cachefname, buf_ref => $dataref, binmode => ':raw', err_mode => 'quiet'));
+    utime(undef, undef, $cachefname);  # it's been used, keep it around longer.
+    dbgprint("Got '$cachefname' from the media cache.\n");
+    return 1;
+}
+
+# Returns 1 if $data made it into the cache.
+sub write_media_cache {
+    my ($cachefname, $data) = @_;
+    my $tmpfname = "$cachefname-tmp-$$";
+    if (not write_file($tmpfname, { binmode => ':raw', err_mode => 'quiet' }, $data)) {
+        unlink($tmpfname);
+        return 0;
+    }
+    if (not move($tmpfname, $cachefname)) {
+        unlink($tmpfname);
+        return 0;
+    }
+    $media_cache_bytes += length($data);
+    return 1;
+}
+
+sub trim_media_cache {
+    return if not defined $media_cache_dir;
+    opendir(my $dh, $media_cache_dir) or return;
+    my @files = ();
+    my $total = 0;
+    while (defined(my $f = readdir($dh))) {
+        next if $f =~ /\A\./;
+        my @st = stat("$media_cache_dir/$f");
+        next if not @st;
+        push @files, [ "$media_cache_dir/$f", $st[7], $st[9] ];
+        $total += $st[7];
+    }
+    closedir($dh);
+
+    my $limit = $media_cache_mb * 1024 * 1024;
+    foreach (sort { $$a[2] <=> $$b[2] } @files) {
+        last if ($total <= $limit);
+        dbgprint("Dropping '$$_[0]' from the media cache.\n");
+        unlink($$_[0]);
+        $total -= $$_[1];
+    }
+    $media_cache_bytes = $total;
+}
+
+# Looks at every image and video in a conversation that this run hasn't seen
+#  yet, with the --jobs workers, before anything that needs to know about
+#  them is queued. Takes [ $hashedfname, $mimetype, $want_orientation,
+#  $want_sha1 ] for each one.
+sub probe_conversation_media {
+    my %probes = ();
+    my @keys = ();
+    foreach (@_) {
+        my ($hashedfname, $mimetype, $want_orientation, $want_sha1) = @$_;
+        my $key = media_memo_key($hashedfname);
+        next if not defined $key;  # missing; that gets reported later.
+        my $memo = $media_memo{$key};
+        my $probe = $probes{$key};
+        if (not defined $probe) {
+            $probe = $probes{$key} = [ $hashedfname, $mimetype, (not defined $memo), 0, 0 ];
+            push @keys, $key;
+        }
+        $$probe[3] ||= $want_orientation && !((defined $memo) && (exists $$memo{orientation}));
+        $$probe[4] ||= $want_sha1 && (defined $media_cache_dir) && !((defined $memo) && (defined $$memo{sha1}));
+    }
+
+    @keys = grep { $probes{$_}[2] || $probes{$_}[3] || $probes{$_}[4] } @keys;
+    foreach my $key (@keys) {
+        my @probe = @{$probes{$key}};
+        queue_media_job(sub { return look_at_media(@probe); });
+    }
+    foreach my $key (@keys) {
+        remember_media($key, $probes{$key}[0], next_media_result());
+    }
+    reset_media_jobs();
+}
+
+# The ffmpeg filters for --attachments-shrink-percent.
+sub shrink_filters {
+    my $memo = shift;
+    my $rotate = $bake_orientation ? orientation_filters($$memo{orientation}) : '';
+    my $fract = $attachment_shrink_percent / 100.0;
+    return "${rotate}scale='trunc(iw*$fract)+mod(trunc(iw*$fract),2)':'trunc(ih*$fract)+mod(trunc(ih*$fract),2)'";
+}
+
+# ffmpeg's output options for writing an image like $fname to a pipe, or
+#  undef if it isn't one (videos go in containers that want a real file to
+#  seek around in).
+sub image_pipe_format {
+    my $fname = shift;
+    return '-f image2pipe -c:v mjpeg' if ($fname =~ /\.jpe?g\Z/i);
+    return '-f image2pipe -c:v png' if ($fname =~ /\.png\Z/i);
+    return '-f gif' if ($fname =~ /\.gif\Z/i);
+    return undef;
+}
 
 sub load_attachment {
     my $origfname = shift;
     my $hashedfname = shift;
     my $fdataref = shift;
     my $mimetype = shift;
+    my $memo = shift;  # from probe_media(), for images and videos.
+
+    if ((defined $attachment_shrink_percent) && (defined $memo)) {
+        my $fmt = media_input_format($memo);
+        my $orientation = $bake_orientation ? undef : $$memo{orientation};
+        my $outfname = $$memo{shrunkfname};  # only for what ffmpeg can't write to a pipe.
+        my $pipefmt = image_pipe_format($outfname);
+        if (defined $pipefmt) {
+            # Take the image straight from ffmpeg; it never touches the disk
+            #  (unless the media cache keeps it, see flush_conversation()).
+            my $cmdline = "$program_dir/ffmpeg $fmt -i '$hashedfname' -vf \"" . shrink_filters($memo) . "\" $pipefmt pipe:1 2>/dev/null";
+            dbgprint("shrinking attachment: $cmdline\n");
+            die("ffmpeg failed ('$cmdline')") if (not read_pipe($cmdline, $fdataref));
+            set_image_orientation($fdataref, $orientation);
+        } else {
+            my $cmdline = "$program_dir/ffmpeg $fmt -i '$hashedfname' -vf \"" . shrink_filters($memo) . "\" '$outfname' 2>/dev/null";
+            dbgprint("shrinking attachment: $cmdline\n");
+            unlink($outfname), die("ffmpeg failed ('$cmdline')") if (system($cmdline) != 0);
+            set_image_orientation($outfname, $orientation, 1);
+            read_file($outfname, buf_ref => $fdataref, binmode => ':raw', err_mode => 'carp');
+        }
+    } else {
+        read_file($hashedfname, buf_ref => $fdataref, binmode => ':raw', err_mode => 'carp');
+    }
+}
+
+
+# Small, upright PNGs get their thumbnail from pngdefry (if it knows -t), which
+#  is a lot cheaper than ffmpeg. It only limits the width, though, so anything
+#  that needs turning (or with --bake-orientation, flipping) is left to ffmpeg.
+sub thumbnail_by_pngdefry {
+    my $memo = shift;
+    my $orientation = $$memo{orientation};
+    return 0 if (not $pngdefry_thumbnails);
+    if (defined $orientation) {
+        return 0 if ($orientation >= 5);
+        return 0 if ($bake_orientation && ($orientation >= 2));
+    }
+    return $$memo{format} eq 'png';  # an iPhone PNG that pngdefry couldn't fix is still 'cgbi'.
+}
+
+# True if make_thumbnail() can also shrink the attachment while it's at it.
+#  Poster frames seek straight to one spot, so they can't.
+sub thumbnail_can_shrink {
+    my ($mimetype, $memo) = @_;
+    return ($video_preview ne 'poster') if ($mimetype =~ /\Avideo\//);
+    return not thumbnail_by_pngdefry($memo);
+}
 
-    my $is_image = $mimetype =~ /\Aimage\//;
+# Makes the inline HTML for the thumbnail of an image or video attachment.
+#  If $shrunkfname is given (see thumbnail_can_shrink()), the shrunk
+#  attachment is written there by the same ffmpeg run, split off after the
+#  decode, so the file is only decoded once. The thumbnail itself comes back
+#  through a pipe.
+sub make_thumbnail {
+    my ($hashedfname, $mimetype, $memo, $shrunkfname) = @_;
     my $is_video = $mimetype =~ /\Avideo\//;
 
-    # Temporary hack to make iPhone PNGs ( http://iphonedevwiki.net/index.php/CgBI_file_format ) look like normal PNGs.
-    if ($is_image) {
-        system("$program_dir/pngdefry -s-defried '$hashedfname' >/dev/null");
-        move("$hashedfname-defried.png", $hashedfname) if ( -f "$hashedfname-defried.png");
+    my $orientation = $$memo{orientation};
+    my $rotate = '';
+    if ($bake_orientation) {
+        $rotate = orientation_filters($orientation);
+        $orientation = undef;  # it's in the pixels now, so scale and tag it as upright.
     }
 
-    if ((defined $attachment_shrink_percent) && ($is_image || $is_video)) {
-        my $is_jpeg = check_jpegness($mimetype, $hashedfname);
-        my $fmt = $is_jpeg ? '-f mjpeg' : '';
-        my $orientation = get_image_orientation($hashedfname);
-        my $fract = $attachment_shrink_percent / 100.0;
-        my $basefname = $origfname;
-        $basefname =~ s#.*/##;
-        my $outfname = "$maildir/tmp/imessage-chatlog-tmp-$$-attachment-shrink-$basefname";
-        my $cmdline = "$program_dir/ffmpeg $fmt -i '$hashedfname' -vf \"scale='trunc(iw*$fract)+mod(trunc(iw*$fract),2)':'trunc(ih*$fract)+mod(trunc(ih*$fract),2)'\" '$outfname' 2>/dev/null";
-        dbgprint("shrinking attachment: $cmdline\n");
-        die("ffmpeg failed ('$cmdline')") if (system($cmdline) != 0);
-        set_image_orientation($outfname, $orientation, 1);
-        read_file($outfname, buf_ref => $fdataref, binmode => ':raw', err_mode => 'carp');
-        unlink($outfname);
+    my $scale="$thumbnail_max_width:-1";
+    # Orientations 5-8 mean rotation between portrait and landscape, so we have to resize the "height" as it will actually be the width at the end.
+    if ((defined $orientation) && (($orientation >= 5) && ($orientation <= 8))) {
+        $scale="-1:$thumbnail_max_width";
+    }
+
+    my $base64 = undef;
+    my $cmdline;
+    my $retry_cmdline = undef;  # if $cmdline didn't make anything.
+    my $inopts = media_input_format($memo);
+    my $filters = undef;  # for an ffmpeg run that $shrunkfname can join.
+    my $outopts = '';
+    if ($is_video && ($video_preview eq 'poster')) {
+        # Seek the input to a keyframe a second in (the very first frame is
+        #  often black) instead of decoding up to it, and take that one frame.
+        #  Clips shorter than that just get their first frame.
+        $cmdline = "$program_dir/ffmpeg -ss 1 $inopts -i '$hashedfname' -frames:v 1 -vf '${rotate}scale=$scale' -f image2pipe -c:v mjpeg pipe:1 2>/dev/null";
+        $retry_cmdline = "$program_dir/ffmpeg $inopts -i '$hashedfname' -frames:v 1 -vf '${rotate}scale=$scale' -f image2pipe -c:v mjpeg pipe:1 2>/dev/null";
+        $mimetype = 'image/jpeg';
+    } elsif ($is_video) {
+        # Make the optimal palette and use it in the same pass, so the video only gets decoded and scaled once.
+        $filters = "fps=3,${rotate}scale=$scale:flags=lanczos,split[x][y];[x]palettegen[p];[y][p]paletteuse";
+        if (defined $video_preview_seconds) {
+            if (defined $shrunkfname) {
+                $filters = "trim=duration=$video_preview_seconds,$filters";  # the shrunk video needs all of it.
+            } else {
+                # As an input option, -t stops reading the clip there, so long videos don't cost more than short ones.
+                $inopts .= " -t $video_preview_seconds";
+            }
+        }
+        $outopts = '-f gif';
+        $mimetype = 'image/gif';
+    } elsif (thumbnail_by_pngdefry($memo) && defined($base64 = pngdefry_thumbnail($hashedfname, $thumbnail_max_width, $orientation))) {
+        $mimetype = 'image/png';
     } else {
-        read_file($hashedfname, buf_ref => $fdataref, binmode => ':raw', err_mode => 'carp');
+        my $is_gif = $$memo{format} eq 'gif';
+        # force everything to a .jpg thumbnail, except .gifs, since they are well-supported and might be animated.
+        $mimetype = $is_gif ? 'image/gif' : 'image/jpeg';
+        $outopts = $is_gif ? '-f gif' : '-frames:v 1 -f image2pipe -c:v mjpeg';   # Force to one frame, so movies just get a static image, but let animated gifs alone.
+        $filters = "${rotate}scale=$scale";
+    }
+
+    if ((defined $filters) && (defined $shrunkfname)) {
+        my $shrink = shrink_filters($memo);
+        # -map only takes the video it's told about, so bring along the audio, too.
+        $cmdline = "$program_dir/ffmpeg $inopts -i '$hashedfname' -filter_complex \"[0:v]split[t0][s0];[t0]$filters\[t];[s0]$shrink\[s]\" -map '[t]' $outopts pipe:1 -map '[s]' -map '0:a?' '$shrunkfname' 2>/dev/null";
+    } elsif (defined $filters) {
+        $cmdline = "$program_dir/ffmpeg $inopts -i '$hashedfname' -filter_complex '$filters' $outopts pipe:1 2>/dev/null";
+    } elsif (defined $shrunkfname) {
+        fail("BUG: thumbnail_can_shrink() and make_thumbnail() disagree");
+    }
+
+    if (not defined $base64) {
+        dbgprint("generating thumbnail: $cmdline\n");
+        $base64 = pipe_to_base64($cmdline, $orientation);
+        if ((not defined $base64) && (defined $retry_cmdline)) {
+            $cmdline = $retry_cmdline;
+            dbgprint("generating thumbnail again: $cmdline\n");
+            $base64 = pipe_to_base64($cmdline, $orientation);
+        }
+        if (not defined $base64) {
+            unlink($shrunkfname) if defined $shrunkfname;
+            die("ffmpeg failed ('$cmdline')");
+        }
     }
+
+    set_image_orientation($shrunkfname, $orientation, 1) if defined $shrunkfname;
+    return "<center><img src='data:$mimetype;base64,$base64'/></center><br/>\n";
+}
+
+
+# The media for a conversation (thumbnails and attachments) is queued up as
+#  jobs, each a sub that returns a string (or undef), and the results are
+#  taken back one at a time, in the order the jobs were queued. With --jobs=1,
+#  a job just runs when its result is wanted. Otherwise up to $media_jobs
+#  forked workers run ahead of the caller; each one writes its result to a
+#  file in $maildir/tmp, which is read back (and deleted) when it's wanted.
+#  Jobs too cheap to be worth a worker can be run in the parent regardless.
+my @media_queue = ();
+my @media_in_parent = ();
+my $media_started = 0;  # jobs handed to workers so far.
+my $media_taken = 0;  # results given back so far.
+my %media_workers = ();  # pid => job number.
+my %media_status = ();  # job number => worker's exit code, once it's done.
+
+sub media_result_fname {
+    my $jobnum = shift;
+    return "$maildir/tmp/imessage-chatlog-tmp-$$-job-$jobnum";
+}
+
+sub queue_media_job {
+    my ($job, $in_parent) = @_;
+    push @media_queue, $job;
+    push @media_in_parent, $in_parent;
+}
+
+sub start_media_job {
+    my $jobnum = $media_started++;
+    my $job = $media_queue[$jobnum];
+    my $resultfname = media_result_fname($jobnum);
+
+    STDOUT->flush();  # or the worker would print it again.
+    my $pid = fork();
+    fail("Couldn't start a worker: $!") if (not defined $pid);
+
+    if ($pid == 0) {
+        # Our own process group, so reset_media_jobs() can stop the ffmpeg or
+        #  pngdefry we start along with us.
+        setpgrp(0, 0);
+        # A signal must not get us into die() and the parent's END blocks.
+        #  Whatever we're running goes with us.
+        $SIG{INT} = $SIG{TERM} = $SIG{HUP} = sub {
+            $SIG{TERM} = 'IGNORE';
+            kill('TERM', -$$);
+            POSIX::_exit(2);
+        };
+
+        # Exit codes: 0 result written, 1 no result, 2 died (error message written).
+        my $rc = 1;
+        my $result = eval { $job->() };
+        if ($@) {
+            $result = $@;
+            $rc = 2;
+        } elsif (defined $result) {
+            $rc = 0;
+        }
+        if (defined $result) {
+            $rc = 2 if (not write_file($resultfname, { binmode => ':raw', err_mode => 'quiet' }, $result));
+        }
+        STDOUT->flush();
+        POSIX::_exit($rc);  # don't run destructors on the parent's database handles.
+    }
+
+    setpgrp($pid, $pid);  # as the worker does, in case we get to kill it first.
+    dbgprint("media job $jobnum is running in process $pid\n");
+    $media_workers{$pid} = $jobnum;
+}
+
+sub reset_media_jobs {
+    foreach (keys %media_workers) {
+        kill('TERM', -$_);  # the whole group: the worker, and whatever it's running.
+        waitpid($_, 0);
+    }
+    for (my $i = $media_taken; $i < $media_started; $i++) {
+        unlink(media_result_fname($i));
+    }
+    @media_queue = ();
+    @media_in_parent = ();
+    $media_started = 0;
+    $media_taken = 0;
+    %media_workers = ();
+    %media_status = ();
+}
+
+# Workers are in process groups of their own, so a Ctrl-C doesn't reach them.
+END {
+    return if ($$ != $media_parent_pid);
+    local $?;  # waitpid() would change our exit code.
+    reset_media_jobs();
+}
+
+sub next_media_result {
+    my $jobnum = $media_taken++;
+    fail("BUG: no more media jobs") if ($jobnum >= scalar(@media_queue));
+
+    if (($media_jobs == 1) || $media_in_parent[$jobnum]) {
+        my $result = $media_queue[$jobnum]->();
+        $media_queue[$jobnum] = undef;
+        return $result;
+    }
+
+    while (not defined $media_status{$jobnum}) {
+        while ((scalar(keys %media_workers) < $media_jobs) && ($media_started < scalar(@media_queue))) {
+            if ($media_in_parent[$media_started]) {
+                $media_started++;
+            } else {
+                start_media_job();
+            }
+        }
+        my $pid = waitpid(-1, 0);
+        fail("BUG: media job $jobnum never finished") if ($pid <= 0);
+        next if (not defined $media_workers{$pid});
+        $media_status{$media_workers{$pid}} = ($? & 127) ? 2 : ($? >> 8);
+        delete $media_workers{$pid};
+    }
+
+    my $rc = $media_status{$jobnum};
+    my $resultfname = media_result_fname($jobnum);
+    my $result = undef;
+    if ($rc != 1) {
+        read_file($resultfname, buf_ref => \$result, binmode => ':raw', err_mode => 'quiet');
+        unlink($resultfname);
+    }
+    $media_queue[$jobnum] = undef;
+
+    if ($rc == 2) {
+        $result = "media job $jobnum failed\n" if ((not defined $result) or ($result eq ''));
+        reset_media_jobs();
+        die($result);
+    }
+
+    return ($rc == 0) ? $result : undef;
 }
 
 
@@ -301,6 +944,7 @@ my $outhasfromme_sms_a = 0;
 my $output_text = '';
 my $output_html = '';
 my @output_attachments = ();
+my @output_thumbnails = ();  # what we need to make the HTML for each thumbnail marker in $output_html.
 
 sub flush_conversation {
     return if (not defined $outmsgid);
@@ -314,11 +958,176 @@ sub flush_conversation {
         $output_text = '';
         $output_html = '';
         @output_attachments = ();
+        @output_thumbnails = ();
         return;
     }
 
     fail("message id went backwards?!") if ($startids{$outhandle_id} > $outmsgid);
 
+    # Queue up all the media work first, so --jobs workers can get through the
+    #  attachments while we're still waiting on thumbnails. Anything already
+    #  made this run (or about to be, earlier in this conversation) comes from
+    #  %media_memo instead. Attachments are looked at first, so a thumbnail
+    #  job can make the shrunk attachment too, from the same decode.
+    my @found = ();
+    my @probes = ();
+    while (@output_attachments) {
+        my $fname = shift @output_attachments;
+        my $mimetype = shift @output_attachments;
+        my $domain = 'MediaDomain';
+
+        $fname =~ s#\A\~/Library/Messages/## if (!$ios_archive);
+        $fname =~ s#\A\~/##;
+        $fname =~ s#\A/var/mobile/## if ($ios_archive);
+        my $hashedfname = archive_fname($domain, $fname);
+        push @found, [ $fname, $mimetype, $hashedfname, $domain ];
+        if ($mimetype =~ /\A(image|video)\//) {
+            push @probes, [ $hashedfname, $mimetype, (defined $attachment_shrink_percent), (defined $attachment_shrink_percent) ];
+        }
+    }
+    foreach (@output_thumbnails) {
+        my ($hashedfname, $mimetype) = @$_;
+        push @probes, [ $hashedfname, $mimetype, 1, 1 ];
+    }
+    probe_conversation_media(@probes);
+
+    my @attachments = ();
+    foreach (@found) {
+        my ($fname, $mimetype, $hashedfname, $domain) = @$_;
+        my $memo = undef;
+        if ($mimetype =~ /\A(image|video)\//) {
+            $memo = probe_media($hashedfname, $mimetype, defined $attachment_shrink_percent);
+        }
+        my $cachefname = undef;
+        my $shrink = 'no';  # or 'new', or 'reuse' something shrunk already.
+
+        if ((defined $attachment_shrink_percent) && (defined $memo)) {
+            my $basefname = $fname;
+            $basefname =~ s#.*/##;
+            if ($$memo{shrunk_cached} && (not -f $$memo{shrunkfname})) {
+                # trim_media_cache() took it since we last used it.
+                delete $$memo{shrunkfname};
+                delete $$memo{shrunk_cached};
+            }
+            if ((not defined $$memo{shrunk}) && (not defined $$memo{shrunkfname})) {
+                # ffmpeg picks the output format from the file extension.
+                my $ext = ($basefname =~ /(\.[^.]*)\Z/) ? lc($1) : '';
+                $cachefname = media_cache_fname($memo, $hashedfname, "shrink percent=$attachment_shrink_percent ext=$ext");
+                if ((defined $cachefname) && (-f $cachefname)) {
+                    utime(undef, undef, $cachefname);
+                    $$memo{shrunkfname} = $cachefname;
+                    $$memo{shrunk_cached} = 1;
+                    $cachefname = undef;
+                }
+            }
+            if (defined $$memo{shrunk}) {
+                dbgprint("Reusing shrunk attachment of memo $$memo{used}.\n");
+                $shrink = 'reuse';
+            } elsif (defined $$memo{shrunkfname}) {
+                dbgprint("Reusing shrunk attachment '$$memo{shrunkfname}'.\n");
+                $shrink = 'reuse';
+            } else {
+                # Where ffmpeg writes it, if it can't use a pipe. Piped images
+                #  stay in memory, or go straight into the media cache.
+                $media_memo_files++;
+                $$memo{shrunkfname} = "$maildir/tmp/imessage-chatlog-tmp-$$-attachment-shrink-$media_memo_files-$basefname";
+                $$memo{shrink_unclaimed} = 1;
+                $shrink = 'new';
+            }
+        }
+        push @attachments, [ $fname, $mimetype, $memo, $cachefname, $hashedfname, $domain, $shrink ];
+    }
+
+    my @thumbnails = ();
+    while (@output_thumbnails) {
+        my ($hashedfname, $mimetype, $fnameimg) = @{shift @output_thumbnails};
+        my $memo = probe_media($hashedfname, $mimetype, 1);
+        my $has_job = 0;
+        my $cachefname = undef;
+        if ((defined $memo) && (not defined $$memo{thumbnail}) && (not $$memo{thumbnail_queued})) {
+            my $html = undef;
+            my $settings = "thumbnail width=$thumbnail_max_width fps=3";
+            if ($mimetype =~ /\Avideo\//) {
+                $settings .= " video=$video_preview";
+                $settings .= " seconds=$video_preview_seconds" if defined $video_preview_seconds;
+            }
+            $cachefname = media_cache_fname($memo, $hashedfname, $settings);
+            if (read_media_cache($cachefname, \$html)) {
+                $$memo{thumbnail} = $html;
+                media_memo_add_bytes($memo, length($html));
+            } else {
+                my $shrunkfname = undef;
+                if ($$memo{shrink_unclaimed} && thumbnail_can_shrink($mimetype, $memo)) {
+                    $shrunkfname = $$memo{shrunkfname};
+                    delete $$memo{shrink_unclaimed};
+                    $$memo{shrink_claimed} = 1;
+                }
+                queue_media_job(sub { return make_thumbnail($hashedfname, $mimetype, $memo, $shrunkfname); });
+                $$memo{thumbnail_queued} = 1;
+                $has_job = 1;
+            }
+        }
+        push @thumbnails, [ $memo, $has_job, $fnameimg, $cachefname ];
+    }
+
+    foreach (@attachments) {
+        my ($fname, $mimetype, $memo, $cachefname, $hashedfname, $domain, $shrink) = @$_;
+        if (($shrink eq 'reuse') || (($shrink eq 'new') && $$memo{shrink_claimed})) {
+            queue_media_job(sub {
+                my $fdata = undef;
+                # not until now: it might not be made yet, or have moved into memory or the media cache meanwhile.
+                return $$memo{shrunk} if defined $$memo{shrunk};
+                return undef if not defined $$memo{shrunkfname};  # making it failed.
+                read_file($$memo{shrunkfname}, buf_ref => \$fdata, binmode => ':raw', err_mode => 'carp');
+                return $fdata;
+            }, 1);
+            next;
+        }
+
+        queue_media_job(sub {
+            my $fdata = undef;
+            if (not -f $hashedfname) {
+                if ($ios_archive) {
+                    print STDERR "WARNING: Missing attachment '$hashedfname' ('$domain', '$fname')\n";
+                } else {
+                    print STDERR "WARNING: Missing attachment '$hashedfname'\n";
+                }
+            } else {
+                load_attachment($fname, $hashedfname, \$fdata, $mimetype, $memo);
+                if ($ios_archive) {
+                    print STDERR "WARNING: Failed to load '$hashedfname' ('$domain', '$fname')\n" if (not defined $fdata);
+                } else {
+                    print STDERR "WARNING: Failed to load '$hashedfname'\n" if (not defined $fdata);
+                }
+            }
+            return $fdata;
+        });
+    }
+    foreach (@attachments) {
+        my $memo = $$_[2];
+        next if not defined $memo;
+        delete $$memo{shrink_unclaimed};
+        delete $$memo{shrink_claimed};
+    }
+
+    for (my $i = 0; $i < scalar(@thumbnails); $i++) {
+        my ($memo, $has_job, $fnameimg, $cachefname) = @{$thumbnails[$i]};
+        my $html;
+        if (not defined $memo) {
+            $html = "[Missing image '$fnameimg']<br/>\n";
+        } elsif ($has_job) {
+            $html = next_media_result();
+            $$memo{thumbnail} = $html;
+            media_memo_add_bytes($memo, length($html)) if defined $html;
+            delete $$memo{thumbnail_queued};
+            # don't keep failures around for next time; they might have been a fluke.
+            write_media_cache($cachefname, $html) if ((defined $cachefname) && ($html =~ /\A<center><img /));
+        } else {
+            $html = $$memo{thumbnail};
+        }
+        $output_html =~ s#\x00thumbnail-$i\x00#$html#;
+    }
+
     $output_text =~ s/\A\n+//;
     $output_text =~ s/\n+\Z//;
 
@@ -334,7 +1143,7 @@ sub flush_conversation {
     my $mimeboundarymixed = "mime_imessage_mixed_$mimesha1";
     my $mimeboundaryalt = "mime_imessage_alt_$mimesha1";
 
-    my $has_attachments = scalar(@output_attachments) > 0;
+    my $has_attachments = scalar(@attachments) > 0;
     my $is_mime = $allow_html || $has_attachments;
     my $content_type_mixed = "multipart/mixed; boundary=\"$mimeboundarymixed\"";
     my $content_type_alt = $allow_html ? "multipart/alternative; boundary=\"$mimeboundaryalt\"; charset=\"utf-8\"" : 'text/plain; charset="utf-8"';
@@ -359,7 +1168,7 @@ EOF
         print TMPEMAIL "This is a multipart message in MIME format.\n\n";
     }
 
-    if (@output_attachments) {
+    if (@attachments) {
         print TMPEMAIL <<EOF
 --$mimeboundarymixed
 Content-Type: $content_type_alt
@@ -526,31 +1335,37 @@ EOF
 
     }
 
-    if (@output_attachments) {
+    if (@attachments) {
         my %used_fnames = ();
-        while (@output_attachments) {
-            my $fname = shift @output_attachments;
-            my $mimetype = shift @output_attachments;
-            my $domain = 'MediaDomain';
-
-            $fname =~ s#\A\~/Library/Messages/## if (!$ios_archive);
-            $fname =~ s#\A\~/##;
-            $fname =~ s#\A/var/mobile/## if ($ios_archive);
-            my $hashedfname = archive_fname($domain, $fname);
-
-            my $fdata = undef;
-            if (not -f $hashedfname) {
-                if ($ios_archive) {
-                    print STDERR "WARNING: Missing attachment '$hashedfname' ('$domain', '$fname')\n";
-                } else {
-                    print STDERR "WARNING: Missing attachment '$hashedfname'\n";
+        foreach (@attachments) {
+            my ($fname, $mimetype, $memo, $cachefname, undef, undef, $shrink) = @$_;
+            my $fdata = next_media_result();
+
+            # A newly shrunk attachment goes into the media cache for next
+            #  time, or if that won't keep it, stays in memory. Only what
+            #  ffmpeg had to write to a file is in $maildir/tmp, and that
+            #  is moved or deleted now.
+            if ($shrink eq 'new') {
+                my $tmpfname = $$memo{shrunkfname};
+                my $cached = 0;
+                if ((defined $fdata) && (defined $cachefname)) {
+                    if (-f $tmpfname) {
+                        $cached = move($tmpfname, $cachefname);
+                        $media_cache_bytes += length($fdata) if $cached;
+                    } else {
+                        $cached = write_media_cache($cachefname, $fdata);
+                    }
                 }
-            } else {
-                load_attachment($fname, $hashedfname, \$fdata, $mimetype);
-                if ($ios_archive) {
-                    print STDERR "WARNING: Failed to load '$hashedfname' ('$domain', '$fname')\n" if (not defined $fdata);
+                unlink($tmpfname) if (not $cached);
+                if ($cached) {
+                    $$memo{shrunkfname} = $cachefname;
+                    $$memo{shrunk_cached} = 1;
                 } else {
-                    print STDERR "WARNING: Failed to load '$hashedfname'\n" if (not defined $fdata);
+                    delete $$memo{shrunkfname};
+                    if (defined $fdata) {
+                        $$memo{shrunk} = $fdata;
+                        media_memo_add_bytes($memo, length($fdata));
+                    }
                 }
             }
 
@@ -599,7 +1414,9 @@ EOF
 
     $output_text = '';
     $output_html = '';
-    @output_attachments = ();
+    reset_media_jobs();
+    trim_media_memo();
+    trim_media_cache() if ($media_cache_bytes > $media_cache_mb * 1024 * 1024);
 
     my $size = (stat($tmpemail))[7];
     my $t = $outtimestamp;
@@ -650,6 +1467,12 @@ mkdir("$maildir/tmp", 0700);
 mkdir("$maildir/cur", 0700);
 mkdir("$maildir/new", 0700);
 
+if ($media_cache_mb > 0) {
+    $media_cache_dir = "$maildir/imessage_media_cache";
+    mkdir($media_cache_dir, 0700);
+    trim_media_cache();  # in case --cache-size went down, and to learn how big it is.
+}
+
 $lastarchivetmpfname = "$maildir/tmp_imessage_last_archive_msgids.txt";
 unlink($lastarchivetmpfname);
 
@@ -1068,6 +1891,7 @@ while (my @row = $stmt->fetchrow_array()) {
         $output_text = '';
         $output_html = '';
         @output_attachments = ();
+        @output_thumbnails = ();
 
         if (defined $subject) {
             chomp($subject);
@@ -1161,64 +1985,12 @@ while (my @row = $stmt->fetchrow_array()) {
                         }
                         $htmltext =~ s#\xEF\xBF\xBC#[Missing image '$fnameimg']<br/>\n#;
                     } else {
-                        # Temporary hack to make iPhone PNGs ( http://iphonedevwiki.net/index.php/CgBI_file_format ) look like normal PNGs.
-                        if ($is_image) {
-                            system("$program_dir/pngdefry -s-defried '$hashedfname' >/dev/null");
-                            move("$hashedfname-defried.png", $hashedfname) if ( -f "$hashedfname-defried.png");
-                        }
-
+                        # The thumbnail is made when the conversation is flushed, maybe in
+                        #  parallel with others (see --jobs); leave a marker for it until then.
                         $fnameimg =~ s#.*/##;
-                        my $orientation = get_image_orientation($hashedfname);
-
-                        my $scale="$thumbnail_max_width:-1";
-                        # Orientations 5-8 mean rotation between portrait and landscape, so we have to resize the "height" as it will actually be the width at the end.
-                        if ((defined $orientation) && (($orientation >= 5) && ($orientation <= 8))) {
-                            $scale="-1:$thumbnail_max_width";
-                        }
-
-                        my $outfname = "$maildir/tmp/imessage-chatlog-tmp-$$-$msgid-$fnameimg";
-                        my $palettefname = undef;
-                        my $cmdline;
-                        if ($is_video) {
-                            $outfname .= '.gif';
-                            $palettefname = "$maildir/tmp/imessage-chatlog-tmp-$$-$msgid-palette-$fnameimg.png";
-                            $cmdline = "$program_dir/ffmpeg -y -i '$hashedfname' -vf 'fps=3,scale=$scale:flags=lanczos,palettegen' '$palettefname' 2>/dev/null";
-                            dbgprint("Generating optimal palette for video->gif ($cmdline)...\n");
-                            unlink($palettefname), die("ffmpeg failed ('$cmdline')") if (system($cmdline) != 0);
-                            $cmdline = "$program_dir/ffmpeg -i '$hashedfname' -i '$palettefname' -filter_complex 'fps=3,scale=$scale:flags=lanczos[x];[x][1:v]paletteuse' '$outfname' 2>/dev/null";
-                            $mimetype = 'image/gif';
-                        } else {
-                            my $is_jpeg = check_jpegness($mimetype, $hashedfname);
-                            my $is_gif = $mimetype eq 'image/gif';
-                            my $ext = $is_gif ? '.gif' : '.jpg';   # force everything to a .jpg thumbnail, except .gifs, since they are well-supported and might be animated.
-                            $mimetype = $is_gif ? 'image/gif' : 'image/jpeg';
-                            my $frames = $is_gif ? '' : '-frames 1';   # Force to one frame, so movies just get a static image, but let animated gifs alone.
-                            my $fmt = $is_jpeg ? '-f mjpeg' : '';
-                            $outfname .= $ext;
-                            $cmdline = "$program_dir/ffmpeg $fmt -i '$hashedfname' $frames -vf 'scale=$scale' '$outfname' 2>/dev/null";
-                        }
-
-                        dbgprint("generating thumbnail: $cmdline\n");
-                        if (system($cmdline) != 0) {
-                            unlink($palettefname) if defined $palettefname;
-                            unlink($outfname);
-                            die("ffmpeg failed ('$cmdline')");
-                        }
-                        unlink($palettefname) if defined $palettefname;
-
-                        set_image_orientation($outfname, $orientation, 1);
-                        my $fdata = undef;
-                        if ((not defined read_file($outfname, buf_ref => \$fdata, binmode => ':raw', err_mode => 'carp')) or (not defined $fdata)) {
-                            unlink($outfname);
-                            print STDERR "Couldn't read scaled attachment '$outfname': $!";
-                            $htmltext =~ s#\xEF\xBF\xBC#[Failed to scale image '$fnameimg']<br/>\n#;
-                        } else {
-                            unlink($outfname);
-                            my $base64 = encode_base64($fdata);
-                            $fdata = undef;
-                            $htmltext =~ s#\xEF\xBF\xBC#<center><img src='data:$mimetype;base64,$base64'/></center><br/>\n#;
-                            $base64 = undef;
-                        }
+                        my $thumbnail = scalar(@output_thumbnails);
+                        push @output_thumbnails, [ $hashedfname, $mimetype, $fnameimg ];
+                        $htmltext =~ s#\xEF\xBF\xBC#\x00thumbnail-$thumbnail\x00#;
                     }
                 } else {
                     $htmltext =~ s#\xEF\xBF\xBC#[attachment $shortfname]<br/>\n#;
@@ -0,0 +1,312 @@
+/* decode.c - full image decoding, for thumbnails (-t) and raw pixel output (--raw)
+   Part of pngdefry; included by pngdefry.c, after dispatch.c.
+
+	Inflates and un-filters the image data in the current pngChunks, de-fries it if
+	needed, and converts every row to 8 bit samples: gray, gray+alpha, RGB or RGBA,
+	depending on the color type and tRNS. 16 bit samples are cut down to their
+	high byte. Palette images come out as RGB(A).
+
+	The image data is inflated through the 32K window of the shared inflator, as
+	stream.c does, and rows are handed to a callback, top to bottom, as soon as
+	they are complete. Non-interlaced images hold only two rows of data; interlaced
+	images are put together in full (as 8 bit samples) first.
+
+	-iphone RGBA rows are passed on still premultiplied (see 'premultiplied').
+*/
+
+struct decoder_t {
+	unsigned int wide, high;
+	unsigned int bitdepth, colortype, interlace;
+	int isPhoney;
+	int chans;			/* 1..4: gray, gray+alpha, RGB, RGBA */
+	int has_alpha;		/* last channel is alpha */
+	int premultiplied;	/* color is multiplied by alpha (-iphone RGBA) */
+	int swap;			/* BGR(A) to RGB(A) */
+
+	unsigned char *palette;
+	int palette_entries;
+	unsigned char *trns;
+	int trns_length;
+};
+
+/*	Returns 0, or -4 for a missing PLTE */
+int init_decoder (struct decoder_t *d, int isPhoney, unsigned int imgwidth, unsigned int imgheight, unsigned int bitdepth, unsigned int colortype, unsigned int interlace)
+{
+	int i;
+
+	memset (d, 0, sizeof(*d));
+	d->wide = imgwidth;
+	d->high = imgheight;
+	d->bitdepth = bitdepth;
+	d->colortype = colortype;
+	d->interlace = interlace;
+	d->isPhoney = isPhoney;
+
+	for (i=0; i<num_chunks; i++)
+	{
+		if (pngChunks[i].id == 0x504C5445)	/* "PLTE" */
+		{
+			d->palette = pngChunks[i].data+4;
+			d->palette_entries = pngChunks[i].length/3;
+		}
+		if (pngChunks[i].id == 0x74524E53)	/* "tRNS" */
+		{
+			d->trns = pngChunks[i].data+4;
+			d->trns_length = pngChunks[i].length;
+		}
+	}
+
+	switch (colortype)
+	{
+		case 0:
+			d->chans = d->trns_length >= 2 ? 2 : 1;
+			break;
+		case 2:
+			d->chans = d->trns_length >= 6 ? 4 : 3;
+			break;
+		case 3:
+			if (d->palette == NULL || d->palette_entries == 0)
+				return -4;
+			d->chans = d->trns_length > 0 ? 4 : 3;
+			break;
+		case 4:
+			d->chans = 2;
+			break;
+		case 6:
+			d->chans = 4;
+			break;
+	}
+	d->has_alpha = !(d->chans & 1);
+
+	/* only 8 bit RGB(A) gets fried */
+	if (isPhoney && bitdepth == 8 && (colortype == 2 || colortype == 6))
+	{
+		d->swap = 1;
+		d->premultiplied = colortype == 6 && flag_UpdateAlpha;
+	}
+	return 0;
+}
+
+/*	Convert one row of 'wide' unfiltered pixels, in any PNG format, to 8 bit samples */
+void convert_row (struct decoder_t *d, unsigned char *dst, const unsigned char *src, unsigned int wide)
+{
+	unsigned int x, v, c;
+	int depth = d->bitdepth, chans = d->chans;
+	unsigned char *start = dst;
+
+	switch (d->colortype)
+	{
+		case 0:		/* gray, 1..16 bits */
+		case 3:		/* palette, 1..8 bits */
+			for (x=0; x<wide; x++)
+			{
+				if (depth == 16)
+					v = (src[2*x] << 8) | src[2*x+1];
+				else if (depth == 8)
+					v = src[x];
+				else
+					v = (src[(x*depth) >> 3] >> (8 - depth - ((x*depth) & 7))) & ((1 << depth)-1);
+				if (d->colortype == 3)
+				{
+					if ((int)v < d->palette_entries)
+					{
+						dst[0] = d->palette[3*v];
+						dst[1] = d->palette[3*v+1];
+						dst[2] = d->palette[3*v+2];
+					} else
+						dst[0] = dst[1] = dst[2] = 0;
+					if (chans == 4)
+						dst[3] = (int)v < d->trns_length ? d->trns[v] : 255;
+				} else
+				{
+					if (depth == 16)
+						dst[0] = v >> 8;
+					else
+						dst[0] = v * 255 / ((1 << depth)-1);
+					if (chans == 2)
+						dst[1] = (v == (unsigned int)((d->trns[0] << 8) | d->trns[1])) ? 0 : 255;
+				}
+				dst += chans;
+			}
+			break;
+		case 2:		/* RGB, 8 or 16 bits */
+			if (chans == 3 && depth == 8)
+			{
+				memcpy (dst, src, 3*wide);
+				break;
+			}
+			for (x=0; x<wide; x++)
+			{
+				if (depth == 16)
+				{
+					for (c=0; c<3; c++)
+						dst[c] = src[6*x+2*c];
+					if (chans == 4)
+						dst[3] = memcmp (src+6*x, d->trns, 6) ? 255 : 0;
+				} else
+				{
+					dst[0] = src[3*x];
+					dst[1] = src[3*x+1];
+					dst[2] = src[3*x+2];
+					/* tRNS always holds 16 bit values */
+					if (chans == 4)
+						dst[3] = (!d->trns[0] && src[3*x] == d->trns[1] &&
+							!d->trns[2] && src[3*x+1] == d->trns[3] &&
+							!d->trns[4] && src[3*x+2] == d->trns[5]) ? 0 : 255;
+				}
+				dst += chans;
+			}
+			break;
+		case 4:		/* gray+alpha, 8 or 16 bits */
+		case 6:		/* RGBA, 8 or 16 bits */
+			if (depth == 8)
+				memcpy (dst, src, chans*wide);
+			else
+			{
+				for (x=0; x<chans*wide; x++)
+					dst[x] = src[2*x];
+			}
+			break;
+	}
+	if (d->swap)
+		swap_pixels (start, wide, chans);
+}
+
+/*	Decode the image, calling row_out for each row of d->wide pixels.
+	The row may be changed by row_out. Returns 0, or a negative error code:
+	-1 out of memory, -2 decompression error, -3 unknown row filter */
+int decode_image (struct decoder_t *d, void (*row_out) (void *user, unsigned char *row), void *user)
+{
+	int Starting_Row [] =  { 0, 0, 4, 0, 2, 0, 1 };
+	int Starting_Col [] =  { 0, 4, 0, 2, 0, 1, 0 };
+	int Row_Increment [] = { 8, 8, 8, 4, 4, 2, 2 };
+	int Col_Increment [] = { 8, 8, 4, 4, 2, 2, 1 };
+	unsigned int pass_wide[7], pass_high[7];
+	size_t pass_bytes[7];
+	int num_passes;
+
+	tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+	size_t in_pos, in_bytes, out_pos = 0, out_bytes, row_pos = 0, rowbytes, piece;
+	unsigned int samples, bitspp, filter_bpp;
+	unsigned int x, y, w, h = 0;
+	int i, pass, result, flags;
+	unsigned char *out, *row, *prev, *swap, *line, *image;
+
+	samples = d->colortype == 2 ? 3 : d->colortype == 4 ? 2 : d->colortype == 6 ? 4 : 1;
+	bitspp = samples*d->bitdepth;
+	filter_bpp = bitspp < 8 ? 1 : bitspp/8;
+
+	if (d->interlace == 1)
+	{
+		num_passes = 7;
+		for (pass=0; pass<7; pass++)
+		{
+			pass_wide[pass] = (d->wide - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
+			pass_high[pass] = (d->high - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
+			pass_bytes[pass] = ((size_t)pass_wide[pass]*bitspp+7)/8;
+		}
+	} else
+	{
+		num_passes = 1;
+		pass_wide[0] = d->wide;
+		pass_high[0] = d->high;
+		pass_bytes[0] = ((size_t)d->wide*bitspp+7)/8;
+	}
+
+	/* the current and the previous row, filter byte first; no pass is wider than the image */
+	rowbytes = ((size_t)d->wide*bitspp+7)/8 + 1;
+	row = (unsigned char *)malloc (rowbytes);
+	prev = (unsigned char *)malloc (rowbytes);
+	line = (unsigned char *)malloc ((size_t)d->wide * d->chans);
+	image = d->interlace == 1 ? (unsigned char *)malloc ((size_t)d->wide * d->high * d->chans) : NULL;
+	result = 0;
+	if (!row || !prev || !line || (d->interlace == 1 && !image))
+		result = -1;
+
+	/* zero sized passes have no rows at all, not even filter bytes */
+	pass = 0;
+	while (pass < num_passes && (pass_wide[pass] == 0 || pass_high[pass] == 0))
+		pass++;
+	rowbytes = pass < num_passes ? pass_bytes[pass]+1 : 0;
+
+	/* inflate through the 32K window, a chunk at a time, as stream_image does */
+	flags = TINFL_FLAG_HAS_MORE_INPUT | (d->isPhoney ? 0 : TINFL_FLAG_PARSE_ZLIB_HEADER);
+	tinfl_init (&inflator);
+	for (i=0; i<num_chunks && !result && status != TINFL_STATUS_DONE; i++)
+	{
+		if (pngChunks[i].id != 0x49444154)	/* "IDAT" */
+			continue;
+		in_pos = 0;
+		do
+		{
+			in_bytes = pngChunks[i].length - in_pos;
+			out_bytes = TINFL_LZ_DICT_SIZE - out_pos;
+			status = tinfl_decompress (&inflator, pngChunks[i].data+4+in_pos, &in_bytes, inflate_window, inflate_window+out_pos, &out_bytes, flags);
+			in_pos += in_bytes;
+			if (status < 0)
+			{
+				result = -2;
+				break;
+			}
+
+			out = inflate_window+out_pos;
+			out_pos = (out_pos + out_bytes) & (TINFL_LZ_DICT_SIZE-1);
+			while (out_bytes && !result)
+			{
+				if (pass == num_passes)
+				{
+					result = -2;
+					break;
+				}
+				piece = rowbytes - row_pos < out_bytes ? rowbytes - row_pos : out_bytes;
+				memcpy (row+row_pos, out, piece);
+				out += piece;
+				out_bytes -= piece;
+				row_pos += piece;
+				if (row_pos < rowbytes)
+					continue;
+				row_pos = 0;
+
+				if (*row > 4)
+				{
+					result = -3;
+					break;
+				}
+				unfilter_row (*row, row+1, h ? prev+1 : NULL, (int)pass_bytes[pass], filter_bpp);
+				convert_row (d, line, row+1, pass_wide[pass]);
+				if (image)
+				{
+					y = Starting_Row[pass] + h*Row_Increment[pass];
+					for (w=0; w<pass_wide[pass]; w++)
+					{
+						x = Starting_Col[pass] + w*Col_Increment[pass];
+						memcpy (image + ((size_t)y*d->wide + x)*d->chans, line + w*d->chans, d->chans);
+					}
+				} else
+					row_out (user, line);
+				swap = row;
+				row = prev;
+				prev = swap;
+
+				if (++h == pass_high[pass])
+				{
+					h = 0;
+					do
+						pass++;
+					while (pass < num_passes && (pass_wide[pass] == 0 || pass_high[pass] == 0));
+					rowbytes = pass < num_passes ? pass_bytes[pass]+1 : 0;
+				}
+			}
+		} while (!result && (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && in_pos < pngChunks[i].length)));
+	}
+	if (!result && (status != TINFL_STATUS_DONE || pass != num_passes))
+		result = -2;
+
+	for (y=0; image && y<d->high && !result; y++)
+		row_out (user, image + (size_t)y*d->wide*d->chans);
+	free (image);
+	free (line);
+	free (prev);
+	free (row);
+	return result;
+}
@@ -0,0 +1,853 @@
+/* dispatch.c - CPU specific variants of pngdefry's per-pixel loops
+   Part of pngdefry; included by pngdefry.c, after miniz.c and the CRC table.
+
+	Each loop comes in a plain C version, which is also the reference: all other
+	versions must produce exactly the same bytes. bind_cpu_variants() is called once
+	at startup. It probes the processor (through miniz's mz_cpu_features) and points
+	the function pointers below at the fastest versions available.
+
+	The environment variable PNGDEFRY_CPU=scalar|sse2|ssse3|sse41|avx2 caps the level
+	used, for testing and benchmarking. It cannot go above what the processor supports.
+*/
+
+const char *cpu_level_names[] = { "scalar", "sse2", "ssse3", "sse41", "avx2" };
+
+int cpu_level = MZ_CPU_LEVEL_SCALAR;
+
+/** Function pointers, set by bind_cpu_variants() **/
+
+/* CRC32 of a block, on a running 'c' (no pre- or post-conditioning) */
+unsigned int (*crc32_block) (unsigned int c, const unsigned char *buf, size_t length);
+/* Swap bytes 0 and 2 of 'count' pixels, 'bytespp' bytes each */
+void (*swap_pixels) (unsigned char *data, int count, int bytespp);
+/* Undo premultiplied alpha for 'count' RGBA pixels */
+void (*demultiply_pixels) (unsigned char *data, int count);
+/* AND of the alpha bytes of 'count' RGBA pixels; 255 means all opaque */
+int (*alpha_and) (const unsigned char *data, int count);
+/* RGBA to RGB for 'count' pixels; 'dst' may be the same as 'src', or before it */
+void (*strip_alpha) (unsigned char *dst, const unsigned char *src, int count);
+/* Undo/redo a row filter; 'prev' is the unfiltered row above */
+void (*unfilter_funcs[5]) (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp);
+void (*refilter_funcs[5]) (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp);
+
+
+/** Plain C versions **/
+
+unsigned int crc32_block_scalar (unsigned int c, const unsigned char *buf, size_t length)
+{
+	size_t i;
+	for (i=0; i < length; i++)
+		c = CRC_256[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+	return c;
+}
+
+void swap_pixels_scalar (unsigned char *data, int count, int bytespp)
+{
+	int x, b;
+
+	for (x=0; x<count; x++)
+	{
+		b = data[2];
+		data[2] = data[0];
+		data[0] = b;
+		data += bytespp;
+	}
+}
+
+void demultiply_pixels_scalar (unsigned char *data, int count)
+{
+	int x;
+
+	for (x=0; x<4*count; x+=4)
+	{
+		if (data[x+3])
+		{
+			data[x] = (data[x]*255+(data[x+3]>>1))/data[x+3];
+			data[x+1] = (data[x+1]*255+(data[x+3]>>1))/data[x+3];
+			data[x+2] = (data[x+2]*255+(data[x+3]>>1))/data[x+3];
+		}
+	}
+}
+
+int alpha_and_scalar (const unsigned char *data, int count)
+{
+	int x, a = 255;
+
+	for (x=0; x<count; x++)
+		a &= data[4*x+3];
+	return a;
+}
+
+void strip_alpha_scalar (unsigned char *dst, const unsigned char *src, int count)
+{
+	int x;
+
+	for (x=0; x<count; x++)
+	{
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst += 3;
+		src += 4;
+	}
+}
+
+int paeth_predictor (int a, int b, int c)
+{
+	int p, pa, pb, pc;
+
+	p = a + b - c;
+	pa = p - a; if (pa < 0) pa = -pa;
+	pb = p - b; if (pb < 0) pb = -pb;
+	pc = p - c; if (pc < 0) pc = -pc;
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+void filter_none (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+}
+
+void unfilter_sub_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=bpp; x<rowbytes; x++)
+		row[x] += row[x-bpp];
+}
+
+void unfilter_up_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=0; x<rowbytes; x++)
+		row[x] += prev[x];
+}
+
+void unfilter_average_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=0; x<bpp && x<rowbytes; x++)
+		row[x] += prev[x]>>1;
+	for (; x<rowbytes; x++)
+		row[x] += (row[x-bpp] + prev[x])>>1;
+}
+
+void unfilter_paeth_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=0; x<bpp && x<rowbytes; x++)
+		row[x] += prev[x];
+	for (; x<rowbytes; x++)
+		row[x] += paeth_predictor (row[x-bpp], prev[x], prev[x-bpp]);
+}
+
+/*	Re-filtering runs right to left, so the pixel to the left is still unfiltered
+	when it's needed. The row above must not have been re-filtered yet either! */
+void refilter_sub_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=rowbytes-1; x>=bpp; x--)
+		row[x] -= row[x-bpp];
+}
+
+void refilter_up_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=rowbytes-1; x>=0; x--)
+		row[x] -= prev[x];
+}
+
+void refilter_average_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=rowbytes-1; x>=bpp; x--)
+		row[x] -= (row[x-bpp] + prev[x])>>1;
+	for (; x>=0; x--)
+		row[x] -= prev[x]>>1;
+}
+
+void refilter_paeth_scalar (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+	for (x=rowbytes-1; x>=bpp; x--)
+		row[x] -= paeth_predictor (row[x-bpp], prev[x], prev[x-bpp]);
+	for (; x>=0; x--)
+		row[x] -= prev[x];
+}
+
+/*	The first row has no row above it (it counts as all zeroes). Up then does nothing,
+	Paeth is the same as Sub, and Average only adds half of the left pixel. */
+void unfilter_row (int rowfilter, unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	if (prev)
+	{
+		unfilter_funcs[rowfilter] (row, prev, rowbytes, bpp);
+		return;
+	}
+	switch (rowfilter)
+	{
+		case 1:	// Sub
+		case 4:	// Paeth
+			unfilter_funcs[1] (row, NULL, rowbytes, bpp);
+			break;
+		case 3:	// Average
+			for (x=bpp; x<rowbytes; x++)
+				row[x] += row[x-bpp]>>1;
+			break;
+	}
+}
+
+void refilter_row (int rowfilter, unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	if (prev)
+	{
+		refilter_funcs[rowfilter] (row, prev, rowbytes, bpp);
+		return;
+	}
+	switch (rowfilter)
+	{
+		case 1:	// Sub
+		case 4:	// Paeth
+			refilter_funcs[1] (row, NULL, rowbytes, bpp);
+			break;
+		case 3:	// Average
+			for (x=rowbytes-1; x>=bpp; x--)
+				row[x] -= row[x-bpp]>>1;
+			break;
+	}
+}
+
+
+#if MINIZ_X86_SIMD
+
+/** SSE2 **/
+
+MZ_TARGET("sse2") __m128i load32_sse2 (const unsigned char *p)
+{
+	int v;
+	memcpy (&v, p, 4);
+	return _mm_cvtsi32_si128 (v);
+}
+
+MZ_TARGET("sse2") void store32_sse2 (unsigned char *p, __m128i v)
+{
+	int i = _mm_cvtsi128_si32 (v);
+	memcpy (p, &i, 4);
+}
+
+MZ_TARGET("sse2") void demultiply_pixels_sse2 (unsigned char *data, int count)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i alpha_lane = _mm_setr_epi32 (0, 0, 0, -1);
+	const __m128i low_byte = _mm_set1_epi32 (0xff);
+	__m128i v, lo, hi, px[4], alpha, num, q, keep;
+	int x, i;
+
+	for (x=0; x+4 <= count; x+=4, data+=16)
+	{
+		v = _mm_loadu_si128 ((const __m128i *)data);
+		lo = _mm_unpacklo_epi8 (v, zero);
+		hi = _mm_unpackhi_epi8 (v, zero);
+		px[0] = _mm_unpacklo_epi16 (lo, zero);
+		px[1] = _mm_unpackhi_epi16 (lo, zero);
+		px[2] = _mm_unpacklo_epi16 (hi, zero);
+		px[3] = _mm_unpackhi_epi16 (hi, zero);
+		/*	(c*255 + a/2)/a is below 2^24, so the float division is exact enough to truncate */
+		for (i=0; i<4; i++)
+		{
+			alpha = _mm_shuffle_epi32 (px[i], 0xff);
+			num = _mm_add_epi32 (_mm_sub_epi32 (_mm_slli_epi32 (px[i], 8), px[i]), _mm_srli_epi32 (alpha, 1));
+			q = _mm_cvttps_epi32 (_mm_div_ps (_mm_cvtepi32_ps (num), _mm_cvtepi32_ps (alpha)));
+			keep = _mm_or_si128 (_mm_cmpeq_epi32 (alpha, zero), alpha_lane);
+			px[i] = _mm_and_si128 (_mm_or_si128 (_mm_and_si128 (keep, px[i]), _mm_andnot_si128 (keep, q)), low_byte);
+		}
+		v = _mm_packus_epi16 (_mm_packs_epi32 (px[0], px[1]), _mm_packs_epi32 (px[2], px[3]));
+		_mm_storeu_si128 ((__m128i *)data, v);
+	}
+	demultiply_pixels_scalar (data, count-x);
+}
+
+MZ_TARGET("sse2") int alpha_and_sse2 (const unsigned char *data, int count)
+{
+	__m128i acc = _mm_set1_epi8 (-1);
+	int x, a;
+
+	for (x=0; x+4 <= count; x+=4)
+		acc = _mm_and_si128 (acc, _mm_loadu_si128 ((const __m128i *)(data+4*x)));
+	/* fold the four alpha bytes (3, 7, 11, 15) into byte 3 */
+	acc = _mm_and_si128 (acc, _mm_srli_si128 (acc, 8));
+	acc = _mm_and_si128 (acc, _mm_srli_si128 (acc, 4));
+	a = (_mm_cvtsi128_si32 (acc) >> 24) & 0xff;
+	return a & alpha_and_scalar (data+4*x, count-x);
+}
+
+MZ_TARGET("sse2") void unfilter_sub_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	__m128i v, carry = _mm_setzero_si128 ();
+	int x = 0;
+
+	if (bpp != 4)
+	{
+		unfilter_sub_scalar (row, prev, rowbytes, bpp);
+		return;
+	}
+	/* prefix sum of four pixels at a time */
+	for (; x+16 <= rowbytes; x+=16)
+	{
+		v = _mm_loadu_si128 ((const __m128i *)(row+x));
+		v = _mm_add_epi8 (v, _mm_slli_si128 (v, 4));
+		v = _mm_add_epi8 (v, _mm_slli_si128 (v, 8));
+		v = _mm_add_epi8 (v, carry);
+		_mm_storeu_si128 ((__m128i *)(row+x), v);
+		carry = _mm_shuffle_epi32 (v, 0xff);
+	}
+	if (x == 0)
+		x = 4;
+	for (; x<rowbytes; x++)
+		row[x] += row[x-4];
+}
+
+MZ_TARGET("sse2") void unfilter_up_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	for (x=0; x+16 <= rowbytes; x+=16)
+		_mm_storeu_si128 ((__m128i *)(row+x), _mm_add_epi8 (_mm_loadu_si128 ((const __m128i *)(row+x)), _mm_loadu_si128 ((const __m128i *)(prev+x))));
+	for (; x<rowbytes; x++)
+		row[x] += prev[x];
+}
+
+MZ_TARGET("sse2") void unfilter_average_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	const __m128i ones = _mm_set1_epi8 (1);
+	__m128i a, b, d = _mm_setzero_si128 (), avg;
+	int x;
+
+	if (bpp != 4)
+	{
+		unfilter_average_scalar (row, prev, rowbytes, bpp);
+		return;
+	}
+	for (x=0; x+4 <= rowbytes; x+=4)
+	{
+		a = d;
+		b = load32_sse2 (prev+x);
+		d = load32_sse2 (row+x);
+		/* _mm_avg_epu8 rounds up; correct that to the floor PNG wants */
+		avg = _mm_sub_epi8 (_mm_avg_epu8 (a, b), _mm_and_si128 (_mm_xor_si128 (a, b), ones));
+		d = _mm_add_epi8 (d, avg);
+		store32_sse2 (row+x, d);
+	}
+	for (; x<rowbytes; x++)
+		row[x] += ((x >= 4 ? row[x-4] : 0) + prev[x])>>1;
+}
+
+/* Paeth on 16-bit lanes: picks a, b or c the same way paeth_predictor does */
+#define PAETH_SELECT_SSE2(a,b,c,abs_func,out) \
+	{ \
+		__m128i pa_, pb_, pc_, min_, ma_, mb_; \
+		pa_ = _mm_sub_epi16 (b, c); \
+		pb_ = _mm_sub_epi16 (a, c); \
+		pc_ = _mm_add_epi16 (pa_, pb_); \
+		pa_ = abs_func (pa_); \
+		pb_ = abs_func (pb_); \
+		pc_ = abs_func (pc_); \
+		min_ = _mm_min_epi16 (pc_, _mm_min_epi16 (pa_, pb_)); \
+		ma_ = _mm_cmpeq_epi16 (min_, pa_); \
+		mb_ = _mm_andnot_si128 (ma_, _mm_cmpeq_epi16 (min_, pb_)); \
+		out = _mm_or_si128 (_mm_and_si128 (ma_, a), _mm_or_si128 (_mm_and_si128 (mb_, b), _mm_andnot_si128 (_mm_or_si128 (ma_, mb_), c))); \
+	}
+#define ABS16_SSE2(v)	_mm_max_epi16 (v, _mm_sub_epi16 (_mm_setzero_si128 (), v))
+#define ABS16_SSSE3(v)	_mm_abs_epi16 (v)
+
+MZ_TARGET("sse2") void unfilter_paeth_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i a, b = zero, c, d = zero, pred;
+	int x;
+
+	if (bpp != 4)
+	{
+		unfilter_paeth_scalar (row, prev, rowbytes, bpp);
+		return;
+	}
+	for (x=0; x+4 <= rowbytes; x+=4)
+	{
+		c = b;
+		b = _mm_unpacklo_epi8 (load32_sse2 (prev+x), zero);
+		a = d;
+		d = _mm_unpacklo_epi8 (load32_sse2 (row+x), zero);
+		PAETH_SELECT_SSE2 (a, b, c, ABS16_SSE2, pred);
+		d = _mm_and_si128 (_mm_add_epi16 (d, pred), _mm_set1_epi16 (0xff));
+		store32_sse2 (row+x, _mm_packus_epi16 (d, d));
+	}
+	for (; x<rowbytes; x++)
+		row[x] += x >= 4 ? paeth_predictor (row[x-4], prev[x], prev[x-4]) : prev[x];
+}
+
+/*	Re-filtering has all its inputs unfiltered, so it vectorizes across the row.
+	It goes right to left in chunks: a chunk's left neighbours are loaded before
+	the chunk is stored, and are only overwritten by the next chunk. The leftmost
+	bytes are left over to the plain C version. */
+MZ_TARGET("sse2") void refilter_sub_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	for (x=rowbytes-16; x>=bpp; x-=16)
+		_mm_storeu_si128 ((__m128i *)(row+x), _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i *)(row+x)), _mm_loadu_si128 ((const __m128i *)(row+x-bpp))));
+	refilter_sub_scalar (row, prev, x+16 < rowbytes ? x+16 : rowbytes, bpp);
+}
+
+MZ_TARGET("sse2") void refilter_up_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	for (x=0; x+16 <= rowbytes; x+=16)
+		_mm_storeu_si128 ((__m128i *)(row+x), _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i *)(row+x)), _mm_loadu_si128 ((const __m128i *)(prev+x))));
+	for (; x<rowbytes; x++)
+		row[x] -= prev[x];
+}
+
+MZ_TARGET("sse2") void refilter_average_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	const __m128i ones = _mm_set1_epi8 (1);
+	__m128i a, b, avg;
+	int x;
+
+	for (x=rowbytes-16; x>=bpp; x-=16)
+	{
+		a = _mm_loadu_si128 ((const __m128i *)(row+x-bpp));
+		b = _mm_loadu_si128 ((const __m128i *)(prev+x));
+		avg = _mm_sub_epi8 (_mm_avg_epu8 (a, b), _mm_and_si128 (_mm_xor_si128 (a, b), ones));
+		_mm_storeu_si128 ((__m128i *)(row+x), _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i *)(row+x)), avg));
+	}
+	refilter_average_scalar (row, prev, x+16 < rowbytes ? x+16 : rowbytes, bpp);
+}
+
+#define REFILTER_PAETH_BODY(abs_func) \
+	const __m128i zero = _mm_setzero_si128 (); \
+	__m128i a, b, c, lo, hi; \
+	int x; \
+ \
+	for (x=rowbytes-16; x>=bpp; x-=16) \
+	{ \
+		a = _mm_loadu_si128 ((const __m128i *)(row+x-bpp)); \
+		b = _mm_loadu_si128 ((const __m128i *)(prev+x)); \
+		c = _mm_loadu_si128 ((const __m128i *)(prev+x-bpp)); \
+		{ \
+			__m128i a16 = _mm_unpacklo_epi8 (a, zero), b16 = _mm_unpacklo_epi8 (b, zero), c16 = _mm_unpacklo_epi8 (c, zero); \
+			PAETH_SELECT_SSE2 (a16, b16, c16, abs_func, lo); \
+			a16 = _mm_unpackhi_epi8 (a, zero); b16 = _mm_unpackhi_epi8 (b, zero); c16 = _mm_unpackhi_epi8 (c, zero); \
+			PAETH_SELECT_SSE2 (a16, b16, c16, abs_func, hi); \
+		} \
+		_mm_storeu_si128 ((__m128i *)(row+x), _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i *)(row+x)), _mm_packus_epi16 (lo, hi))); \
+	} \
+	refilter_paeth_scalar (row, prev, x+16 < rowbytes ? x+16 : rowbytes, bpp);
+
+MZ_TARGET("sse2") void refilter_paeth_sse2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	REFILTER_PAETH_BODY (ABS16_SSE2)
+}
+
+
+/** SSSE3 **/
+
+MZ_TARGET("ssse3") void swap_pixels_ssse3 (unsigned char *data, int count, int bytespp)
+{
+	__m128i mask;
+	int x = 0;
+
+	if (bytespp == 4)
+	{
+		mask = _mm_setr_epi8 (2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+		for (; x+4 <= count; x+=4, data+=16)
+			_mm_storeu_si128 ((__m128i *)data, _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)data), mask));
+	} else if (bytespp == 3)
+	{
+		/* five pixels at a time; the 16th byte, part of the next pixel, is stored back unchanged */
+		mask = _mm_setr_epi8 (2,1,0, 5,4,3, 8,7,6, 11,10,9, 14,13,12, 15);
+		for (; x+6 <= count; x+=5, data+=15)
+			_mm_storeu_si128 ((__m128i *)data, _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)data), mask));
+	}
+	swap_pixels_scalar (data, count-x, bytespp);
+}
+
+MZ_TARGET("ssse3") void strip_alpha_ssse3 (unsigned char *dst, const unsigned char *src, int count)
+{
+	const __m128i pack = _mm_setr_epi8 (0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+	int x;
+
+	/*	each store writes 4 bytes past the 12 it means to; stopping 2 pixels early
+		keeps those inside this row's own output */
+	for (x=0; x+6 <= count; x+=4)
+		_mm_storeu_si128 ((__m128i *)(dst+3*x), _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(src+4*x)), pack));
+	strip_alpha_scalar (dst+3*x, src+4*x, count-x);
+}
+
+MZ_TARGET("ssse3") void unfilter_paeth_ssse3 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i a, b = zero, c, d = zero, pred;
+	int x;
+
+	if (bpp != 4)
+	{
+		unfilter_paeth_scalar (row, prev, rowbytes, bpp);
+		return;
+	}
+	for (x=0; x+4 <= rowbytes; x+=4)
+	{
+		c = b;
+		b = _mm_unpacklo_epi8 (load32_sse2 (prev+x), zero);
+		a = d;
+		d = _mm_unpacklo_epi8 (load32_sse2 (row+x), zero);
+		PAETH_SELECT_SSE2 (a, b, c, ABS16_SSSE3, pred);
+		d = _mm_and_si128 (_mm_add_epi16 (d, pred), _mm_set1_epi16 (0xff));
+		store32_sse2 (row+x, _mm_packus_epi16 (d, d));
+	}
+	for (; x<rowbytes; x++)
+		row[x] += x >= 4 ? paeth_predictor (row[x-4], prev[x], prev[x-4]) : prev[x];
+}
+
+MZ_TARGET("ssse3") void refilter_paeth_ssse3 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	REFILTER_PAETH_BODY (ABS16_SSSE3)
+}
+
+
+/** SSE4.1 + PCLMULQDQ: CRC32 by carry-less multiplication folding
+	(Intel's "Fast CRC Computation Using PCLMULQDQ", constants for the reflected
+	zlib/PNG polynomial 0xEDB88320). Needs at least 64 bytes; the tail is done
+	by the table version. **/
+
+MZ_TARGET("sse4.1,pclmul") unsigned int crc32_block_pclmul (unsigned int c, const unsigned char *buf, size_t length)
+{
+	const __m128i k1k2 = _mm_set_epi64x (0x01c6e41596LL, 0x0154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x (0x00ccaa009eLL, 0x01751997d0LL);
+	const __m128i k5k0 = _mm_set_epi64x (0, 0x0163cd6124LL);
+	const __m128i poly = _mm_set_epi64x (0x01f7011641LL, 0x01db710641LL);
+	const __m128i mask32 = _mm_setr_epi32 (-1, 0, -1, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	if (length < 64)
+		return crc32_block_scalar (c, buf, length);
+
+	x1 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)(buf + 0x00)), _mm_cvtsi32_si128 (c));
+	x2 = _mm_loadu_si128 ((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128 ((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128 ((const __m128i *)(buf + 0x30));
+	buf += 64;
+	length -= 64;
+
+	/* fold 512 bits at a time */
+	while (length >= 64)
+	{
+		x5 = _mm_clmulepi64_si128 (x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128 (x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128 (x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128 (x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128 (x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128 (x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128 (x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128 (x4, k1k2, 0x11);
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), _mm_loadu_si128 ((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), _mm_loadu_si128 ((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), _mm_loadu_si128 ((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), _mm_loadu_si128 ((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		length -= 64;
+	}
+
+	/* fold into 128 bits */
+	x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+	x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+	x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+	/* then 128 bits at a time */
+	while (length >= 16)
+	{
+		x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, _mm_loadu_si128 ((const __m128i *)buf)), x5);
+		buf += 16;
+		length -= 16;
+	}
+
+	/* fold 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128 (x1, k3k4, 0x10);
+	x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+	x2 = _mm_srli_si128 (x1, 4);
+	x1 = _mm_and_si128 (x1, mask32);
+	x1 = _mm_clmulepi64_si128 (x1, k5k0, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128 (x1, mask32);
+	x2 = _mm_clmulepi64_si128 (x2, poly, 0x10);
+	x2 = _mm_and_si128 (x2, mask32);
+	x2 = _mm_clmulepi64_si128 (x2, poly, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+	c = _mm_extract_epi32 (x1, 1);
+
+	return crc32_block_scalar (c, buf, length);
+}
+
+
+/** AVX2 **/
+
+MZ_TARGET("avx2") void swap_pixels_avx2 (unsigned char *data, int count, int bytespp)
+{
+	__m256i mask;
+	int x = 0;
+
+	if (bytespp == 4)
+	{
+		mask = _mm256_setr_epi8 (2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15, 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+		for (; x+8 <= count; x+=8, data+=32)
+			_mm256_storeu_si256 ((__m256i *)data, _mm256_shuffle_epi8 (_mm256_loadu_si256 ((const __m256i *)data), mask));
+	}
+	swap_pixels_ssse3 (data, count-x, bytespp);
+}
+
+MZ_TARGET("avx2") void demultiply_pixels_avx2 (unsigned char *data, int count)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	const __m256i alpha_lane = _mm256_setr_epi32 (0, 0, 0, -1, 0, 0, 0, -1);
+	const __m256i low_byte = _mm256_set1_epi32 (0xff);
+	__m256i v, lo, hi, px[4], alpha, num, q, keep;
+	int x, i;
+
+	/*	the unpacks work within 128-bit lanes, and the packs undo them the same way */
+	for (x=0; x+8 <= count; x+=8, data+=32)
+	{
+		v = _mm256_loadu_si256 ((const __m256i *)data);
+		lo = _mm256_unpacklo_epi8 (v, zero);
+		hi = _mm256_unpackhi_epi8 (v, zero);
+		px[0] = _mm256_unpacklo_epi16 (lo, zero);
+		px[1] = _mm256_unpackhi_epi16 (lo, zero);
+		px[2] = _mm256_unpacklo_epi16 (hi, zero);
+		px[3] = _mm256_unpackhi_epi16 (hi, zero);
+		for (i=0; i<4; i++)
+		{
+			alpha = _mm256_shuffle_epi32 (px[i], 0xff);
+			num = _mm256_add_epi32 (_mm256_sub_epi32 (_mm256_slli_epi32 (px[i], 8), px[i]), _mm256_srli_epi32 (alpha, 1));
+			q = _mm256_cvttps_epi32 (_mm256_div_ps (_mm256_cvtepi32_ps (num), _mm256_cvtepi32_ps (alpha)));
+			keep = _mm256_or_si256 (_mm256_cmpeq_epi32 (alpha, zero), alpha_lane);
+			px[i] = _mm256_and_si256 (_mm256_blendv_epi8 (q, px[i], keep), low_byte);
+		}
+		v = _mm256_packus_epi16 (_mm256_packs_epi32 (px[0], px[1]), _mm256_packs_epi32 (px[2], px[3]));
+		_mm256_storeu_si256 ((__m256i *)data, v);
+	}
+	demultiply_pixels_sse2 (data, count-x);
+}
+
+MZ_TARGET("avx2") int alpha_and_avx2 (const unsigned char *data, int count)
+{
+	__m256i acc = _mm256_set1_epi8 (-1);
+	__m128i v;
+	int x, a;
+
+	for (x=0; x+8 <= count; x+=8)
+		acc = _mm256_and_si256 (acc, _mm256_loadu_si256 ((const __m256i *)(data+4*x)));
+	v = _mm_and_si128 (_mm256_castsi256_si128 (acc), _mm256_extracti128_si256 (acc, 1));
+	v = _mm_and_si128 (v, _mm_srli_si128 (v, 8));
+	v = _mm_and_si128 (v, _mm_srli_si128 (v, 4));
+	a = (_mm_cvtsi128_si32 (v) >> 24) & 0xff;
+	return a & alpha_and_scalar (data+4*x, count-x);
+}
+
+MZ_TARGET("avx2") void unfilter_up_avx2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	for (x=0; x+32 <= rowbytes; x+=32)
+		_mm256_storeu_si256 ((__m256i *)(row+x), _mm256_add_epi8 (_mm256_loadu_si256 ((const __m256i *)(row+x)), _mm256_loadu_si256 ((const __m256i *)(prev+x))));
+	unfilter_up_sse2 (row+x, prev+x, rowbytes-x, bpp);
+}
+
+MZ_TARGET("avx2") void refilter_sub_avx2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	for (x=rowbytes-32; x>=bpp; x-=32)
+		_mm256_storeu_si256 ((__m256i *)(row+x), _mm256_sub_epi8 (_mm256_loadu_si256 ((const __m256i *)(row+x)), _mm256_loadu_si256 ((const __m256i *)(row+x-bpp))));
+	refilter_sub_sse2 (row, prev, x+32 < rowbytes ? x+32 : rowbytes, bpp);
+}
+
+MZ_TARGET("avx2") void refilter_up_avx2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	int x;
+
+	for (x=0; x+32 <= rowbytes; x+=32)
+		_mm256_storeu_si256 ((__m256i *)(row+x), _mm256_sub_epi8 (_mm256_loadu_si256 ((const __m256i *)(row+x)), _mm256_loadu_si256 ((const __m256i *)(prev+x))));
+	refilter_up_sse2 (row+x, prev+x, rowbytes-x, bpp);
+}
+
+MZ_TARGET("avx2") void refilter_average_avx2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	const __m256i ones = _mm256_set1_epi8 (1);
+	__m256i a, b, avg;
+	int x;
+
+	for (x=rowbytes-32; x>=bpp; x-=32)
+	{
+		a = _mm256_loadu_si256 ((const __m256i *)(row+x-bpp));
+		b = _mm256_loadu_si256 ((const __m256i *)(prev+x));
+		avg = _mm256_sub_epi8 (_mm256_avg_epu8 (a, b), _mm256_and_si256 (_mm256_xor_si256 (a, b), ones));
+		_mm256_storeu_si256 ((__m256i *)(row+x), _mm256_sub_epi8 (_mm256_loadu_si256 ((const __m256i *)(row+x)), avg));
+	}
+	refilter_average_sse2 (row, prev, x+32 < rowbytes ? x+32 : rowbytes, bpp);
+}
+
+MZ_TARGET("avx2") void refilter_paeth_avx2 (unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	__m256i a, b, c, pa, pb, pc, smallest, ma, mb, pred;
+	int x;
+
+	/* 16 pixels bytes at a time, widened to 16-bit lanes */
+	for (x=rowbytes-16; x>=bpp; x-=16)
+	{
+		a = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(row+x-bpp)));
+		b = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(prev+x)));
+		c = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *)(prev+x-bpp)));
+		pa = _mm256_sub_epi16 (b, c);
+		pb = _mm256_sub_epi16 (a, c);
+		pc = _mm256_abs_epi16 (_mm256_add_epi16 (pa, pb));
+		pa = _mm256_abs_epi16 (pa);
+		pb = _mm256_abs_epi16 (pb);
+		smallest = _mm256_min_epi16 (pc, _mm256_min_epi16 (pa, pb));
+		ma = _mm256_cmpeq_epi16 (smallest, pa);
+		mb = _mm256_cmpeq_epi16 (smallest, pb);
+		pred = _mm256_blendv_epi8 (_mm256_blendv_epi8 (c, b, mb), a, ma);
+		_mm_storeu_si128 ((__m128i *)(row+x), _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i *)(row+x)),
+			_mm_packus_epi16 (_mm256_castsi256_si128 (pred), _mm256_extracti128_si256 (pred, 1))));
+	}
+	refilter_paeth_ssse3 (row, prev, x+16 < rowbytes ? x+16 : rowbytes, bpp);
+}
+
+#endif /* MINIZ_X86_SIMD */
+
+
+/** Pick the variants to use **/
+
+int bind_cpu_variants (const char *forced)
+{
+	int level, i;
+
+	level = mz_cpu_max_level ();
+	if (forced && forced[0])
+	{
+		for (i=0; i<5; i++)
+		{
+			if (!strcasecmp (forced, cpu_level_names[i]))
+				break;
+		}
+		if (i == 5)
+			fprintf (stderr, "pngdefry : unknown PNGDEFRY_CPU value '%s', ignored\n", forced);
+		else if (i > level)
+			fprintf (stderr, "pngdefry : PNGDEFRY_CPU=%s is not supported by this processor, using %s\n", forced, cpu_level_names[level]);
+		else
+			level = i;
+	}
+	level = mz_cpu_init (level);
+
+	crc32_block = crc32_block_scalar;
+	swap_pixels = swap_pixels_scalar;
+	demultiply_pixels = demultiply_pixels_scalar;
+	alpha_and = alpha_and_scalar;
+	strip_alpha = strip_alpha_scalar;
+	unfilter_funcs[0] = filter_none;
+	unfilter_funcs[1] = unfilter_sub_scalar;
+	unfilter_funcs[2] = unfilter_up_scalar;
+	unfilter_funcs[3] = unfilter_average_scalar;
+	unfilter_funcs[4] = unfilter_paeth_scalar;
+	refilter_funcs[0] = filter_none;
+	refilter_funcs[1] = refilter_sub_scalar;
+	refilter_funcs[2] = refilter_up_scalar;
+	refilter_funcs[3] = refilter_average_scalar;
+	refilter_funcs[4] = refilter_paeth_scalar;
+
+#if MINIZ_X86_SIMD
+	if (level >= MZ_CPU_LEVEL_SSE2)
+	{
+		demultiply_pixels = demultiply_pixels_sse2;
+		alpha_and = alpha_and_sse2;
+		unfilter_funcs[1] = unfilter_sub_sse2;
+		unfilter_funcs[2] = unfilter_up_sse2;
+		unfilter_funcs[3] = unfilter_average_sse2;
+		unfilter_funcs[4] = unfilter_paeth_sse2;
+		refilter_funcs[1] = refilter_sub_sse2;
+		refilter_funcs[2] = refilter_up_sse2;
+		refilter_funcs[3] = refilter_average_sse2;
+		refilter_funcs[4] = refilter_paeth_sse2;
+	}
+	if (level >= MZ_CPU_LEVEL_SSSE3)
+	{
+		swap_pixels = swap_pixels_ssse3;
+		strip_alpha = strip_alpha_ssse3;
+		unfilter_funcs[4] = unfilter_paeth_ssse3;
+		refilter_funcs[4] = refilter_paeth_ssse3;
+	}
+	if (level >= MZ_CPU_LEVEL_SSE41 && (mz_cpu_features () & MZ_CPU_HAS_PCLMUL))
+		crc32_block = crc32_block_pclmul;
+	if (level >= MZ_CPU_LEVEL_AVX2)
+	{
+		swap_pixels = swap_pixels_avx2;
+		demultiply_pixels = demultiply_pixels_avx2;
+		alpha_and = alpha_and_avx2;
+		unfilter_funcs[2] = unfilter_up_avx2;
+		refilter_funcs[1] = refilter_sub_avx2;
+		refilter_funcs[2] = refilter_up_avx2;
+		refilter_funcs[3] = refilter_average_avx2;
+		refilter_funcs[4] = refilter_paeth_avx2;
+	}
+#endif
+
+	cpu_level = level;
+	return level;
+}
+
+/*	For -d: check that Adler-32s of pieces of a buffer, put together with
+	mz_adler32_combine(), come out as the Adler-32 of the whole buffer, for
+	splits on and around the 5552 byte blocks the SIMD variants work in.
+	Returns 1 if they all do */
+int check_adler32_combine (void)
+{
+	static const size_t splits[] = { 0, 1, 15, 16, 5551, 5552, 5553, 65521, 65537, 99999, 100000 };
+	unsigned char *buf;
+	mz_ulong whole, head, tail;
+	unsigned int seed = 1;
+	size_t i, length = 100000;
+	int ok = 1;
+
+	buf = (unsigned char *)malloc (length);
+	if (buf == NULL)
+		return 0;
+	for (i=0; i<length; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		buf[i] = (seed >> 16) & 0xff;
+	}
+	whole = mz_adler32 (MZ_ADLER32_INIT, buf, length);
+	for (i=0; i<sizeof(splits)/sizeof(splits[0]); i++)
+	{
+		head = mz_adler32 (MZ_ADLER32_INIT, buf, splits[i]);
+		tail = mz_adler32 (MZ_ADLER32_INIT, buf+splits[i], length-splits[i]);
+		if (mz_adler32_combine (head, tail, length-splits[i]) != whole)
+			ok = 0;
+	}
+	free (buf);
+	return ok;
+}
@@ -145,6 +145,9 @@
 // Define MINIZ_NO_ZLIB_COMPATIBLE_NAME to disable zlib names, to prevent conflicts against stock zlib.
 //#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 
+// Define MINIZ_NO_SIMD to disable the SSE2/SSSE3/SSE4.1/AVX2 variants of the hot loops (otherwise selected at runtime by mz_cpu_init()).
+//#define MINIZ_NO_SIMD
+
 // Define MINIZ_NO_MALLOC to disable all calls to malloc, free, and realloc.
 // Note if MINIZ_NO_MALLOC is defined then the user must always provide custom user alloc/free/realloc
 // callbacks to the zlib and archive API's, and a few stand-alone helper API's which don't provide custom user
@@ -171,6 +174,12 @@
 #define MINIZ_HAS_64BIT_REGISTERS 1
 #endif
 
+#if MINIZ_X86_OR_X64_CPU && defined(__GNUC__) && !defined(MINIZ_NO_SIMD)
+// MINIZ_X86_SIMD compiles the SSE2/SSSE3/SSE4.1/AVX2 variants of the hot loops (using per-function target attributes, so the rest of the
+// code still builds for the baseline instruction set). mz_cpu_init() picks the variants to use at runtime.
+#define MINIZ_X86_SIMD 1
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -189,11 +198,25 @@ typedef void *(*mz_realloc_func)(void *opaque, void *address, size_t items, size
 #define MZ_ADLER32_INIT (1)
 // mz_adler32() returns the initial adler-32 value to use when called with ptr==NULL.
 mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len);
+// mz_adler32_combine() returns the adler-32 of two blocks of data put together, given the adler-32 of each (both started from
+// MZ_ADLER32_INIT) and the length of the second, like zlib's adler32_combine().
+mz_ulong mz_adler32_combine(mz_ulong adler1, mz_ulong adler2, size_t len2);
 
 #define MZ_CRC32_INIT (0)
 // mz_crc32() returns the initial CRC-32 value to use when called with ptr==NULL.
 mz_ulong mz_crc32(mz_ulong crc, const unsigned char *ptr, size_t buf_len);
 
+// Runtime CPU dispatch.
+// mz_cpu_features() probes the processor (only once) and returns a combination of the MZ_CPU_HAS_ flags.
+// mz_cpu_init() binds miniz's hot loops (Adler-32, the deflate match length compare) to the fastest variants allowed by the given
+// MZ_CPU_LEVEL_, clamped to what the processor actually supports, and returns the level used. Until it's called the scalar variants are used.
+enum { MZ_CPU_HAS_SSE2 = 1, MZ_CPU_HAS_SSSE3 = 2, MZ_CPU_HAS_SSE41 = 4, MZ_CPU_HAS_PCLMUL = 8, MZ_CPU_HAS_AVX2 = 16 };
+enum { MZ_CPU_LEVEL_SCALAR = 0, MZ_CPU_LEVEL_SSE2 = 1, MZ_CPU_LEVEL_SSSE3 = 2, MZ_CPU_LEVEL_SSE41 = 3, MZ_CPU_LEVEL_AVX2 = 4 };
+unsigned int mz_cpu_features(void);
+// Returns the highest MZ_CPU_LEVEL_ supported by the processor.
+int mz_cpu_max_level(void);
+int mz_cpu_init(int level);
+
 // Compression strategies.
 enum { MZ_DEFAULT_STRATEGY = 0, MZ_FILTERED = 1, MZ_HUFFMAN_ONLY = 2, MZ_RLE = 3, MZ_FIXED = 4 };
 
@@ -700,6 +723,11 @@ typedef struct
   #define TINFL_BITBUF_SIZE (32)
 #endif
 
+// The table driven fast loop (see tinfl_decode_fast()) needs a 64-bit bit buffer and cheap unaligned little endian loads.
+#if TINFL_USE_64BIT_BITBUF && MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
+  #define TINFL_USE_FAST_LOOP 1
+#endif
+
 struct tinfl_decompressor_tag
 {
   mz_uint32 m_state, m_num_bits, m_zhdr0, m_zhdr1, m_z_adler32, m_final, m_type, m_check_adler32, m_dist, m_counter, m_num_extra, m_table_sizes[TINFL_MAX_HUFF_TABLES];
@@ -707,6 +735,9 @@ struct tinfl_decompressor_tag
   size_t m_dist_from_out_buf_start;
   tinfl_huff_table m_tables[TINFL_MAX_HUFF_TABLES];
   mz_uint8 m_raw_header[4], m_len_codes[TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1 + 137];
+#if TINFL_USE_FAST_LOOP
+  mz_uint32 m_fast_lit[TINFL_FAST_LOOKUP_SIZE], m_fast_dist[TINFL_FAST_LOOKUP_SIZE];
+#endif
 };
 
 // ------------------- Low-level Compression API Definitions
@@ -725,6 +756,10 @@ enum
 // TDEFL_GREEDY_PARSING_FLAG: Set to use faster greedy parsing, instead of more efficient lazy parsing.
 // TDEFL_NONDETERMINISTIC_PARSING_FLAG: Enable to decrease the compressor's initialization time to the minimum, but the output may vary from run to run given the same input (depending on the contents of memory).
 // TDEFL_FORCE_ALL_STATIC_BLOCKS: Disable usage of optimized Huffman tables.
+// TDEFL_PIXEL_HASH: Hash 4 bytes (a whole RGBA pixel, or an RGB pixel and the next byte) with a multiplicative hash instead of 3 bytes with shift/xor.
+//  Filtered image rows are mostly small values near 0 and 255, which the shift/xor hash crams into a few long chains. 3 byte matches are only found by chance.
+// TDEFL_SPLIT_BLOCKS: Split each buffer of LZ codes into the blocks that come out smallest, and pick stored, static or dynamic for each by counting
+//  the bits they would take with the actual Huffman tables. Slow; for when every byte counts.
 enum
 {
   TDEFL_WRITE_ZLIB_HEADER             = 0x01000,
@@ -734,7 +769,9 @@ enum
   TDEFL_RLE_MATCHES                   = 0x10000,
   TDEFL_FILTER_MATCHES                = 0x20000,
   TDEFL_FORCE_ALL_STATIC_BLOCKS       = 0x40000,
-  TDEFL_FORCE_ALL_RAW_BLOCKS          = 0x80000
+  TDEFL_FORCE_ALL_RAW_BLOCKS          = 0x80000,
+  TDEFL_PIXEL_HASH                    = 0x100000,
+  TDEFL_SPLIT_BLOCKS                  = 0x200000
 };
 
 // High level compression functions:
@@ -769,11 +806,20 @@ mz_bool tdefl_compress_mem_to_output(const void *pBuf, size_t buf_len, tdefl_put
 
 enum { TDEFL_MAX_HUFF_TABLES = 3, TDEFL_MAX_HUFF_SYMBOLS_0 = 288, TDEFL_MAX_HUFF_SYMBOLS_1 = 32, TDEFL_MAX_HUFF_SYMBOLS_2 = 19, TDEFL_LZ_DICT_SIZE = 32768, TDEFL_LZ_DICT_SIZE_MASK = TDEFL_LZ_DICT_SIZE - 1, TDEFL_MIN_MATCH_LEN = 3, TDEFL_MAX_MATCH_LEN = 258 };
 
+// TDEFL_LZ_HASH_BITS is the size of the hash chain heads (m_hash) as a power of 2, 12 to 16. Define it before including miniz.c to override.
+#ifndef TDEFL_LZ_HASH_BITS
+  #if TDEFL_LESS_MEMORY
+    #define TDEFL_LZ_HASH_BITS 12
+  #else
+    #define TDEFL_LZ_HASH_BITS 15
+  #endif
+#endif
+
 // TDEFL_OUT_BUF_SIZE MUST be large enough to hold a single entire compressed output block (using static/fixed Huffman codes).
 #if TDEFL_LESS_MEMORY
-enum { TDEFL_LZ_CODE_BUF_SIZE = 24 * 1024, TDEFL_OUT_BUF_SIZE = (TDEFL_LZ_CODE_BUF_SIZE * 13 ) / 10, TDEFL_MAX_HUFF_SYMBOLS = 288, TDEFL_LZ_HASH_BITS = 12, TDEFL_LEVEL1_HASH_SIZE_MASK = 4095, TDEFL_LZ_HASH_SHIFT = (TDEFL_LZ_HASH_BITS + 2) / 3, TDEFL_LZ_HASH_SIZE = 1 << TDEFL_LZ_HASH_BITS };
+enum { TDEFL_LZ_CODE_BUF_SIZE = 24 * 1024, TDEFL_OUT_BUF_SIZE = (TDEFL_LZ_CODE_BUF_SIZE * 13 ) / 10, TDEFL_MAX_HUFF_SYMBOLS = 288, TDEFL_LEVEL1_HASH_BITS = 12, TDEFL_LEVEL1_HASH_SIZE_MASK = (1 << TDEFL_LEVEL1_HASH_BITS) - 1, TDEFL_LZ_HASH_SHIFT = (TDEFL_LZ_HASH_BITS + 2) / 3, TDEFL_LZ_HASH_SIZE = 1 << TDEFL_LZ_HASH_BITS };
 #else
-enum { TDEFL_LZ_CODE_BUF_SIZE = 64 * 1024, TDEFL_OUT_BUF_SIZE = (TDEFL_LZ_CODE_BUF_SIZE * 13 ) / 10, TDEFL_MAX_HUFF_SYMBOLS = 288, TDEFL_LZ_HASH_BITS = 15, TDEFL_LEVEL1_HASH_SIZE_MASK = 4095, TDEFL_LZ_HASH_SHIFT = (TDEFL_LZ_HASH_BITS + 2) / 3, TDEFL_LZ_HASH_SIZE = 1 << TDEFL_LZ_HASH_BITS };
+enum { TDEFL_LZ_CODE_BUF_SIZE = 64 * 1024, TDEFL_OUT_BUF_SIZE = (TDEFL_LZ_CODE_BUF_SIZE * 13 ) / 10, TDEFL_MAX_HUFF_SYMBOLS = 288, TDEFL_LEVEL1_HASH_BITS = 12, TDEFL_LEVEL1_HASH_SIZE_MASK = (1 << TDEFL_LEVEL1_HASH_BITS) - 1, TDEFL_LZ_HASH_SHIFT = (TDEFL_LZ_HASH_BITS + 2) / 3, TDEFL_LZ_HASH_SIZE = 1 << TDEFL_LZ_HASH_BITS };
 #endif
 
 // The low-level tdefl functions below may be used directly if the above helper functions aren't flexible enough. The low-level functions don't make any heap allocations, unlike the above helper functions.
@@ -824,6 +870,10 @@ typedef struct
 // Initializes the compressor.
 tdefl_status tdefl_init(tdefl_compressor *d, tdefl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags);
 
+// Same as tdefl_init(), for a compressor that went through tdefl_init() before, or is all zeroes (static). It only clears the part of the
+// hash table the previous stream can have used, so keeping one compressor around saves most of the init cost on short streams.
+tdefl_status tdefl_reinit(tdefl_compressor *d, tdefl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags);
+
 // Compresses a block of data, consuming as much of the input as possible, and writing as much compressed data as possible.
 tdefl_status tdefl_compress(tdefl_compressor *d, const void *pIn_buf, size_t *pIn_buf_size, void *pOut_buf, size_t *pOut_buf_size, tdefl_flush flush);
 // tdefl_compress_buffer() is only usable when the tdefl_init() is called with a valid tdefl_put_buf_func_ptr.
@@ -858,6 +908,12 @@ typedef unsigned char mz_validate_uint64[sizeof(mz_uint64)==8 ? 1 : -1];
 
 #define MZ_ASSERT(x) assert(x)
 
+#if MINIZ_X86_SIMD
+  #include <immintrin.h>
+  #include <cpuid.h>
+  #define MZ_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 #ifdef MINIZ_NO_MALLOC
   #define MZ_MALLOC(x) NULL
   #define MZ_FREE(x) x, ((void)0)
@@ -875,6 +931,7 @@ typedef unsigned char mz_validate_uint64[sizeof(mz_uint64)==8 ? 1 : -1];
 #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
   #define MZ_READ_LE16(p) *((const mz_uint16 *)(p))
   #define MZ_READ_LE32(p) *((const mz_uint32 *)(p))
+  #define MZ_READ_LE64(p) *((const mz_uint64 *)(p))
 #else
   #define MZ_READ_LE16(p) ((mz_uint32)(((const mz_uint8 *)(p))[0]) | ((mz_uint32)(((const mz_uint8 *)(p))[1]) << 8U))
   #define MZ_READ_LE32(p) ((mz_uint32)(((const mz_uint8 *)(p))[0]) | ((mz_uint32)(((const mz_uint8 *)(p))[1]) << 8U) | ((mz_uint32)(((const mz_uint8 *)(p))[2]) << 16U) | ((mz_uint32)(((const mz_uint8 *)(p))[3]) << 24U))
@@ -898,10 +955,9 @@ static void *def_alloc_func(void *opaque, size_t items, size_t size) { (void)opa
 static void def_free_func(void *opaque, void *address) { (void)opaque, MZ_FREE(address); }
 static void *def_realloc_func(void *opaque, void *address, size_t items, size_t size) { (void)opaque; return MZ_REALLOC(address, items * size); }
 
-mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+static mz_ulong mz_adler32_scalar(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
 {
   mz_uint32 i, s1 = (mz_uint32)(adler & 0xffff), s2 = (mz_uint32)(adler >> 16); size_t block_len = buf_len % 5552;
-  if (!ptr) return MZ_ADLER32_INIT;
   while (buf_len) {
     for (i = 0; i + 7 < block_len; i += 8, ptr += 8) {
       s1 += ptr[0], s2 += s1; s1 += ptr[1], s2 += s1; s1 += ptr[2], s2 += s1; s1 += ptr[3], s2 += s1;
@@ -913,13 +969,111 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
   return (s2 << 16) + s1;
 }
 
+#if MINIZ_X86_SIMD
+// The SIMD variants take 32 bytes at a time, as in zlib-ng and Chromium. For bytes b[0..31] added to (s1, s2):
+//   s1 += sum(b[i]), s2 += 32 * s1 + sum((32 - i) * b[i])
+// s1 at the start of each 32 byte step is summed in ps, which is multiplied by 32 once at the end. At most 5536 bytes (173 steps) go
+// in between reductions, the largest multiple of 32 that can't overflow 32 bits (5552 for single bytes).
+enum { MZ_ADLER32_SIMD_STEPS = 5552 / 32 };
+
+static MZ_TARGET("ssse3") mz_uint32 mz_adler32_hsum_ssse3(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (mz_uint32)_mm_cvtsi128_si32(v);
+}
+
+static MZ_TARGET("ssse3") mz_ulong mz_adler32_ssse3(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+{
+  mz_uint32 s1 = (mz_uint32)(adler & 0xffff), s2 = (mz_uint32)(adler >> 16);
+  size_t steps = buf_len / 32;
+  const __m128i taps_lo = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i taps_hi = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+  buf_len -= steps * 32;
+  while (steps)
+  {
+    size_t n = MZ_MIN(steps, (size_t)MZ_ADLER32_SIMD_STEPS);
+    __m128i v_s1 = zero, v_ps = _mm_cvtsi32_si128((int)(s1 * n)), v_s2 = _mm_cvtsi32_si128((int)s2);
+    steps -= n;
+    do
+    {
+      __m128i lo = _mm_loadu_si128((const __m128i*)ptr), hi = _mm_loadu_si128((const __m128i*)(ptr + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(lo, zero), _mm_sad_epu8(hi, zero)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(lo, taps_lo), ones));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(hi, taps_hi), ones));
+      ptr += 32;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    s1 = (s1 + mz_adler32_hsum_ssse3(v_s1)) % 65521U;
+    s2 = mz_adler32_hsum_ssse3(v_s2) % 65521U;
+  }
+  return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+
+static MZ_TARGET("avx2") mz_ulong mz_adler32_avx2(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+{
+  mz_uint32 s1 = (mz_uint32)(adler & 0xffff), s2 = (mz_uint32)(adler >> 16);
+  size_t steps = buf_len / 32;
+  const __m256i taps = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+  buf_len -= steps * 32;
+  while (steps)
+  {
+    size_t n = MZ_MIN(steps, (size_t)MZ_ADLER32_SIMD_STEPS);
+    __m256i v_s1 = zero, v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0), v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m128i sum1, sum2;
+    steps -= n;
+    do
+    {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)ptr);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, taps), ones));
+      ptr += 32;
+    } while (--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+    sum1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    sum2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    s1 = (s1 + mz_adler32_hsum_ssse3(sum1)) % 65521U;
+    s2 = mz_adler32_hsum_ssse3(sum2) % 65521U;
+  }
+  return mz_adler32_scalar((s2 << 16) + s1, ptr, buf_len);
+}
+#endif // MINIZ_X86_SIMD
+
+// Bound by mz_cpu_init().
+static mz_ulong (*mz_adler32_func)(mz_ulong adler, const unsigned char *ptr, size_t buf_len) = mz_adler32_scalar;
+
+mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
+{
+  if (!ptr) return MZ_ADLER32_INIT;
+  return mz_adler32_func(adler, ptr, buf_len);
+}
+
+mz_ulong mz_adler32_combine(mz_ulong adler1, mz_ulong adler2, size_t len2)
+{
+  // Appending len2 bytes adds len2 * s1 (of the first block) to s2, and the initial 1 of the second block's s1 must be taken out again.
+  mz_uint32 rem = (mz_uint32)(len2 % 65521U), s1 = (mz_uint32)(adler1 & 0xffff), s2 = (rem * s1) % 65521U;
+  s1 += (mz_uint32)(adler2 & 0xffff) + 65521U - 1;
+  s2 += (mz_uint32)((adler1 >> 16) & 0xffff) + (mz_uint32)((adler2 >> 16) & 0xffff) + 65521U - rem;
+  if (s1 >= 65521U) s1 -= 65521U;
+  if (s1 >= 65521U) s1 -= 65521U;
+  if (s2 >= 65521U * 2) s2 -= 65521U * 2;
+  if (s2 >= 65521U) s2 -= 65521U;
+  return (s2 << 16) | s1;
+}
+
 // Karl Malbrain's compact CRC-32. See "A compact CCITT crc16 and crc32 C implementation that balances processor cache usage against speed": http://www.geocities.com/malbrain/
 mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
 {
   static const mz_uint32 s_crc32[16] = { 0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
     0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+  mz_uint32 crcu32 = (mz_uint32)crc;
   if (!ptr) return MZ_CRC32_INIT;
-  crc = ~crc; while (buf_len--) { mz_uint8 b = *ptr++; crc = (crc >> 4) ^ s_crc32[(crc & 0xF) ^ (b & 0xF)]; crc = (crc >> 4) ^ s_crc32[(crc & 0xF) ^ (b >> 4)]; } return ~crc;
+  // Work on 32 bits: ~crc on a 64-bit mz_ulong would shift ones in from the top.
+  crcu32 = ~crcu32; while (buf_len--) { mz_uint8 b = *ptr++; crcu32 = (crcu32 >> 4) ^ s_crc32[(crcu32 & 0xF) ^ (b & 0xF)]; crcu32 = (crcu32 >> 4) ^ s_crc32[(crcu32 & 0xF) ^ (b >> 4)]; } return ~crcu32;
 }
 
 #ifndef MINIZ_NO_ZLIB_APIS
@@ -1338,12 +1492,182 @@ const char *mz_error(int err)
     code_len = TINFL_FAST_LOOKUP_BITS; do { temp = (pHuff)->m_tree[~temp + ((bit_buf >> code_len++) & 1)]; } while (temp < 0); \
   } sym = temp; bit_buf >>= code_len; num_bits -= code_len; } MZ_MACRO_END
 
+static const int s_length_base[31] = { 3,4,5,6,7,8,9,10,11,13, 15,17,19,23,27,31,35,43,51,59, 67,83,99,115,131,163,195,227,258,0,0 };
+static const int s_length_extra[31]= { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+static const int s_dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193, 257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+static const int s_dist_extra[32] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+#if TINFL_USE_FAST_LOOP
+// Fast loop table entries combine the Huffman code with what it stands for:
+// bits 0-7 code length (of both codes for a literal pair), 8-11 extra bits, 12-15 kind, 16-31 literal(s) or length/distance base.
+// A zero entry means the loop can't handle the code (longer than TINFL_FAST_LOOKUP_BITS, or invalid).
+enum { TINFL_FAST_LITERAL = 1, TINFL_FAST_LITERAL_PAIR = 2, TINFL_FAST_MATCH = 3, TINFL_FAST_END_OF_BLOCK = 4 };
+enum { TINFL_FAST_MORE, TINFL_FAST_BLOCK_DONE, TINFL_FAST_COPY };
+// Input needed for one branchless bit buffer refill, and output for a match copied in 8 byte steps.
+#define TINFL_FAST_IN_MARGIN 8
+#define TINFL_FAST_OUT_MARGIN (258 + 8)
+
+static mz_uint32 tinfl_fast_entry(int table, int sym, mz_uint code_len)
+{
+  if (table == 0)
+  {
+    if (sym < 256) return ((mz_uint32)sym << 16) | (TINFL_FAST_LITERAL << 12) | code_len;
+    if (sym == 256) return (TINFL_FAST_END_OF_BLOCK << 12) | code_len;
+    if (sym > 285) return 0;
+    return ((mz_uint32)s_length_base[sym - 257] << 16) | (TINFL_FAST_MATCH << 12) | (s_length_extra[sym - 257] << 8) | code_len;
+  }
+  if (sym > 29) return 0;
+  return ((mz_uint32)s_dist_base[sym] << 16) | (TINFL_FAST_MATCH << 12) | (s_dist_extra[sym] << 8) | code_len;
+}
+
+// Looks up a code with tinfl's regular tables, for the codes that have no fast entry.
+static mz_uint32 tinfl_fast_slow_entry(const tinfl_huff_table *pTable, int table, tinfl_bit_buf_t bit_buf)
+{
+  int sym = pTable->m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]; mz_uint code_len;
+  if (sym > 0)
+    return tinfl_fast_entry(table, sym & 511, sym >> 9);
+  if (sym == 0)
+    return 0;
+  code_len = TINFL_FAST_LOOKUP_BITS; do { sym = pTable->m_tree[~sym + ((bit_buf >> code_len++) & 1)]; } while (sym < 0);
+  return tinfl_fast_entry(table, sym, code_len);
+}
+
+static void tinfl_build_fast_tables(tinfl_decompressor *r)
+{
+  mz_uint i, code_len; int sym;
+  for (i = 0; i < TINFL_FAST_LOOKUP_SIZE; i++)
+  {
+    sym = r->m_tables[0].m_look_up[i]; r->m_fast_lit[i] = (sym > 0) ? tinfl_fast_entry(0, sym & 511, sym >> 9) : 0;
+    sym = r->m_tables[1].m_look_up[i]; r->m_fast_dist[i] = (sym > 0) ? tinfl_fast_entry(1, sym & 511, sym >> 9) : 0;
+  }
+  // Two short literals that fit in the lookup bits together get a single entry. The second code
+  // only depends on the low bits of i >> code_len, so the regular table still gives the right one.
+  for (i = 0; i < TINFL_FAST_LOOKUP_SIZE; i++)
+  {
+    sym = r->m_tables[0].m_look_up[i];
+    if ((sym <= 0) || ((sym & 511) >= 256)) continue;
+    code_len = sym >> 9;
+    sym = r->m_tables[0].m_look_up[i >> code_len];
+    if ((sym <= 0) || ((sym & 511) >= 256) || (code_len + (sym >> 9) > TINFL_FAST_LOOKUP_BITS)) continue;
+    r->m_fast_lit[i] = ((mz_uint32)(r->m_fast_lit[i] >> 16) << 16) | ((mz_uint32)(sym & 511) << 24) | (TINFL_FAST_LITERAL_PAIR << 12) | (code_len + (sym >> 9));
+  }
+}
+
+// Decodes literals and matches for as long as there are at least TINFL_FAST_IN_MARGIN input and TINFL_FAST_OUT_MARGIN output bytes left,
+// without any of tinfl_decompress()'s per symbol checks. The bit buffer is refilled with a single 64-bit load per symbol, which leaves it
+// with 56-63 bits: enough for a length code, its extra bits, a distance code and its extra bits. On return, whole bytes that were loaded
+// but not used are given back, so tinfl_decompress() can go on as if it had read the input itself.
+// Returns TINFL_FAST_BLOCK_DONE after the end of block code, or TINFL_FAST_COPY with a match in *pCounter/*pDist that starts before the output
+// buffer, for tinfl_decompress() to fail on.
+static int tinfl_decode_fast(tinfl_decompressor *r, const mz_uint8 **ppIn_buf_cur, const mz_uint8 *pIn_buf_next, const mz_uint8 *pIn_buf_end, mz_uint8 *pOut_buf_start, mz_uint8 **ppOut_buf_cur, mz_uint8 *pOut_buf_end, tinfl_bit_buf_t *pBit_buf, mz_uint32 *pNum_bits, mz_uint32 *pCounter, mz_uint32 *pDist, size_t out_buf_size_mask)
+{
+  const mz_uint8 *pIn_buf_cur = *ppIn_buf_cur; mz_uint8 *pOut_buf_cur = *ppOut_buf_cur;
+  tinfl_bit_buf_t bit_buf = *pBit_buf; mz_uint32 num_bits = *pNum_bits, entry, code_len, counter, dist, rewind;
+  int result = TINFL_FAST_MORE;
+
+  while (((pIn_buf_end - pIn_buf_cur) >= TINFL_FAST_IN_MARGIN) && ((pOut_buf_end - pOut_buf_cur) >= TINFL_FAST_OUT_MARGIN))
+  {
+    mz_uint8 *pSrc;
+    // Bits above num_bits are either zero or the same stream bits again, so or'ing them in is harmless.
+    bit_buf |= MZ_READ_LE64(pIn_buf_cur) << num_bits; pIn_buf_cur += (63 - num_bits) >> 3; num_bits |= 56;
+
+    if ((entry = r->m_fast_lit[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) == 0)
+    {
+      if ((entry = tinfl_fast_slow_entry(&r->m_tables[0], 0, bit_buf)) == 0) break;
+    }
+    if (((entry >> 12) & 15) <= TINFL_FAST_LITERAL_PAIR)
+    {
+      // Literal runs: keep going while the bit buffer holds a full literal code.
+      do
+      {
+        pOut_buf_cur[0] = (mz_uint8)(entry >> 16);
+        if (((entry >> 12) & 15) == TINFL_FAST_LITERAL_PAIR) pOut_buf_cur[1] = (mz_uint8)(entry >> 24);
+        pOut_buf_cur += (entry >> 12) & 15;
+        code_len = entry & 255; bit_buf >>= code_len; num_bits -= code_len;
+        if (num_bits < 15) break;
+        entry = r->m_fast_lit[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)];
+      } while ((entry) && (((entry >> 12) & 15) <= TINFL_FAST_LITERAL_PAIR));
+      continue;
+    }
+    if (((entry >> 12) & 15) == TINFL_FAST_END_OF_BLOCK)
+    {
+      code_len = entry & 255; bit_buf >>= code_len; num_bits -= code_len;
+      result = TINFL_FAST_BLOCK_DONE;
+      break;
+    }
+
+    // Length and distance are only consumed once both are known to be good.
+    code_len = entry & 255;
+    counter = (entry >> 16) + (mz_uint32)((bit_buf >> code_len) & ((1U << ((entry >> 8) & 15)) - 1));
+    code_len += (entry >> 8) & 15;
+    if ((entry = r->m_fast_dist[(bit_buf >> code_len) & (TINFL_FAST_LOOKUP_SIZE - 1)]) == 0)
+    {
+      if ((entry = tinfl_fast_slow_entry(&r->m_tables[1], 1, bit_buf >> code_len)) == 0) break;
+    }
+    code_len += entry & 255;
+    dist = (entry >> 16) + (mz_uint32)((bit_buf >> code_len) & ((1U << ((entry >> 8) & 15)) - 1));
+    code_len += (entry >> 8) & 15;
+    bit_buf >>= code_len; num_bits -= code_len;
+
+    if (dist > (mz_uint32)(pOut_buf_cur - pOut_buf_start))
+    {
+      if (out_buf_size_mask == (size_t)-1)
+      {
+        // Before the start of the output; let tinfl_decompress() fail on it.
+        *pCounter = counter; *pDist = dist;
+        result = TINFL_FAST_COPY;
+        break;
+      }
+      // The match starts in the part of the wrapping buffer that is behind the output.
+      dist = (mz_uint32)(pOut_buf_cur - pOut_buf_start) - dist;
+      while (counter--) { *pOut_buf_cur++ = pOut_buf_start[dist++ & out_buf_size_mask]; }
+      continue;
+    }
+    pSrc = pOut_buf_cur - dist;
+    if ((dist >= 8) && (out_buf_size_mask == (size_t)-1))
+    {
+      // May write up to 7 bytes past the match; they're overwritten by whatever comes next.
+      // Not in a wrapping buffer though: there, the bytes after the output are still part of the dictionary.
+      mz_uint8 *pOut_end = pOut_buf_cur + counter;
+      do
+      {
+        TINFL_MEMCPY(pOut_buf_cur, pSrc, 8);
+        pOut_buf_cur += 8; pSrc += 8;
+      } while (pOut_buf_cur < pOut_end);
+      pOut_buf_cur = pOut_end;
+    }
+    else if (dist >= 8)
+    {
+      for ( ; counter >= 8; counter -= 8)
+      {
+        TINFL_MEMCPY(pOut_buf_cur, pSrc, 8);
+        pOut_buf_cur += 8; pSrc += 8;
+      }
+      while (counter--) *pOut_buf_cur++ = *pSrc++;
+    }
+    else if (dist == 1)
+    {
+      TINFL_MEMSET(pOut_buf_cur, pSrc[0], counter);
+      pOut_buf_cur += counter;
+    }
+    else
+    {
+      do { *pOut_buf_cur++ = *pSrc++; } while (--counter);
+    }
+  }
+
+  // Give back the whole bytes that are still in the bit buffer, but only as far as this call's input goes.
+  rewind = MZ_MIN(num_bits >> 3, (mz_uint32)(pIn_buf_cur - pIn_buf_next));
+  pIn_buf_cur -= rewind; num_bits -= rewind << 3;
+  bit_buf &= (((tinfl_bit_buf_t)1) << num_bits) - 1;
+
+  *ppIn_buf_cur = pIn_buf_cur; *ppOut_buf_cur = pOut_buf_cur; *pBit_buf = bit_buf; *pNum_bits = num_bits;
+  return result;
+}
+#endif
+
 tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size, mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size, const mz_uint32 decomp_flags)
 {
-  static const int s_length_base[31] = { 3,4,5,6,7,8,9,10,11,13, 15,17,19,23,27,31,35,43,51,59, 67,83,99,115,131,163,195,227,258,0,0 };
-  static const int s_length_extra[31]= { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-  static const int s_dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193, 257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-  static const int s_dist_extra[32] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
   static const mz_uint8 s_length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
   static const int s_min_table_sizes[3] = { 257, 1, 4 };
 
@@ -1462,9 +1786,22 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
           TINFL_MEMCPY(r->m_tables[0].m_code_size, r->m_len_codes, r->m_table_sizes[0]); TINFL_MEMCPY(r->m_tables[1].m_code_size, r->m_len_codes + r->m_table_sizes[0], r->m_table_sizes[1]);
         }
       }
+#if TINFL_USE_FAST_LOOP
+      tinfl_build_fast_tables(r);
+#endif
       for ( ; ; )
       {
         mz_uint8 *pSrc;
+#if TINFL_USE_FAST_LOOP
+        if (((pIn_buf_end - pIn_buf_cur) >= TINFL_FAST_IN_MARGIN) && ((pOut_buf_end - pOut_buf_cur) >= TINFL_FAST_OUT_MARGIN))
+        {
+          int fast = tinfl_decode_fast(r, &pIn_buf_cur, pIn_buf_next, pIn_buf_end, pOut_buf_start, &pOut_buf_cur, pOut_buf_end, &bit_buf, &num_bits, &counter, &dist, out_buf_size_mask);
+          if (fast == TINFL_FAST_BLOCK_DONE)
+            break;
+          if (fast == TINFL_FAST_COPY)
+            goto copy_match;
+        }
+#endif
         for ( ; ; )
         {
           if (((pIn_buf_end - pIn_buf_cur) < 4) || ((pOut_buf_end - pOut_buf_cur) < 2))
@@ -1524,6 +1861,9 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
         num_extra = s_dist_extra[dist]; dist = s_dist_base[dist];
         if (num_extra) { mz_uint extra_bits; TINFL_GET_BITS(27, extra_bits, num_extra); dist += extra_bits; }
 
+#if TINFL_USE_FAST_LOOP
+copy_match:
+#endif
         dist_from_out_buf_start = pOut_buf_cur - pOut_buf_start;
         if ((dist > dist_from_out_buf_start) && (decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF))
         {
@@ -1593,19 +1933,8 @@ common_exit:
   *pIn_buf_size = pIn_buf_cur - pIn_buf_next; *pOut_buf_size = pOut_buf_cur - pOut_buf_next;
   if ((decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32)) && (status >= 0))
   {
-    const mz_uint8 *ptr = pOut_buf_next; size_t buf_len = *pOut_buf_size;
-    mz_uint32 i, s1 = r->m_check_adler32 & 0xffff, s2 = r->m_check_adler32 >> 16; size_t block_len = buf_len % 5552;
-    while (buf_len)
-    {
-      for (i = 0; i + 7 < block_len; i += 8, ptr += 8)
-      {
-        s1 += ptr[0], s2 += s1; s1 += ptr[1], s2 += s1; s1 += ptr[2], s2 += s1; s1 += ptr[3], s2 += s1;
-        s1 += ptr[4], s2 += s1; s1 += ptr[5], s2 += s1; s1 += ptr[6], s2 += s1; s1 += ptr[7], s2 += s1;
-      }
-      for ( ; i < block_len; ++i) s1 += *ptr++, s2 += s1;
-      s1 %= 65521U, s2 %= 65521U; buf_len -= block_len; block_len = 5552;
-    }
-    r->m_check_adler32 = (s2 << 16) + s1; if ((status == TINFL_STATUS_DONE) && (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) && (r->m_check_adler32 != r->m_z_adler32)) status = TINFL_STATUS_ADLER32_MISMATCH;
+    r->m_check_adler32 = (mz_uint32)mz_adler32_func(r->m_check_adler32, pOut_buf_next, *pOut_buf_size);
+    if ((status == TINFL_STATUS_DONE) && (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) && (r->m_check_adler32 != r->m_z_adler32)) status = TINFL_STATUS_ADLER32_MISMATCH;
   }
   return status;
 }
@@ -1846,10 +2175,12 @@ static void tdefl_optimize_huffman_table(tdefl_compressor *d, int table_num, int
 
 static mz_uint8 s_tdefl_packed_code_size_syms_swizzle[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-static void tdefl_start_dynamic_block(tdefl_compressor *d)
+// Builds the Huffman tables for a dynamic block from m_huff_count, and the run length coded code sizes that go in its header.
+// Returns the number of entries in packed_code_sizes.
+static mz_uint tdefl_pack_code_sizes(tdefl_compressor *d, mz_uint8 *packed_code_sizes, int *pNum_lit_codes, int *pNum_dist_codes, int *pNum_bit_lengths)
 {
-  int num_lit_codes, num_dist_codes, num_bit_lengths; mz_uint i, total_code_sizes_to_pack, num_packed_code_sizes, rle_z_count, rle_repeat_count, packed_code_sizes_index;
-  mz_uint8 code_sizes_to_pack[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1], packed_code_sizes[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1], prev_code_size = 0xFF;
+  int num_lit_codes, num_dist_codes, num_bit_lengths; mz_uint i, total_code_sizes_to_pack, num_packed_code_sizes, rle_z_count, rle_repeat_count;
+  mz_uint8 code_sizes_to_pack[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1], prev_code_size = 0xFF;
 
   d->m_huff_count[0][256] = 1;
 
@@ -1891,13 +2222,26 @@ static void tdefl_start_dynamic_block(tdefl_compressor *d)
 
   tdefl_optimize_huffman_table(d, 2, TDEFL_MAX_HUFF_SYMBOLS_2, 7, MZ_FALSE);
 
+  for (num_bit_lengths = 18; num_bit_lengths >= 0; num_bit_lengths--) if (d->m_huff_code_sizes[2][s_tdefl_packed_code_size_syms_swizzle[num_bit_lengths]]) break;
+  num_bit_lengths = MZ_MAX(4, (num_bit_lengths + 1));
+
+  *pNum_lit_codes = num_lit_codes; *pNum_dist_codes = num_dist_codes; *pNum_bit_lengths = num_bit_lengths;
+  return num_packed_code_sizes;
+}
+
+static void tdefl_start_dynamic_block(tdefl_compressor *d)
+{
+  int num_lit_codes, num_dist_codes, num_bit_lengths; mz_uint i, num_packed_code_sizes, packed_code_sizes_index;
+  mz_uint8 packed_code_sizes[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1];
+
+  num_packed_code_sizes = tdefl_pack_code_sizes(d, packed_code_sizes, &num_lit_codes, &num_dist_codes, &num_bit_lengths);
+
   TDEFL_PUT_BITS(2, 2);
 
   TDEFL_PUT_BITS(num_lit_codes - 257, 5);
   TDEFL_PUT_BITS(num_dist_codes - 1, 5);
 
-  for (num_bit_lengths = 18; num_bit_lengths >= 0; num_bit_lengths--) if (d->m_huff_code_sizes[2][s_tdefl_packed_code_size_syms_swizzle[num_bit_lengths]]) break;
-  num_bit_lengths = MZ_MAX(4, (num_bit_lengths + 1)); TDEFL_PUT_BITS(num_bit_lengths - 4, 4);
+  TDEFL_PUT_BITS(num_bit_lengths - 4, 4);
   for (i = 0; (int)i < num_bit_lengths; i++) TDEFL_PUT_BITS(d->m_huff_code_sizes[2][s_tdefl_packed_code_size_syms_swizzle[i]], 3);
 
   for (packed_code_sizes_index = 0; packed_code_sizes_index < num_packed_code_sizes; )
@@ -1929,19 +2273,18 @@ static void tdefl_start_static_block(tdefl_compressor *d)
 static const mz_uint mz_bitmasks[17] = { 0x0000, 0x0001, 0x0003, 0x0007, 0x000F, 0x001F, 0x003F, 0x007F, 0x00FF, 0x01FF, 0x03FF, 0x07FF, 0x0FFF, 0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF };
 
 #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN && MINIZ_HAS_64BIT_REGISTERS
-static mz_bool tdefl_compress_lz_codes(tdefl_compressor *d)
+static mz_bool tdefl_compress_lz_codes(tdefl_compressor *d, const mz_uint8 *pLZ_code_buf, const mz_uint8 *pLZ_code_buf_end)
 {
   mz_uint flags;
-  mz_uint8 *pLZ_codes;
+  const mz_uint8 *pLZ_codes;
   mz_uint8 *pOutput_buf = d->m_pOutput_buf;
-  mz_uint8 *pLZ_code_buf_end = d->m_pLZ_code_buf;
   mz_uint64 bit_buffer = d->m_bit_buffer;
   mz_uint bits_in = d->m_bits_in;
 
 #define TDEFL_PUT_BITS_FAST(b, l) { bit_buffer |= (((mz_uint64)(b)) << bits_in); bits_in += (l); }
 
   flags = 1;
-  for (pLZ_codes = d->m_lz_code_buf; pLZ_codes < pLZ_code_buf_end; flags >>= 1)
+  for (pLZ_codes = pLZ_code_buf; pLZ_codes < pLZ_code_buf_end; flags >>= 1)
   {
     if (flags == 1)
       flags = *pLZ_codes++ | 0x100;
@@ -2018,13 +2361,13 @@ static mz_bool tdefl_compress_lz_codes(tdefl_compressor *d)
   return (d->m_pOutput_buf < d->m_pOutput_buf_end);
 }
 #else
-static mz_bool tdefl_compress_lz_codes(tdefl_compressor *d)
+static mz_bool tdefl_compress_lz_codes(tdefl_compressor *d, const mz_uint8 *pLZ_code_buf, const mz_uint8 *pLZ_code_buf_end)
 {
   mz_uint flags;
-  mz_uint8 *pLZ_codes;
+  const mz_uint8 *pLZ_codes;
 
   flags = 1;
-  for (pLZ_codes = d->m_lz_code_buf; pLZ_codes < d->m_pLZ_code_buf; flags >>= 1)
+  for (pLZ_codes = pLZ_code_buf; pLZ_codes < pLZ_code_buf_end; flags >>= 1)
   {
     if (flags == 1)
       flags = *pLZ_codes++ | 0x100;
@@ -2063,13 +2406,170 @@ static mz_bool tdefl_compress_lz_codes(tdefl_compressor *d)
 }
 #endif // MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN && MINIZ_HAS_64BIT_REGISTERS
 
-static mz_bool tdefl_compress_block(tdefl_compressor *d, mz_bool static_block)
+// Compresses the LZ codes from pLZ_code_buf (which must be a flags byte) to pLZ_code_buf_end into a block, without the BFINAL bit.
+static mz_bool tdefl_compress_block(tdefl_compressor *d, mz_bool static_block, const mz_uint8 *pLZ_code_buf, const mz_uint8 *pLZ_code_buf_end)
 {
   if (static_block)
     tdefl_start_static_block(d);
   else
     tdefl_start_dynamic_block(d);
-  return tdefl_compress_lz_codes(d);
+  return tdefl_compress_lz_codes(d, pLZ_code_buf, pLZ_code_buf_end);
+}
+
+static void tdefl_put_stored_block(tdefl_compressor *d, mz_uint dict_pos, mz_uint len)
+{
+  mz_uint i, n = len;
+  TDEFL_PUT_BITS(0, 2);
+  if (d->m_bits_in) { TDEFL_PUT_BITS(0, 8 - d->m_bits_in); }
+  for (i = 2; i; --i, n ^= 0xFFFF)
+  {
+    TDEFL_PUT_BITS(n & 0xFFFF, 16);
+  }
+  for (i = 0; i < len; ++i)
+  {
+    TDEFL_PUT_BITS(d->m_dict[(dict_pos + i) & TDEFL_LZ_DICT_SIZE_MASK], 8);
+  }
+}
+
+// Block splitting, for TDEFL_SPLIT_BLOCKS. The LZ code buffer is cut into up to TDEFL_SPLIT_CHUNKS chunks of whole flag groups (a flags byte
+// and up to 8 codes), and blocks are split between chunks. Keeping running symbol counts at each chunk boundary makes the cost of any run of
+// chunks quick to work out.
+enum { TDEFL_SPLIT_CHUNKS = 64, TDEFL_MAX_SPLIT_BLOCKS = 32 };
+
+typedef struct
+{
+  mz_uint m_num_chunks;
+  mz_bool m_stored_ok;
+  mz_uint16 m_ofs[TDEFL_SPLIT_CHUNKS + 1];
+  mz_uint m_extra_bits[TDEFL_SPLIT_CHUNKS + 1], m_lz_bytes[TDEFL_SPLIT_CHUNKS + 1];
+  mz_uint16 m_counts[TDEFL_SPLIT_CHUNKS + 1][TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1];
+} tdefl_split_state;
+
+// Returns the size in bits of chunks [c0, c1) as a block of their own, and the cheapest BTYPE for them (0 stored, 1 static, 2 dynamic).
+// Stored blocks are only considered when allowed and they fit. The symbol counts are left in m_huff_count, ready for tdefl_compress_block().
+static mz_uint tdefl_split_cost(tdefl_compressor *d, const tdefl_split_state *s, mz_uint c0, mz_uint c1, int *pBlock_type)
+{
+  mz_uint i, extra_bits = s->m_extra_bits[c1] - s->m_extra_bits[c0], lz_bytes = s->m_lz_bytes[c1] - s->m_lz_bytes[c0], static_bits, best_bits;
+
+  for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_0; i++) d->m_huff_count[0][i] = (mz_uint16)(s->m_counts[c1][i] - s->m_counts[c0][i]);
+  for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_1; i++) d->m_huff_count[1][i] = (mz_uint16)(s->m_counts[c1][TDEFL_MAX_HUFF_SYMBOLS_0 + i] - s->m_counts[c0][TDEFL_MAX_HUFF_SYMBOLS_0 + i]);
+  d->m_huff_count[0][256] = 1;
+
+  // Static block: 3 header bits, and code sizes 8/9/7/8 and 5.
+  static_bits = 3 + extra_bits;
+  for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_0; i++) static_bits += d->m_huff_count[0][i] * ((i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8);
+  for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_1; i++) static_bits += d->m_huff_count[1][i] * 5;
+  best_bits = static_bits; *pBlock_type = 1;
+
+  if (!(d->m_flags & TDEFL_FORCE_ALL_STATIC_BLOCKS))
+  {
+    int num_lit_codes, num_dist_codes, num_bit_lengths; mz_uint num_packed_code_sizes, dynamic_bits;
+    mz_uint8 packed_code_sizes[TDEFL_MAX_HUFF_SYMBOLS_0 + TDEFL_MAX_HUFF_SYMBOLS_1];
+    num_packed_code_sizes = tdefl_pack_code_sizes(d, packed_code_sizes, &num_lit_codes, &num_dist_codes, &num_bit_lengths);
+    dynamic_bits = 3 + 5 + 5 + 4 + 3 * num_bit_lengths + extra_bits;
+    for (i = 0; i < num_packed_code_sizes; i++)
+    {
+      mz_uint code = packed_code_sizes[i];
+      dynamic_bits += d->m_huff_code_sizes[2][code];
+      if (code >= 16) { dynamic_bits += "\02\03\07"[code - 16]; i++; }
+    }
+    for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_0; i++) dynamic_bits += d->m_huff_count[0][i] * d->m_huff_code_sizes[0][i];
+    for (i = 0; i < TDEFL_MAX_HUFF_SYMBOLS_1; i++) dynamic_bits += d->m_huff_count[1][i] * d->m_huff_code_sizes[1][i];
+    if (dynamic_bits < best_bits) { best_bits = dynamic_bits; *pBlock_type = 2; }
+  }
+
+  // Stored block: up to 7 bits to get to a byte boundary, LEN and NLEN, and the bytes.
+  if ((s->m_stored_ok) && (lz_bytes <= 0xFFFF) && (3 + 7 + 32 + 8 * lz_bytes < best_bits)) { best_bits = 3 + 7 + 32 + 8 * lz_bytes; *pBlock_type = 0; }
+  return best_bits;
+}
+
+// Looks for the split of chunks [c0, c1) into two blocks that's cheapest, if it's cheaper than cost (the cost of the whole), and goes on with
+// both halves. Split points are appended to pSplits in order.
+static void tdefl_split_block(tdefl_compressor *d, const tdefl_split_state *s, mz_uint c0, mz_uint c1, mz_uint cost, mz_uint *pSplits, mz_uint *pNum_splits)
+{
+  mz_uint c, best_split = 0, best_cost = cost, best_left = 0, best_right = 0;
+  int block_type;
+
+  for (c = c0 + 1; c < c1; c++)
+  {
+    mz_uint left = tdefl_split_cost(d, s, c0, c, &block_type), right = tdefl_split_cost(d, s, c, c1, &block_type);
+    if (left + right < best_cost) { best_split = c; best_cost = left + right; best_left = left; best_right = right; }
+  }
+  if (!best_split)
+    return;
+  tdefl_split_block(d, s, c0, best_split, best_left, pSplits, pNum_splits);
+  if (*pNum_splits >= TDEFL_MAX_SPLIT_BLOCKS - 1)
+    return;
+  pSplits[(*pNum_splits)++] = best_split;
+  tdefl_split_block(d, s, best_split, c1, best_right, pSplits, pNum_splits);
+}
+
+// Compresses all of the LZ code buffer as one or more blocks, for TDEFL_SPLIT_BLOCKS. The last one gets the BFINAL bit if final is set.
+static mz_bool tdefl_compress_split_blocks(tdefl_compressor *d, mz_bool final, mz_bool stored_ok)
+{
+  tdefl_split_state s;
+  mz_uint i, c, num_groups = 0, groups_per_chunk, splits[TDEFL_MAX_SPLIT_BLOCKS], num_splits = 0;
+  const mz_uint8 *pLZ_codes, *pLZ_code_buf_end = d->m_pLZ_code_buf;
+  int block_type;
+
+  for (pLZ_codes = d->m_lz_code_buf; pLZ_codes < pLZ_code_buf_end; num_groups++)
+  {
+    mz_uint flags = *pLZ_codes++ | 0x100;
+    for ( ; (flags != 1) && (pLZ_codes < pLZ_code_buf_end); flags >>= 1)
+      pLZ_codes += (flags & 1) ? 3 : 1;
+  }
+  groups_per_chunk = (num_groups + TDEFL_SPLIT_CHUNKS - 1) / TDEFL_SPLIT_CHUNKS;
+
+  // Running counts: chunk c covers codes m_ofs[c] to m_ofs[c + 1], and its symbols are m_counts[c + 1] - m_counts[c].
+  s.m_stored_ok = stored_ok; s.m_ofs[0] = 0; s.m_extra_bits[0] = 0; s.m_lz_bytes[0] = 0; memset(s.m_counts[0], 0, sizeof(s.m_counts[0]));
+  for (pLZ_codes = d->m_lz_code_buf, c = 0; pLZ_codes < pLZ_code_buf_end; c++)
+  {
+    mz_uint16 *pCounts = s.m_counts[c + 1]; mz_uint extra_bits = s.m_extra_bits[c], lz_bytes = s.m_lz_bytes[c];
+    memcpy(pCounts, s.m_counts[c], sizeof(s.m_counts[c]));
+    for (i = 0; (i < groups_per_chunk) && (pLZ_codes < pLZ_code_buf_end); i++)
+    {
+      mz_uint flags = *pLZ_codes++ | 0x100;
+      for ( ; (flags != 1) && (pLZ_codes < pLZ_code_buf_end); flags >>= 1)
+      {
+        if (flags & 1)
+        {
+          mz_uint match_len = pLZ_codes[0], match_dist = (pLZ_codes[1] | (pLZ_codes[2] << 8)); pLZ_codes += 3;
+          pCounts[s_tdefl_len_sym[match_len]]++;
+          if (match_dist < 512)
+          {
+            pCounts[TDEFL_MAX_HUFF_SYMBOLS_0 + s_tdefl_small_dist_sym[match_dist]]++; extra_bits += s_tdefl_small_dist_extra[match_dist];
+          }
+          else
+          {
+            pCounts[TDEFL_MAX_HUFF_SYMBOLS_0 + s_tdefl_large_dist_sym[match_dist >> 8]]++; extra_bits += s_tdefl_large_dist_extra[match_dist >> 8];
+          }
+          extra_bits += s_tdefl_len_extra[match_len];
+          lz_bytes += match_len + TDEFL_MIN_MATCH_LEN;
+        }
+        else
+        {
+          pCounts[*pLZ_codes++]++;
+          lz_bytes++;
+        }
+      }
+    }
+    s.m_ofs[c + 1] = (mz_uint16)(pLZ_codes - d->m_lz_code_buf); s.m_extra_bits[c + 1] = extra_bits; s.m_lz_bytes[c + 1] = lz_bytes;
+  }
+  s.m_num_chunks = c;
+
+  tdefl_split_block(d, &s, 0, s.m_num_chunks, tdefl_split_cost(d, &s, 0, s.m_num_chunks, &block_type), splits, &num_splits);
+  splits[num_splits] = s.m_num_chunks;
+
+  for (i = 0, c = 0; i <= num_splits; c = splits[i++])
+  {
+    tdefl_split_cost(d, &s, c, splits[i], &block_type);
+    TDEFL_PUT_BITS((final) && (i == num_splits), 1);
+    if (!block_type)
+      tdefl_put_stored_block(d, d->m_lz_code_buf_dict_pos + s.m_lz_bytes[c], s.m_lz_bytes[splits[i]] - s.m_lz_bytes[c]);
+    else if (!tdefl_compress_block(d, block_type == 1, d->m_lz_code_buf + s.m_ofs[c], d->m_lz_code_buf + s.m_ofs[splits[i]]))
+      return MZ_FALSE;
+  }
+  return MZ_TRUE;
 }
 
 static int tdefl_flush_block(tdefl_compressor *d, int flush)
@@ -2095,34 +2595,41 @@ static int tdefl_flush_block(tdefl_compressor *d, int flush)
     TDEFL_PUT_BITS(0x78, 8); TDEFL_PUT_BITS(0x01, 8);
   }
 
-  TDEFL_PUT_BITS(flush == TDEFL_FINISH, 1);
-
   pSaved_output_buf = d->m_pOutput_buf; saved_bit_buf = d->m_bit_buffer; saved_bits_in = d->m_bits_in;
 
-  if (!use_raw_block)
-    comp_block_succeeded = tdefl_compress_block(d, (d->m_flags & TDEFL_FORCE_ALL_STATIC_BLOCKS) || (d->m_total_lz_bytes < 48));
-
-  // If the block gets expanded, forget the current contents of the output buffer and send a raw block instead.
-  if ( ((use_raw_block) || ((d->m_total_lz_bytes) && ((d->m_pOutput_buf - pSaved_output_buf + 1U) >= d->m_total_lz_bytes))) &&
-       ((d->m_lookahead_pos - d->m_lz_code_buf_dict_pos) <= d->m_dict_size) )
+  if ((d->m_flags & TDEFL_SPLIT_BLOCKS) && (!use_raw_block) && (d->m_total_lz_bytes))
   {
-    mz_uint i; d->m_pOutput_buf = pSaved_output_buf; d->m_bit_buffer = saved_bit_buf, d->m_bits_in = saved_bits_in;
-    TDEFL_PUT_BITS(0, 2);
-    if (d->m_bits_in) { TDEFL_PUT_BITS(0, 8 - d->m_bits_in); }
-    for (i = 2; i; --i, d->m_total_lz_bytes ^= 0xFFFF)
-    {
-      TDEFL_PUT_BITS(d->m_total_lz_bytes & 0xFFFF, 16);
-    }
-    for (i = 0; i < d->m_total_lz_bytes; ++i)
+    comp_block_succeeded = tdefl_compress_split_blocks(d, flush == TDEFL_FINISH, (d->m_lookahead_pos - d->m_lz_code_buf_dict_pos) <= d->m_dict_size);
+    // Split blocks are never bigger than static codes for the whole, but to be safe fall back to those like below.
+    if (!comp_block_succeeded)
     {
-      TDEFL_PUT_BITS(d->m_dict[(d->m_lz_code_buf_dict_pos + i) & TDEFL_LZ_DICT_SIZE_MASK], 8);
+      d->m_pOutput_buf = pSaved_output_buf; d->m_bit_buffer = saved_bit_buf, d->m_bits_in = saved_bits_in;
+      TDEFL_PUT_BITS(flush == TDEFL_FINISH, 1);
+      tdefl_compress_block(d, MZ_TRUE, d->m_lz_code_buf, d->m_pLZ_code_buf);
     }
   }
-  // Check for the extremely unlikely (if not impossible) case of the compressed block not fitting into the output buffer when using dynamic codes.
-  else if (!comp_block_succeeded)
+  else
   {
-    d->m_pOutput_buf = pSaved_output_buf; d->m_bit_buffer = saved_bit_buf, d->m_bits_in = saved_bits_in;
-    tdefl_compress_block(d, MZ_TRUE);
+    TDEFL_PUT_BITS(flush == TDEFL_FINISH, 1);
+
+    pSaved_output_buf = d->m_pOutput_buf; saved_bit_buf = d->m_bit_buffer; saved_bits_in = d->m_bits_in;
+
+    if (!use_raw_block)
+      comp_block_succeeded = tdefl_compress_block(d, (d->m_flags & TDEFL_FORCE_ALL_STATIC_BLOCKS) || (d->m_total_lz_bytes < 48), d->m_lz_code_buf, d->m_pLZ_code_buf);
+
+    // If the block gets expanded, forget the current contents of the output buffer and send a raw block instead.
+    if ( ((use_raw_block) || ((d->m_total_lz_bytes) && ((d->m_pOutput_buf - pSaved_output_buf + 1U) >= d->m_total_lz_bytes))) &&
+         ((d->m_lookahead_pos - d->m_lz_code_buf_dict_pos) <= d->m_dict_size) )
+    {
+      d->m_pOutput_buf = pSaved_output_buf; d->m_bit_buffer = saved_bit_buf, d->m_bits_in = saved_bits_in;
+      tdefl_put_stored_block(d, d->m_lz_code_buf_dict_pos, d->m_total_lz_bytes);
+    }
+    // Check for the extremely unlikely (if not impossible) case of the compressed block not fitting into the output buffer when using dynamic codes.
+    else if (!comp_block_succeeded)
+    {
+      d->m_pOutput_buf = pSaved_output_buf; d->m_bit_buffer = saved_bit_buf, d->m_bits_in = saved_bits_in;
+      tdefl_compress_block(d, MZ_TRUE, d->m_lz_code_buf, d->m_pLZ_code_buf);
+    }
   }
 
   if (flush)
@@ -2173,6 +2680,61 @@ static int tdefl_flush_block(tdefl_compressor *d, int flush)
   return d->m_output_flush_remaining;
 }
 
+// Returns the number of leading bytes (at most max_len) that p and q have in common. The variant used is bound by mz_cpu_init().
+static mz_uint tdefl_match_len_scalar(const mz_uint8 *p, const mz_uint8 *q, mz_uint max_len)
+{
+  mz_uint len = 0;
+#if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN && MINIZ_HAS_64BIT_REGISTERS && defined(__GNUC__)
+  // 8 bytes at a time; the lowest differing bit is in the first differing byte
+  for ( ; len + 8 <= max_len; len += 8)
+  {
+    mz_uint64 diff = MZ_READ_LE64(p + len) ^ MZ_READ_LE64(q + len);
+    if (diff) return len + ((mz_uint)__builtin_ctzll(diff) >> 3);
+  }
+#elif MINIZ_USE_UNALIGNED_LOADS_AND_STORES
+  while ((len + 2 <= max_len) && (*(const mz_uint16*)(p + len) == *(const mz_uint16*)(q + len))) len += 2;
+#endif
+  while ((len < max_len) && (p[len] == q[len])) len++;
+  return len;
+}
+
+#if MINIZ_X86_SIMD
+static MZ_TARGET("sse2") mz_uint tdefl_match_len_sse2(const mz_uint8 *p, const mz_uint8 *q, mz_uint max_len)
+{
+  mz_uint len = 0;
+  for ( ; len + 16 <= max_len; len += 16)
+  {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + len)), _mm_loadu_si128((const __m128i*)(q + len)))) ^ 0xFFFF;
+    if (mask) return len + __builtin_ctz(mask);
+  }
+  while ((len < max_len) && (p[len] == q[len])) len++;
+  return len;
+}
+
+static MZ_TARGET("avx2") mz_uint tdefl_match_len_avx2(const mz_uint8 *p, const mz_uint8 *q, mz_uint max_len)
+{
+  mz_uint len = 0;
+  for ( ; len + 32 <= max_len; len += 32)
+  {
+    mz_uint32 mask = ~(mz_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + len)), _mm256_loadu_si256((const __m256i*)(q + len))));
+    if (mask) return len + __builtin_ctz(mask);
+  }
+  if (len + 16 <= max_len)
+  {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + len)), _mm_loadu_si128((const __m128i*)(q + len)))) ^ 0xFFFF;
+    if (mask) return len + __builtin_ctz(mask);
+    len += 16;
+  }
+  while ((len < max_len) && (p[len] == q[len])) len++;
+  return len;
+}
+#endif // MINIZ_X86_SIMD
+
+static mz_uint (*tdefl_match_len_func)(const mz_uint8 *p, const mz_uint8 *q, mz_uint max_len) = tdefl_match_len_scalar;
+
+// Hash of the 4 bytes at the start of a TDEFL_PIXEL_HASH match, 'bits' wide (Knuth's multiplicative hash: the top bits depend on all the input bits).
+#define TDEFL_PIXEL_HASH_FUNC(quad, bits) (((mz_uint32)(quad) * 2654435761U) >> (32 - (bits)))
+
 #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES
 #define TDEFL_READ_UNALIGNED_WORD(p) *(const mz_uint16*)(p)
 static __forceinline void tdefl_find_match(tdefl_compressor *d, mz_uint lookahead_pos, mz_uint max_dist, mz_uint max_match_len, mz_uint *pMatch_dist, mz_uint *pMatch_len)
@@ -2180,7 +2742,7 @@ static __forceinline void tdefl_find_match(tdefl_compressor *d, mz_uint lookahea
 {
   mz_uint dist, pos = lookahead_pos & TDEFL_LZ_DICT_SIZE_MASK, match_len = *pMatch_len, probe_pos = pos, next_probe_pos, probe_len;
   mz_uint num_probes_left = d->m_max_probes[match_len >= 32];
-  const mz_uint16 *s = (const mz_uint16*)(d->m_dict + pos), *p, *q;
+  const mz_uint16 *s = (const mz_uint16*)(d->m_dict + pos), *q;
   mz_uint16 c01 = TDEFL_READ_UNALIGNED_WORD(&d->m_dict[pos + match_len - 1]), s01 = TDEFL_READ_UNALIGNED_WORD(s);
   MZ_ASSERT(max_match_len <= TDEFL_MAX_MATCH_LEN); if (max_match_len <= match_len) return;
   for ( ; ; )
@@ -2195,16 +2757,15 @@ static __forceinline void tdefl_find_match(tdefl_compressor *d, mz_uint lookahea
         if (TDEFL_READ_UNALIGNED_WORD(&d->m_dict[probe_pos + match_len - 1]) == c01) break;
       TDEFL_PROBE; TDEFL_PROBE; TDEFL_PROBE;
     }
-    if (!dist) break; q = (const mz_uint16*)(d->m_dict + probe_pos); if (TDEFL_READ_UNALIGNED_WORD(q) != s01) continue; p = s; probe_len = 32;
-    do { } while ( (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) && (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) &&
-                   (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) && (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) && (--probe_len > 0) );
-    if (!probe_len)
+    if (!dist) break; q = (const mz_uint16*)(d->m_dict + probe_pos); if (TDEFL_READ_UNALIGNED_WORD(q) != s01) continue;
+    probe_len = 2 + ((max_match_len > 2) ? tdefl_match_len_func((const mz_uint8*)s + 2, (const mz_uint8*)q + 2, max_match_len - 2) : 0);
+    if (probe_len >= max_match_len)
     {
-      *pMatch_dist = dist; *pMatch_len = MZ_MIN(max_match_len, TDEFL_MAX_MATCH_LEN); break;
+      *pMatch_dist = dist; *pMatch_len = max_match_len; break;
     }
-    else if ((probe_len = ((mz_uint)(p - s) * 2) + (mz_uint)(*(const mz_uint8*)p == *(const mz_uint8*)q)) > match_len)
+    else if (probe_len > match_len)
     {
-      *pMatch_dist = dist; if ((*pMatch_len = match_len = MZ_MIN(max_match_len, probe_len)) == max_match_len) break;
+      *pMatch_dist = dist; *pMatch_len = match_len = probe_len;
       c01 = TDEFL_READ_UNALIGNED_WORD(&d->m_dict[pos + match_len - 1]);
     }
   }
@@ -2239,6 +2800,17 @@ static __forceinline void tdefl_find_match(tdefl_compressor *d, mz_uint lookahea
 }
 #endif // #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES
 
+// Whether tdefl_compress() uses tdefl_compress_fast() for these flags
+static mz_bool tdefl_uses_compress_fast(mz_uint flags)
+{
+#if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
+  return ((flags & TDEFL_MAX_PROBES_MASK) == 1) && ((flags & TDEFL_GREEDY_PARSING_FLAG) != 0) &&
+    ((flags & (TDEFL_FILTER_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS | TDEFL_RLE_MATCHES)) == 0);
+#else
+  (void)flags; return MZ_FALSE;
+#endif
+}
+
 #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
 static mz_bool tdefl_compress_fast(tdefl_compressor *d)
 {
@@ -2246,6 +2818,7 @@ static mz_bool tdefl_compress_fast(tdefl_compressor *d)
   mz_uint lookahead_pos = d->m_lookahead_pos, lookahead_size = d->m_lookahead_size, dict_size = d->m_dict_size, total_lz_bytes = d->m_total_lz_bytes, num_flags_left = d->m_num_flags_left;
   mz_uint8 *pLZ_code_buf = d->m_pLZ_code_buf, *pLZ_flags = d->m_pLZ_flags;
   mz_uint cur_pos = lookahead_pos & TDEFL_LZ_DICT_SIZE_MASK;
+  const mz_bool pixel_hash = (d->m_flags & TDEFL_PIXEL_HASH) != 0;
 
   while ((d->m_src_buf_left) || ((d->m_flush) && (lookahead_size)))
   {
@@ -2273,21 +2846,16 @@ static mz_bool tdefl_compress_fast(tdefl_compressor *d)
     {
       mz_uint cur_match_dist, cur_match_len = 1;
       mz_uint8 *pCur_dict = d->m_dict + cur_pos;
-      mz_uint first_trigram = (*(const mz_uint32 *)pCur_dict) & 0xFFFFFF;
-      mz_uint hash = (first_trigram ^ (first_trigram >> (24 - (TDEFL_LZ_HASH_BITS - 8)))) & TDEFL_LEVEL1_HASH_SIZE_MASK;
+      mz_uint32 first_quad = *(const mz_uint32 *)pCur_dict;
+      mz_uint first_trigram = first_quad & 0xFFFFFF;
+      mz_uint hash = pixel_hash ? TDEFL_PIXEL_HASH_FUNC(first_quad, TDEFL_LEVEL1_HASH_BITS) : (first_trigram ^ (first_trigram >> (24 - (TDEFL_LZ_HASH_BITS - 8)))) & TDEFL_LEVEL1_HASH_SIZE_MASK;
       mz_uint probe_pos = d->m_hash[hash];
       d->m_hash[hash] = (mz_uint16)lookahead_pos;
 
       if (((cur_match_dist = (mz_uint16)(lookahead_pos - probe_pos)) <= dict_size) && ((*(const mz_uint32 *)(d->m_dict + (probe_pos &= TDEFL_LZ_DICT_SIZE_MASK)) & 0xFFFFFF) == first_trigram))
       {
-        const mz_uint16 *p = (const mz_uint16 *)pCur_dict;
-        const mz_uint16 *q = (const mz_uint16 *)(d->m_dict + probe_pos);
-        mz_uint32 probe_len = 32;
-        do { } while ( (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) && (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) &&
-          (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) && (TDEFL_READ_UNALIGNED_WORD(++p) == TDEFL_READ_UNALIGNED_WORD(++q)) && (--probe_len > 0) );
-        cur_match_len = ((mz_uint)(p - (const mz_uint16 *)pCur_dict) * 2) + (mz_uint)(*(const mz_uint8 *)p == *(const mz_uint8 *)q);
-        if (!probe_len)
-          cur_match_len = cur_match_dist ? TDEFL_MAX_MATCH_LEN : 0;
+        // the dictionary is followed by TDEFL_MAX_MATCH_LEN - 1 mirrored bytes, so both sides can be read that far
+        cur_match_len = cur_match_dist ? 3 + tdefl_match_len_func(pCur_dict + 3, d->m_dict + probe_pos + 3, TDEFL_MAX_MATCH_LEN - 3) : 0;
 
         if ((cur_match_len < TDEFL_MIN_MATCH_LEN) || ((cur_match_len == TDEFL_MIN_MATCH_LEN) && (cur_match_dist >= 8U*1024U)))
         {
@@ -2412,12 +2980,48 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
 {
   const mz_uint8 *pSrc = d->m_pSrc; size_t src_buf_left = d->m_src_buf_left;
   tdefl_flush flush = d->m_flush;
+  // number of bytes hashed for the chains
+  const mz_uint hash_len = (d->m_flags & TDEFL_PIXEL_HASH) ? 4 : TDEFL_MIN_MATCH_LEN;
 
   while ((src_buf_left) || ((flush) && (d->m_lookahead_size)))
   {
     mz_uint len_to_move, cur_match_dist, cur_match_len, cur_pos;
     // Update dictionary and hash chains. Keeps the lookahead size equal to TDEFL_MAX_MATCH_LEN.
-    if ((d->m_lookahead_size + d->m_dict_size) >= (TDEFL_MIN_MATCH_LEN - 1))
+    if (!(d->m_flags & TDEFL_MAX_PROBES_MASK))
+    {
+      // Huffman only: tdefl_find_match() gives up before its first probe, so there are no chains to keep (tdefl_reinit() relies on that)
+      mz_uint dst_pos = (d->m_lookahead_pos + d->m_lookahead_size) & TDEFL_LZ_DICT_SIZE_MASK;
+      mz_uint num_bytes_to_process = (mz_uint)MZ_MIN(src_buf_left, TDEFL_MAX_MATCH_LEN - d->m_lookahead_size);
+      src_buf_left -= num_bytes_to_process;
+      d->m_lookahead_size += num_bytes_to_process;
+      while (num_bytes_to_process)
+      {
+        mz_uint n = MZ_MIN(TDEFL_LZ_DICT_SIZE - dst_pos, num_bytes_to_process);
+        memcpy(d->m_dict + dst_pos, pSrc, n);
+        if (dst_pos < (TDEFL_MAX_MATCH_LEN - 1))
+          memcpy(d->m_dict + TDEFL_LZ_DICT_SIZE + dst_pos, pSrc, MZ_MIN(n, (TDEFL_MAX_MATCH_LEN - 1) - dst_pos));
+        pSrc += n;
+        dst_pos = (dst_pos + n) & TDEFL_LZ_DICT_SIZE_MASK;
+        num_bytes_to_process -= n;
+      }
+    }
+    else if ((hash_len == 4) && ((d->m_lookahead_size + d->m_dict_size) >= 3))
+    {
+      // the 4 bytes at ins_pos end with the one just added (the mirrored bytes past the end of the dictionary are updated first)
+      mz_uint dst_pos = (d->m_lookahead_pos + d->m_lookahead_size) & TDEFL_LZ_DICT_SIZE_MASK, ins_pos = d->m_lookahead_pos + d->m_lookahead_size - 3;
+      mz_uint num_bytes_to_process = (mz_uint)MZ_MIN(src_buf_left, TDEFL_MAX_MATCH_LEN - d->m_lookahead_size);
+      const mz_uint8 *pSrc_end = pSrc + num_bytes_to_process;
+      src_buf_left -= num_bytes_to_process;
+      d->m_lookahead_size += num_bytes_to_process;
+      while (pSrc != pSrc_end)
+      {
+        mz_uint8 c = *pSrc++; mz_uint hash; d->m_dict[dst_pos] = c; if (dst_pos < (TDEFL_MAX_MATCH_LEN - 1)) d->m_dict[TDEFL_LZ_DICT_SIZE + dst_pos] = c;
+        hash = TDEFL_PIXEL_HASH_FUNC(MZ_READ_LE32(&d->m_dict[ins_pos & TDEFL_LZ_DICT_SIZE_MASK]), TDEFL_LZ_HASH_BITS);
+        d->m_next[ins_pos & TDEFL_LZ_DICT_SIZE_MASK] = d->m_hash[hash]; d->m_hash[hash] = (mz_uint16)(ins_pos);
+        dst_pos = (dst_pos + 1) & TDEFL_LZ_DICT_SIZE_MASK; ins_pos++;
+      }
+    }
+    else if ((hash_len == TDEFL_MIN_MATCH_LEN) && ((d->m_lookahead_size + d->m_dict_size) >= (TDEFL_MIN_MATCH_LEN - 1)))
     {
       mz_uint dst_pos = (d->m_lookahead_pos + d->m_lookahead_size) & TDEFL_LZ_DICT_SIZE_MASK, ins_pos = d->m_lookahead_pos + d->m_lookahead_size - 2;
       mz_uint hash = (d->m_dict[ins_pos & TDEFL_LZ_DICT_SIZE_MASK] << TDEFL_LZ_HASH_SHIFT) ^ d->m_dict[(ins_pos + 1) & TDEFL_LZ_DICT_SIZE_MASK];
@@ -2443,10 +3047,11 @@ static mz_bool tdefl_compress_normal(tdefl_compressor *d)
         d->m_dict[dst_pos] = c;
         if (dst_pos < (TDEFL_MAX_MATCH_LEN - 1))
           d->m_dict[TDEFL_LZ_DICT_SIZE + dst_pos] = c;
-        if ((++d->m_lookahead_size + d->m_dict_size) >= TDEFL_MIN_MATCH_LEN)
+        if ((++d->m_lookahead_size + d->m_dict_size) >= hash_len)
         {
-          mz_uint ins_pos = d->m_lookahead_pos + (d->m_lookahead_size - 1) - 2;
-          mz_uint hash = ((d->m_dict[ins_pos & TDEFL_LZ_DICT_SIZE_MASK] << (TDEFL_LZ_HASH_SHIFT * 2)) ^ (d->m_dict[(ins_pos + 1) & TDEFL_LZ_DICT_SIZE_MASK] << TDEFL_LZ_HASH_SHIFT) ^ c) & (TDEFL_LZ_HASH_SIZE - 1);
+          mz_uint ins_pos = d->m_lookahead_pos + d->m_lookahead_size - hash_len;
+          mz_uint hash = (hash_len == 4) ? TDEFL_PIXEL_HASH_FUNC(MZ_READ_LE32(&d->m_dict[ins_pos & TDEFL_LZ_DICT_SIZE_MASK]), TDEFL_LZ_HASH_BITS) :
+            ((d->m_dict[ins_pos & TDEFL_LZ_DICT_SIZE_MASK] << (TDEFL_LZ_HASH_SHIFT * 2)) ^ (d->m_dict[(ins_pos + 1) & TDEFL_LZ_DICT_SIZE_MASK] << TDEFL_LZ_HASH_SHIFT) ^ c) & (TDEFL_LZ_HASH_SIZE - 1);
           d->m_next[ins_pos & TDEFL_LZ_DICT_SIZE_MASK] = d->m_hash[hash]; d->m_hash[hash] = (mz_uint16)(ins_pos);
         }
       }
@@ -2575,9 +3180,7 @@ tdefl_status tdefl_compress(tdefl_compressor *d, const void *pIn_buf, size_t *pI
     return (d->m_prev_return_status = tdefl_flush_output_buffer(d));
 
 #if MINIZ_USE_UNALIGNED_LOADS_AND_STORES && MINIZ_LITTLE_ENDIAN
-  if (((d->m_flags & TDEFL_MAX_PROBES_MASK) == 1) &&
-      ((d->m_flags & TDEFL_GREEDY_PARSING_FLAG) != 0) &&
-      ((d->m_flags & (TDEFL_FILTER_MATCHES | TDEFL_FORCE_ALL_RAW_BLOCKS | TDEFL_RLE_MATCHES)) == 0))
+  if (tdefl_uses_compress_fast(d->m_flags))
   {
     if (!tdefl_compress_fast(d))
       return d->m_prev_return_status;
@@ -2627,6 +3230,25 @@ tdefl_status tdefl_init(tdefl_compressor *d, tdefl_put_buf_func_ptr pPut_buf_fun
   return TDEFL_STATUS_OKAY;
 }
 
+tdefl_status tdefl_reinit(tdefl_compressor *d, tdefl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags)
+{
+  // The hash heads are all zero after a deterministic tdefl_init(). Huffman only streams leave them that way, and tdefl_compress_fast()
+  // only uses the first TDEFL_LEVEL1_HASH_SIZE_MASK + 1. (Positions are stored in 16 bits, too few to tell stale entries apart instead.)
+  mz_uint prev_flags = d->m_flags;
+  if ((flags & TDEFL_NONDETERMINISTIC_PARSING_FLAG) || (prev_flags & TDEFL_NONDETERMINISTIC_PARSING_FLAG))
+    return tdefl_init(d, pPut_buf_func, pPut_buf_user, flags);
+  if ((d->m_lookahead_pos + d->m_lookahead_size) && (prev_flags & TDEFL_MAX_PROBES_MASK))
+  {
+    if (tdefl_uses_compress_fast(prev_flags))
+      memset(d->m_hash, 0, sizeof(d->m_hash[0]) * (TDEFL_LEVEL1_HASH_SIZE_MASK + 1));
+    else
+      MZ_CLEAR_OBJ(d->m_hash);
+  }
+  tdefl_init(d, pPut_buf_func, pPut_buf_user, flags | TDEFL_NONDETERMINISTIC_PARSING_FLAG);
+  d->m_flags = (mz_uint)flags;
+  return TDEFL_STATUS_OKAY;
+}
+
 tdefl_status tdefl_get_prev_return_status(tdefl_compressor *d)
 {
   return d->m_prev_return_status;
@@ -2703,6 +3325,61 @@ mz_uint tdefl_create_comp_flags_from_zip_params(int level, int window_bits, int
   return comp_flags;
 }
 
+// ------------------- Runtime CPU dispatch
+
+unsigned int mz_cpu_features(void)
+{
+  static int s_probed; static unsigned int s_features;
+  if (!s_probed)
+  {
+#if MINIZ_X86_SIMD
+    unsigned int a, b, c, d, max_leaf = __get_cpuid_max(0, NULL);
+    if (max_leaf >= 1)
+    {
+      __cpuid(1, a, b, c, d);
+      if (d & (1U << 26)) s_features |= MZ_CPU_HAS_SSE2;
+      if (c & (1U << 9)) s_features |= MZ_CPU_HAS_SSSE3;
+      if (c & (1U << 19)) s_features |= MZ_CPU_HAS_SSE41;
+      if (c & (1U << 1)) s_features |= MZ_CPU_HAS_PCLMUL;
+      // AVX2 also needs the OS to save the YMM registers (OSXSAVE set, and XCR0 bits 1 and 2).
+      if ((max_leaf >= 7) && (c & (1U << 27)) && (c & (1U << 28)))
+      {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ __volatile__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        __cpuid_count(7, 0, a, b, c, d);
+        if (((xcr0_lo & 6) == 6) && (b & (1U << 5))) s_features |= MZ_CPU_HAS_AVX2;
+      }
+    }
+#endif
+    s_probed = 1;
+  }
+  return s_features;
+}
+
+int mz_cpu_max_level(void)
+{
+  unsigned int f = mz_cpu_features();
+  if (!(f & MZ_CPU_HAS_SSE2)) return MZ_CPU_LEVEL_SCALAR;
+  if (!(f & MZ_CPU_HAS_SSSE3)) return MZ_CPU_LEVEL_SSE2;
+  if (!(f & MZ_CPU_HAS_SSE41)) return MZ_CPU_LEVEL_SSSE3;
+  if (!(f & MZ_CPU_HAS_AVX2)) return MZ_CPU_LEVEL_SSE41;
+  return MZ_CPU_LEVEL_AVX2;
+}
+
+int mz_cpu_init(int level)
+{
+  level = MZ_MAX(MZ_CPU_LEVEL_SCALAR, MZ_MIN(level, mz_cpu_max_level()));
+  mz_adler32_func = mz_adler32_scalar;
+  tdefl_match_len_func = tdefl_match_len_scalar;
+#if MINIZ_X86_SIMD
+  if (level >= MZ_CPU_LEVEL_SSSE3) mz_adler32_func = mz_adler32_ssse3;
+  if (level >= MZ_CPU_LEVEL_AVX2) mz_adler32_func = mz_adler32_avx2;
+  if (level >= MZ_CPU_LEVEL_SSE2) tdefl_match_len_func = tdefl_match_len_sse2;
+  if (level >= MZ_CPU_LEVEL_AVX2) tdefl_match_len_func = tdefl_match_len_avx2;
+#endif
+  return level;
+}
+
 #ifdef _MSC_VER
 #pragma warning (push)
 #pragma warning (disable:4204) // nonstandard extension used : non-constant aggregate initializer (also supported by GNU C and C99, so no big deal)
@@ -2725,7 +3402,7 @@ void *tdefl_write_image_to_png_file_in_memory(const void *pImage, int w, int h,
   *pLen_out = out_buf.m_size-41;
   {
     mz_uint8 pnghdr[41]={0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,0x00,0x00,0x00,0x0d,0x49,0x48,0x44,0x52,
-      0,0,(mz_uint8)(w>>8),(mz_uint8)w,0,0,(mz_uint8)(h>>8),(mz_uint8)h,8,"\0\0\04\02\06"[num_chans],0,0,0,0,0,0,0,
+      (mz_uint8)(w>>24),(mz_uint8)(w>>16),(mz_uint8)(w>>8),(mz_uint8)w,(mz_uint8)(h>>24),(mz_uint8)(h>>16),(mz_uint8)(h>>8),(mz_uint8)h,8,"\0\0\04\02\06"[num_chans],0,0,0,0,0,0,0,
       (mz_uint8)(*pLen_out>>24),(mz_uint8)(*pLen_out>>16),(mz_uint8)(*pLen_out>>8),(mz_uint8)*pLen_out,0x49,0x44,0x41,0x54};
     c=(mz_uint32)mz_crc32(MZ_CRC32_INIT,pnghdr+12,17); for (i=0; i<4; ++i, c<<=8) ((mz_uint8*)(pnghdr+29))[i]=(mz_uint8)(c>>24);
     memcpy(out_buf.m_pBuf, pnghdr, 41);
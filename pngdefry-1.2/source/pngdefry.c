@@ -40,6 +40,9 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "miniz.c"
 
@@ -50,6 +53,11 @@ int flag_Process_Anyway = 0;
 int flag_List_Chunks = 0;
 int flag_Debug = 0;
 int flag_UpdateAlpha = 1;
+int flag_DropAlpha = 0;		/* -A: write fully opaque -iphone RGBA images as RGB */
+int flag_FastRepack = 0;	/* -f: repack with single probe LZ matching instead of Huffman coding only */
+int flag_MaxCompress = 0;	/* -z: try several row filter choices and keep the smallest */
+int flag_Validate = 0;		/* -V: only check the files, reading each once with constant memory use */
+int flag_Stats = 0;			/* --stats=json: end with per file and batch statistics as JSON */
 
 /* do not ignore bad CRC32, as proposed by Tatsh (https://github.com/Tatsh/pngdefry) */
 /* ignoring a bad CRC32 is considered a possible vulnerability */
@@ -58,13 +66,28 @@ int flag_Ignore_CRC32 = 0;
 
 int repack_IDAT_size = 524288;	/* 512K -- seems a bit much to me, axually, but have seen this used */
 
+/* -m: images whose image data would take more than this are repacked a row at a time */
+size_t memory_budget = (size_t)1024*1048576;
+
 int flag_Rewrite = 0;
 
+int thumbnail_width = 0;	/* -t: write a thumbnail this wide instead */
+int flag_Raw = 0;			/* 1: --raw, write PAM files; 2: --rawvideo, write bare pixels to stdout */
+FILE *output_stdout = NULL;	/* the real stdout for -o- and --rawvideo; messages go to stderr then */
+
 char *suffix = NULL;
 char *outputPath = NULL;
 
 unsigned char png_magic_bytes[] = "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A";
 
+/* Largest chunk length allowed by the PNG specs; the limit for input that can't be measured up front */
+#define MAX_CHUNK_LENGTH	0x7FFFFFFFu
+
+/* Largest image dimensions process() handles, and -V accepts. 2^26-1 pixels
+   of up to 64 bits is a row size that still fits an int */
+#define MAX_IMAGE_WIDTH		67108863u
+#define MAX_IMAGE_HEIGHT	0x7FFFFFFFu
+
 /** Chunk data comes here **/
 
 struct chunk_t {
@@ -102,14 +125,106 @@ unsigned int CRC_256[] = {
 	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-int crc32s (unsigned char *buf, int buf_length)
+/** Processor specific versions of the CRC32 and pixel loops **/
+#include "dispatch.c"
+
+/** Per file and batch statistics, for --stats=json **/
+#include "stats.c"
+
+/** One compressor and decompressor for the whole run, rather than a new one for
+	every image: tdefl_reinit() only clears what the previous image used **/
+
+tdefl_compressor deflator;
+tinfl_decompressor inflator;
+unsigned char inflate_window[TINFL_LZ_DICT_SIZE];
+
+struct deflate_dest_t {
+	unsigned char *data;
+	size_t length, max_length;
+};
+
+int deflate_put (const void *buf, int len, void *user)
 {
-	unsigned int c = 0xffffffff;
-	int i;
-	for (i=0; i < buf_length; i++ )
-		c = CRC_256[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+	struct deflate_dest_t *dest = (struct deflate_dest_t *)user;
+
+	if (dest->length + len > dest->max_length)
+		return 0;
+	memcpy (dest->data + dest->length, buf, len);
+	dest->length += len;
+	return 1;
+}
+
+/*	As tdefl_compress_mem_to_mem: returns the compressed length, or 0 on failure */
+size_t deflate_to_mem (unsigned char *dest, size_t dest_size, const unsigned char *src, size_t src_length, int flags)
+{
+	struct deflate_dest_t out;
+
+	out.data = dest;
+	out.length = 0;
+	out.max_length = dest_size;
+	tdefl_reinit (&deflator, deflate_put, &out, flags);
+	if (tdefl_compress_buffer (&deflator, src, src_length, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+		return 0;
+	return out.length;
+}
+
+/*	As tinfl_decompress_mem_to_mem: returns the inflated length, or TINFL_DECOMPRESS_MEM_TO_MEM_FAILED */
+size_t inflate_to_mem (unsigned char *dest, size_t dest_size, const unsigned char *src, size_t src_length, int flags)
+{
+	tinfl_status status;
+
+	tinfl_init (&inflator);
+	status = tinfl_decompress (&inflator, src, &src_length, dest, dest, &dest_size, (flags & ~TINFL_FLAG_HAS_MORE_INPUT) | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+	return status == TINFL_STATUS_DONE ? dest_size : TINFL_DECOMPRESS_MEM_TO_MEM_FAILED;
+}
+
+/*	Turn the raw deflate stream in src into a zlib stream in dest (which needs room
+	for src_length+6 bytes) without recompressing it. The stream is inflated through
+	a 32K window, only to find where it ends and what its Adler-32 is; the compressed
+	bytes are copied as they are. *inflated_length is set to the inflated size.
+	Returns the zlib stream length, or 0 on a decompression error */
+size_t rewrap_zlib (unsigned char *dest, const unsigned char *src, size_t src_length, size_t *inflated_length)
+{
+	tinfl_status status;
+	size_t in_pos = 0, out_pos = 0, in_bytes, out_bytes, stream_length;
+	mz_uint32 adler;
+
+	*inflated_length = 0;
+	tinfl_init (&inflator);
+	do
+	{
+		in_bytes = src_length - in_pos;
+		out_bytes = TINFL_LZ_DICT_SIZE - out_pos;
+		status = tinfl_decompress (&inflator, src+in_pos, &in_bytes, inflate_window, inflate_window+out_pos, &out_bytes, TINFL_FLAG_COMPUTE_ADLER32);
+		in_pos += in_bytes;
+		out_pos = (out_pos + out_bytes) & (TINFL_LZ_DICT_SIZE-1);
+		*inflated_length += out_bytes;
+	} while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+	if (status != TINFL_STATUS_DONE)
+		return 0;
+
+	/* the inflator may have read a few bytes past the end into its bit buffer */
+	stream_length = in_pos - (inflator.m_num_bits >> 3);
+	adler = inflator.m_check_adler32;
+
+	/* deflate, 32K window, default level; 0x789C is a multiple of 31 as it should be */
+	dest[0] = 0x78;
+	dest[1] = 0x9C;
+	memcpy (dest+2, src, stream_length);
+	dest[2+stream_length  ] = (adler >> 24) & 0xff;
+	dest[2+stream_length+1] = (adler >> 16) & 0xff;
+	dest[2+stream_length+2] = (adler >>  8) & 0xff;
+	dest[2+stream_length+3] = (adler      ) & 0xff;
+	return stream_length+6;
+}
+
+/** Full image decoding for -t and --raw, and thumbnails for -t **/
+#include "decode.c"
+#include "thumbnail.c"
 
-	return (c ^ 0xffffffff);
+int crc32s (unsigned char *buf, int buf_length)
+{
+	return (crc32_block (0xffffffff, buf, buf_length) ^ 0xffffffff);
 };
 
 int get_long (FILE *f)
@@ -128,11 +243,59 @@ int read_long (void *src)
 }
 
 
+/*	Reads 'length' bytes into a new buffer. Big blocks are read a megabyte at a time,
+	and the buffer only grows with data that actually came in, so a bogus length
+	in a stream that can't be measured does not claim all that memory up front.
+	Returns NULL and sets *error to -2 (out of memory) or -3 (premature end of file). */
+unsigned char *read_block (FILE *f, unsigned int length, int *error)
+{
+	unsigned char *data, *grown;
+	unsigned int size, got;
+	size_t bytes_read;
+
+	size = length < 1048576 ? length : 1048576;
+	data = (unsigned char *)malloc (size ? size : 1);
+	if (data == NULL)
+	{
+		*error = -2;
+		return NULL;
+	}
+	got = 0;
+	while (got < length)
+	{
+		if (got == size)
+		{
+			size = length-size < size ? length : 2*size;
+			grown = (unsigned char *)realloc (data, size);
+			if (grown == NULL)
+			{
+				free (data);
+				*error = -2;
+				return NULL;
+			}
+			data = grown;
+		}
+		bytes_read = fread (data+got, 1, size-got, f);
+		if (bytes_read == 0)
+		{
+			free (data);
+			*error = -3;
+			return NULL;
+		}
+		got += bytes_read;
+	}
+	return data;
+}
+
+/* init_chunk() errors, for --stats */
+const char *chunk_failures[] = { "", "chunk_size", "out_of_memory", "truncated", "crc" };
+
 int init_chunk (FILE *f, unsigned int filelength)
 {
 	struct chunk_t one_chunk;
 	unsigned char buf[8];
 	long bytes_read;
+	int error;
 
 	bytes_read = fread (buf, 1,4, f);
 	if (bytes_read != 4)
@@ -154,28 +317,29 @@ int init_chunk (FILE *f, unsigned int filelength)
 		return -1;
 	}
 
-	one_chunk.data = (unsigned char *)malloc (one_chunk.length+4);
+	one_chunk.data = read_block (f, one_chunk.length+4, &error);
 	if (one_chunk.data == NULL)
 	{
 		if (flag_Debug)
-			printf ("    informational : no memory for chunk length %u\n", one_chunk.length);
-		return -2;
-	}
-	if (fread (one_chunk.data, 1, one_chunk.length+4, f) != one_chunk.length+4)
-	{
-		if (flag_Debug)
-			printf ("    informational : failed to read chunk length %u\n", one_chunk.length);
-		return -3;
+		{
+			if (error == -2)
+				printf ("    informational : no memory for chunk length %u\n", one_chunk.length);
+			else
+				printf ("    informational : failed to read chunk length %u\n", one_chunk.length);
+		}
+		return error;
 	}
 	one_chunk.id = (one_chunk.data[0] << 24) + (one_chunk.data[1] << 16) + (one_chunk.data[2] << 8) + one_chunk.data[3];
 
 	if (fread (buf, 1,4, f) != 4)
 	{
+		free (one_chunk.data);
 		if (flag_Debug)
 			printf ("    informational : failed to read chunk crc32\n");
 		return -4;
 	}
 	one_chunk.crc32 = (buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
+	file_stats.in_bytes += one_chunk.length+12;
 
 	if (num_chunks >= max_chunks)
 	{
@@ -208,7 +372,7 @@ void reset_chunks (void)
 
 void demultiplyAlpha (int wide, int high, unsigned char *data)
 {
-	int x,y;
+	int y;
 	unsigned char *srcPtr;
 
 	srcPtr = data;
@@ -217,25 +381,19 @@ void demultiplyAlpha (int wide, int high, unsigned char *data)
 	{
 		/* skip rowfilter -- it's assumed to be 0 here anyway! */
 		srcPtr++;
-		for (x=0; x<4*wide; x+=4)
-		{
-			if (srcPtr[x+3])
-			{
-				srcPtr[x] = (srcPtr[x]*255+(srcPtr[x+3]>>1))/srcPtr[x+3];
-				srcPtr[x+1] = (srcPtr[x+1]*255+(srcPtr[x+3]>>1))/srcPtr[x+3];
-				srcPtr[x+2] = (srcPtr[x+2]*255+(srcPtr[x+3]>>1))/srcPtr[x+3];
-			}
-		}
+		demultiply_pixels (srcPtr, wide);
 		srcPtr += 4*wide;
 	}
 }
 
-void removeRowFilters (int wide, int high, unsigned char *data)
+/*	Returns the AND of all alpha bytes for RGBA, so 255 means fully opaque */
+int removeRowFilters (int wide, int high, int bytespp, unsigned char *data)
 {
-	int x,y, rowfilter;
+	int y, rowfilter, alpha = 255;
 	unsigned char *srcPtr, *upPtr;
 
 	srcPtr = data;
+	upPtr = NULL;
 
 	for (y=0; y<high; y++)
 	{
@@ -243,173 +401,516 @@ void removeRowFilters (int wide, int high, unsigned char *data)
 		/*	Need to save original filter for re-applying! */
 		/*	*srcPtr = 0; */
 		srcPtr++;
-		switch (rowfilter)
+		if (rowfilter > 4)
+			printf ("removerowfilter() : Unknown row filter %d\n", rowfilter);
+		else
 		{
-			case 0:	// None
-				break;
-			case 1:	// Sub
-				for (x=4; x<4*wide; x++)
-				{
-					srcPtr[x] += srcPtr[x-4];
-				}
-				break;
-			case 2:	// Up
-				upPtr = srcPtr - 4*wide - 1;
-				if (y > 0)
-				{
-					for (x=0; x<4*wide; x++)
-					{
-						srcPtr[x] += upPtr[x];
-					}
-				}
-				break;
-			case 3:	// Average
-				upPtr = srcPtr - 4*wide - 1;
-				if (y == 0)
-				{
-					for (x=4; x<4*wide; x++)
-					{
-						srcPtr[x] += (srcPtr[x-4]>>1);
-					}
-				} else
-				{
-					srcPtr[0] += (upPtr[x]>>1);
-					for (x=4; x<4*wide; x++)
-					{
-						srcPtr[x] += ((upPtr[x] + srcPtr[x-4])>>1);
-					}
-				}
-				break;
-			case 4:	// Paeth
-				upPtr = srcPtr - 4*wide - 1;
-				{
-					int p,pa,pb,pc,value;
-					int leftpix,toppix,topleftpix;
+			unfilter_row (rowfilter, srcPtr, upPtr, bytespp*wide, bytespp);
+			if (bytespp == 4 && alpha == 255)
+				alpha = alpha_and (srcPtr, wide);
+		}
+		upPtr = srcPtr;
+		srcPtr += bytespp*wide;
+	}
+	return alpha;
+}
 
-					for (x=0; x<4*wide; x++)
-					{
-						leftpix = 0;
-						toppix = 0;
-						topleftpix = 0;
-						if (x > 0)
-							leftpix = srcPtr[x-4];
-						if (y > 0)
-						{
-							toppix = upPtr[x];
-							if (x >= 4)
-								topleftpix = upPtr[x-4];
-						}
-						p = leftpix + toppix - topleftpix;
-						pa = p - leftpix; if (pa < 0) pa = -pa;
-						pb = p - toppix; if (pb < 0) pb = -pb;
-						pc = p - topleftpix; if (pc < 0) pc = -pc;
-						if (pa <= pb && pa <= pc)
-							value = leftpix;
-						else if (pb <= pc)
-							value = toppix;
-						else
-							value = topleftpix;
+/*	Works bottom to top, so the row above is still unfiltered when it's needed */
+void applyRowFilters (int wide, int high, int bytespp, unsigned char *data)
+{
+	int y, rowfilter;
+	unsigned char *srcPtr, *upPtr;
 
-						srcPtr[x] += value;
-					}
-				}
-				break;
-			default:
-				printf ("removerowfilter() : Unknown row filter %d\n", rowfilter);
+	for (y=high-1; y>=0; y--)
+	{
+		srcPtr = data + (size_t)y*(bytespp*wide+1);
+		rowfilter = *srcPtr;
+		srcPtr++;
+		upPtr = y > 0 ? srcPtr - bytespp*wide - 1 : NULL;
+		if (rowfilter > 4)
+			printf ("applyrowfilter : Unknown row filter %d\n", rowfilter);
+		else
+			refilter_row (rowfilter, srcPtr, upPtr, bytespp*wide, bytespp);
+	}
+}
+
+/*	Remove the alpha bytes from unfiltered RGBA rows and re-filter them as RGB.
+	'dest' may be the same as 'data', or before it. Returns the new data size */
+size_t dropAlpha (int wide, int high, unsigned char *data, unsigned char *dest)
+{
+	int y;
+	unsigned char *destPtr;
+
+	destPtr = dest;
+	for (y=0; y<high; y++)
+	{
+		/* the original row filter is kept; any filter works for RGB as well */
+		*destPtr = *data;
+		strip_alpha (destPtr+1, data+1, wide);
+		destPtr += 3*wide+1;
+		data += 4*wide+1;
+	}
+	applyRowFilters (wide, high, 3, dest);
+	return (size_t)high*(3*wide+1);
+}
+
+/*	The image is RGB now; sBIT has one entry less as well */
+void alphaDropped (struct chunk_t *ihdr_chunk)
+{
+	int i;
+
+	ihdr_chunk->data[13] = 2;
+	ihdr_chunk->crc32 = crc32s (ihdr_chunk->data, ihdr_chunk->length+4);
+	for (i=0; i<num_chunks; i++)
+	{
+		if (pngChunks[i].id == 0x73424954 && pngChunks[i].length == 4)	/* "sBIT" */
+		{
+			pngChunks[i].length = 3;
+			pngChunks[i].crc32 = crc32s (pngChunks[i].data, pngChunks[i].length+4);
 		}
-		srcPtr += 4*wide;
 	}
 }
 
-void applyRowFilters (int wide, int high, unsigned char *data)
+/*	Set the row filter bytes of unfiltered rows: 0..4 for the same filter on
+	every row, 5 for the filter that gives the smallest sum of absolute (signed)
+	differences on each row. 'scratch' holds one row */
+void chooseRowFilters (int wide, int high, int bytespp, unsigned char *data, int strategy, unsigned char *scratch)
 {
-	int x,y, rowfilter;
+	int y, x, rowfilter, sum, best_sum;
 	unsigned char *srcPtr, *upPtr;
 
 	srcPtr = data;
+	upPtr = NULL;
+	for (y=0; y<high; y++)
+	{
+		if (strategy < 5)
+			*srcPtr = strategy;
+		else
+		{
+			best_sum = -1;
+			for (rowfilter=0; rowfilter<5; rowfilter++)
+			{
+				memcpy (scratch, srcPtr+1, bytespp*wide);
+				refilter_row (rowfilter, scratch, upPtr, bytespp*wide, bytespp);
+				sum = 0;
+				for (x=0; x<bytespp*wide; x++)
+					sum += scratch[x] < 128 ? scratch[x] : 256-scratch[x];
+				if (best_sum < 0 || sum < best_sum)
+				{
+					best_sum = sum;
+					*srcPtr = rowfilter;
+				}
+			}
+		}
+		upPtr = srcPtr+1;
+		srcPtr += bytespp*wide+1;
+	}
+}
+
+/*	-z: compress the repacked image data as it is, and then with each of the
+	chooseRowFilters() strategies, all with the slowest tdefl settings, and keep
+	the smallest. 'data' holds the filtered rows, one sub-image per Adam7 pass if
+	interlaced, and is changed. Returns the compressed length, or 0 on failure */
+size_t deflate_smallest (unsigned char *dest, size_t dest_size, unsigned char *data, size_t length, unsigned int imgwidth, unsigned int imgheight, unsigned int interlace, int bytespp)
+{
+	int Starting_Row [] =  { 0, 0, 4, 0, 2, 0, 1 };
+	int Starting_Col [] =  { 0, 4, 0, 2, 0, 1, 0 };
+	int Row_Increment [] = { 8, 8, 8, 4, 4, 2, 2 };
+	int Col_Increment [] = { 8, 8, 4, 4, 2, 2, 1 };
+	const char *strategy_names[] = { "None", "Sub", "Up", "Average", "Paeth", "adaptive" };
+	int pass_wide[7], pass_high[7], num_passes, pass, strategy, best_strategy;
+	int flags = TDEFL_WRITE_ZLIB_HEADER | TDEFL_MAX_PROBES_MASK | TDEFL_PIXEL_HASH | TDEFL_SPLIT_BLOCKS;
+	size_t best_length, trial_length, ofs;
+	unsigned char *plain, *trial, *scratch;
+
+	best_length = deflate_to_mem (dest, dest_size, data, length, flags);
+	if (best_length == 0)
+		return 0;
+	best_strategy = -1;
+
+	if (interlace == 1)
+	{
+		num_passes = 7;
+		for (pass=0; pass<7; pass++)
+		{
+			pass_wide[pass] = (imgwidth - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
+			pass_high[pass] = (imgheight - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
+			if (pass_wide[pass] == 0)
+				pass_high[pass] = 0;
+		}
+	} else
+	{
+		num_passes = 1;
+		pass_wide[0] = imgwidth;
+		pass_high[0] = imgheight;
+	}
+
+	/* too little memory for the other strategies is no reason to fail */
+	plain = (unsigned char *)malloc (length);
+	trial = (unsigned char *)malloc (dest_size);
+	scratch = (unsigned char *)malloc ((size_t)bytespp*imgwidth);
+	if (plain && trial && scratch)
+	{
+		memcpy (plain, data, length);
+		ofs = 0;
+		for (pass=0; pass<num_passes; pass++)
+		{
+			removeRowFilters (pass_wide[pass], pass_high[pass], bytespp, plain+ofs);
+			ofs += (size_t)pass_high[pass] * (bytespp*pass_wide[pass]+1);
+		}
+
+		for (strategy=0; strategy<=5; strategy++)
+		{
+			memcpy (data, plain, length);
+			ofs = 0;
+			for (pass=0; pass<num_passes; pass++)
+			{
+				chooseRowFilters (pass_wide[pass], pass_high[pass], bytespp, data+ofs, strategy, scratch);
+				applyRowFilters (pass_wide[pass], pass_high[pass], bytespp, data+ofs);
+				ofs += (size_t)pass_high[pass] * (bytespp*pass_wide[pass]+1);
+			}
+			trial_length = deflate_to_mem (trial, dest_size, data, length, flags);
+			if (trial_length && trial_length < best_length)
+			{
+				memcpy (dest, trial, trial_length);
+				best_length = trial_length;
+				best_strategy = strategy;
+			}
+		}
+	}
+	free (plain);
+	free (trial);
+	free (scratch);
+
+	if (flag_Verbose)
+	{
+		if (best_strategy < 0)
+			printf ("    smallest with      : the original row filters\n");
+		else
+			printf ("    smallest with      : %s row filters\n", strategy_names[best_strategy]);
+	}
+	return best_length;
+}
+
+/*	Output file name for -o and -s, ending in 'ext'; caller must free it */
+char *output_file_name (char *filename, const char *ext)
+{
+	char *write_file_name;
+	char *clipOffPath;
+	size_t suffix_length;
+
+	suffix_length = (suffix ? strlen(suffix) : 0) + strlen(ext);
+	if (outputPath && outputPath[0])
+	{
+		clipOffPath = strrchr (filename, '/');
+		if (clipOffPath)
+			clipOffPath++;
+		else
+			clipOffPath = filename;
+
+		write_file_name = (char *)malloc (strlen(outputPath)+strlen(clipOffPath)+suffix_length+8);
+		if (write_file_name == NULL)
+			return NULL;
+		strcpy (write_file_name, outputPath);
+		strcat (write_file_name, "/");
+		strcat (write_file_name, clipOffPath);
+	} else
+	{
+		write_file_name = (char *)malloc (strlen(filename)+suffix_length+8);
+		if (write_file_name == NULL)
+			return NULL;
+		strcpy (write_file_name, filename);
+	}
+	/* without a suffix, PNG files keep their name as is */
+	if ((suffix && suffix[0]) || strcmp (ext, ".png"))
+	{
+		if (strlen(write_file_name) >= 4 && !strcasecmp (write_file_name+strlen(write_file_name)-4, ".png"))
+			write_file_name[strlen(write_file_name)-4] = 0;
+		if (suffix)
+			strcat (write_file_name, suffix);
+		strcat (write_file_name, ext);
+	}
+	return write_file_name;
+}
+
+void close_input (FILE *f)
+{
+	if (f != stdin)
+		fclose (f);
+}
+
+/*	Write one chunk; 'data' starts with the chunk type */
+void write_chunk (FILE *f, unsigned int length, unsigned char *data, unsigned int crc)
+{
+	fputc ( (length >> 24) & 0xff, f);
+	fputc ( (length >> 16) & 0xff, f);
+	fputc ( (length >>  8) & 0xff, f);
+	fputc ( (length      ) & 0xff, f);
+	fwrite (data, length+4, 1, f);
+	fputc ( (crc >> 24) & 0xff, f);
+	fputc ( (crc >> 16) & 0xff, f);
+	fputc ( (crc >>  8) & 0xff, f);
+	fputc ( (crc      ) & 0xff, f);
+	file_stats.out_bytes += length+12;
+}
+
+/*	Open the output file, or hand out stdout for -o- and --rawvideo */
+FILE *open_output (char *write_file_name)
+{
+	if (output_stdout)
+		return output_stdout;
+	return fopen (write_file_name, "wb");
+}
+
+int close_output (FILE *f)
+{
+	if (f == output_stdout)
+		return fflush (f);
+	return fclose (f);
+}
+
+/*	Work out the output file name (left NULL for -o-), say where the output goes,
+	and open it. With 'temp_file_name', a temporary file next to it is opened
+	instead, for the caller to rename into place once all went well, so that a
+	failure halfway leaves no broken file behind (or none in place of the input).
+	Returns NULL, with the error shown, if any of that fails */
+FILE *start_output (char *filename, int *didShowName, char **write_file_name, char **temp_file_name)
+{
+	FILE *f;
+
+	if (!output_stdout)
+	{
+		*write_file_name = output_file_name (filename, ".png");
+		if (*write_file_name && temp_file_name)
+		{
+			*temp_file_name = (char *)malloc (strlen(*write_file_name)+8);
+			if (*temp_file_name)
+			{
+				strcpy (*temp_file_name, *write_file_name);
+				strcat (*temp_file_name, ".tmp");
+			}
+		}
+		if (*write_file_name == NULL || (temp_file_name && *temp_file_name == NULL))
+		{
+			if (*didShowName)
+				printf ("    ");
+			else
+			{
+				*didShowName = 1;
+				printf ("%s : ", filename);
+			}
+			file_stats.failure = "out_of_memory";
+			printf ("failed to allocate memory for output file name ...\n");
+			return NULL;
+		}
+	}
+
+	if (!*didShowName)
+	{
+		*didShowName = 1;
+		printf ("%s : ", filename);
+	}
+	if (output_stdout)
+		printf ("writing to standard output\n");
+	else
+		printf ("writing to file %s\n", *write_file_name);
+
+	f = open_output (temp_file_name && *temp_file_name ? *temp_file_name : *write_file_name);
+	if (!f)
+	{
+		file_stats.failure = "output";
+		printf ("    failed to create output file!\n");
+	}
+	return f;
+}
+
+/*	Write the PNG signature and the chunks before the image data */
+void write_png_head (FILE *f)
+{
+	int i = 0;
+
+	fwrite (png_magic_bytes, 1, 8, f);
+	file_stats.out_bytes = 8;
+
+	/* need to skip first bogus chunk */
+	/* at this point, I expect the first one to be IHDR! */
+	if (pngChunks[0].id == 0x43674249)	/* "CgBI" */
+		i++;
+	while (i < num_chunks && pngChunks[i].id != 0x49444154)	/* "IDAT" */
+	{
+		write_chunk (f, pngChunks[i].length, pngChunks[i].data, pngChunks[i].crc32);
+		i++;
+	}
+}
+
+/*	Write the chunks after the image data, which starts at pngChunks[idat_first_index] */
+void write_png_tail (FILE *f, int idat_first_index)
+{
+	int i = idat_first_index;
+
+	while (i < num_chunks && pngChunks[i].id == 0x49444154)	/* "IDAT" */
+		i++;
+	while (i < num_chunks)
+	{
+		write_chunk (f, pngChunks[i].length, pngChunks[i].data, pngChunks[i].crc32);
+		i++;
+	}
+}
+
+/** Decoded pixel output, for -t and --raw **/
+
+/* indexed by channel count */
+const char *pam_tuple_types[] = { "", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+const char *rawvideo_formats[] = { "", "gray", "ya8", "rgb24", "rgba" };
+
+struct raw_output_t {
+	FILE *f;
+	unsigned int wide;
+	size_t rowbytes;
+	int demultiply;
+	int failed;
+};
+
+void write_raw_row (void *user, unsigned char *row)
+{
+	struct raw_output_t *out = (struct raw_output_t *)user;
+
+	if (out->demultiply)
+		demultiply_pixels (row, out->wide);
+	if (fwrite (row, 1, out->rowbytes, out->f) != out->rowbytes)
+		out->failed = 1;
+}
+
+void show_pixel_error (char *filename, int didShowName, int result)
+{
+	if (didShowName)
+		printf ("    ");
+	else
+		printf ("%s : ", filename);
+	switch (result)
+	{
+		case -1: file_stats.failure = "out_of_memory"; printf ("out of memory\n"); break;
+		case -2: file_stats.failure = "decompression"; printf ("unspecified decompression error\n"); break;
+		case -3: file_stats.failure = "row_filter"; printf ("unknown row filter type\n"); break;
+		case -4: file_stats.failure = "invalid"; printf ("missing PLTE chunk\n"); break;
+		case -5: file_stats.failure = "compression"; printf ("unspecified compression error\n"); break;
+		default: file_stats.failure = "output"; printf ("failed to write output file!\n");
+	}
+}
+
+/*	Write the image in the current pngChunks as a thumbnail (-t) and/or as plain
+	pixels (--raw, --rawvideo), never touching the original IDAT stream again.
+	A full size image goes to --raw(video) output one row at a time, as it is decoded.
+	Returns 1 if a file was written. */
+int write_pixels (char *filename, int didShowName, int isPhoney, unsigned int imgwidth, unsigned int imgheight, unsigned int bitdepth, unsigned int colortype, unsigned int interlace)
+{
+	struct decoder_t decoder;
+	struct thumbnail_t thumbnail;
+	struct raw_output_t out;
+	void *thumbnail_png = NULL;
+	size_t thumbnail_length = 0;
+	char *write_file_name = NULL;
+	FILE *write_file;
+	unsigned int wide, high;
+	int chans, result;
+
+	memset (&thumbnail, 0, sizeof(thumbnail));
+	result = init_decoder (&decoder, isPhoney, imgwidth, imgheight, bitdepth, colortype, interlace);
+	wide = imgwidth;
+	high = imgheight;
+	chans = decoder.chans;
+	if (!result && thumbnail_width)
+	{
+		result = make_thumbnail (&decoder, thumbnail_width, &thumbnail);
+		wide = thumbnail.wide;
+		high = thumbnail.high;
+		if (!result && !flag_Raw)
+		{
+			thumbnail_png = tdefl_write_image_to_png_file_in_memory (thumbnail.pixels, thumbnail.wide, thumbnail.high, thumbnail.chans, &thumbnail_length);
+			if (thumbnail_png == NULL)
+				result = -5;
+		}
+	}
+	if (!result && !output_stdout)
+	{
+		write_file_name = output_file_name (filename, flag_Raw ? ".pam" : ".png");
+		if (write_file_name == NULL)
+			result = -1;
+	}
+	if (result < 0)
+	{
+		show_pixel_error (filename, didShowName, result);
+		free_thumbnail (&thumbnail);
+		return 0;
+	}
+
+	if (!didShowName)
+		printf ("%s : ", filename);
+	if (flag_Raw == 2)
+		printf ("writing %ux%u %s pixels to standard output\n", wide, high, rawvideo_formats[chans]);
+	else if (output_stdout)
+		printf ("writing %s to standard output\n", thumbnail_width ? "thumbnail" : "pixels");
+	else
+		printf ("writing %s to file %s\n", thumbnail_width ? "thumbnail" : "pixels", write_file_name);
+	write_file = open_output (write_file_name);
+	if (!write_file)
+	{
+		file_stats.failure = "output";
+		printf ("    failed to create output file!\n");
+		free_thumbnail (&thumbnail);
+		free (thumbnail_png);
+		free (write_file_name);
+		return 0;
+	}
+
+	if (flag_Raw == 1)
+		file_stats.out_bytes = fprintf (write_file, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n", wide, high, chans, pam_tuple_types[chans]);
 
-	for (y=0; y<high; y++)
+	if (thumbnail_png)
 	{
-		rowfilter = *srcPtr;
-		srcPtr++;
-		switch (rowfilter)
-		{
-			case 0:	// None
-				break;
-			case 1:	// Sub
-				for (x=4*wide-1; x>=4; x--)
-				{
-					srcPtr[x] -= srcPtr[x-4];
-				}
-				break;
-			case 2:	// Up
-				if (y > 0)
-				{
-					upPtr = srcPtr - 1;
-					for (x=4*wide-1; x>=0; x--)
-					{
-						srcPtr[x] -= upPtr[x];
-					}
-				}
-				break;
-			case 3:	// Average
-				upPtr = srcPtr - 4*wide - 1;
-				if (y == 0)
-				{
-					for (x=4*wide-1; x>=4; x--)
-					{
-						srcPtr[x] -= (srcPtr[x-4]>>1);
-					}
-				} else
-				{
-					srcPtr[0] -= (upPtr[x]>>1);
-					for (x=4*wide-1; x>=4; x--)
-					{
-						srcPtr[x] -= ((upPtr[x] + srcPtr[x-4])>>1);
-					}
-				}
-				break;
-			case 4:	// Paeth
-				upPtr = srcPtr - 1;
-				{
-					int p,pa,pb,pc,value;
-					int leftpix,toppix,topleftpix;
-
-					for (x=4*wide-1; x>=0; x--)
-					{
-						leftpix = 0;
-						toppix = 0;
-						topleftpix = 0;
-						if (x > 0)
-							leftpix = srcPtr[x-4];
-						if (y > 0)
-						{
-							toppix = upPtr[x];
-							if (x >= 4)
-								topleftpix = upPtr[x-4];
-						}
-						p = leftpix + toppix - topleftpix;
-						pa = p - leftpix; if (pa < 0) pa = -pa;
-						pb = p - toppix; if (pb < 0) pb = -pb;
-						pc = p - topleftpix; if (pc < 0) pc = -pc;
-						if (pa <= pb && pa <= pc)
-							value = leftpix;
-						else if (pb <= pc)
-							value = toppix;
-						else
-							value = topleftpix;
+		if (fwrite (thumbnail_png, 1, thumbnail_length, write_file) != thumbnail_length)
+			result = -6;
+		file_stats.out_bytes += thumbnail_length;
+	} else if (thumbnail_width)
+	{
+		if (fwrite (thumbnail.pixels, (size_t)wide*chans, high, write_file) != high)
+			result = -6;
+		file_stats.out_bytes += (size_t)wide*chans*high;
+	} else
+	{
+		/* ffmpeg's rgba and PAM's RGB_ALPHA are not premultiplied */
+		out.f = write_file;
+		out.wide = wide;
+		out.rowbytes = (size_t)wide*chans;
+		out.demultiply = decoder.premultiplied;
+		out.failed = 0;
+		result = decode_image (&decoder, write_raw_row, &out);
+		if (!result && out.failed)
+			result = -6;
+		file_stats.out_bytes += out.rowbytes*high;
+	}
+	if (close_output (write_file) != 0 && !result)
+		result = -6;
 
-						srcPtr[x] -= value;
-					}
-				}
-				break;
-			default:
-				printf ("applyrowfilter : Unknown row filter %d\n", rowfilter);
-		}
-		srcPtr += 4*wide;
+	if (result < 0)
+	{
+		show_pixel_error (filename, 1, result);
+		if (write_file_name)
+			remove (write_file_name);
+		file_stats.out_bytes = 0;
 	}
+	free_thumbnail (&thumbnail);
+	free (thumbnail_png);
+	free (write_file_name);
+	return result == 0;
 }
 
+/** Validation only, for -V **/
+#include "validate.c"
+
+/** Row by row repacking, for -m **/
+#include "stream.c"
+
 int process (char *filename)
 {
 	FILE *f;
@@ -425,30 +926,31 @@ int process (char *filename)
 /* Derived IHRD items: */
 	unsigned int bitspp;
 	unsigned int bytespp;
-	unsigned int bytespline;
+	size_t bytespline;
 
 	struct chunk_t *ihdr_chunk = NULL;
 	int idat_first_index = 0;
 	unsigned char *all_idat = NULL;
-	unsigned int total_idat_size = 0;
+	size_t total_idat_size = 0;
 
 /* Adam7 interlacing information */
 	int Starting_Row [] =  { 0, 0, 4, 0, 2, 0, 1 };
 	int Starting_Col [] =  { 0, 4, 0, 2, 0, 1, 0 };
 	int Row_Increment [] = { 8, 8, 8, 4, 4, 2, 2 };
 	int Col_Increment [] = { 8, 8, 4, 4, 2, 2, 1 };
-	int row_filter_bytes = 0;
+	size_t row_filter_bytes = 0;
 
 /* Needed for unpacking/repacking */
 	unsigned char *data_out;
-	int out_length;
+	size_t out_length;
 	unsigned char *data_repack = NULL;
-	int repack_size, repack_length;
+	size_t repack_size, repack_length;
+	int unfilterRGBA, opaque = 0, dropped_alpha = 0;
 
 /* New file name comes here */
 	char *write_file_name = NULL;
 	FILE *write_file;
-	int write_block_size;
+	size_t write_block_size;
 
 /*	int i,j,b;
 	int blocklength, blockid;
@@ -459,37 +961,55 @@ int process (char *filename)
 
 	int crc, result;
 
-	f = fopen (filename, "rb");
-	if (!f)
+	if (!strcmp (filename, "-"))
 	{
-		printf ("%s : not found or could not be opened\n", filename);
-		return 0;
+		f = stdin;
+		filename = "stdin";
+	} else
+	{
+		f = fopen (filename, "rb");
+		if (!f)
+		{
+			file_stats.failure = "open";
+			printf ("%s : not found or could not be opened\n", filename);
+			return 0;
+		}
 	}
 
-	fseek (f, 0, SEEK_END);
-	length = ftell (f);
-	fseek (f, 0, SEEK_SET);
+	/* pipes and the like can't be measured; then only the PNG limits apply */
+	length = MAX_CHUNK_LENGTH+4;
+	if (fseek (f, 0, SEEK_END) == 0)
+	{
+		long filelength = ftell (f);
+		if (filelength >= 0 && filelength < MAX_CHUNK_LENGTH)
+			length = filelength;
+		fseek (f, 0, SEEK_SET);
+	}
 
 	i = 0;
 
 	if (fread (buf,1,8, f) != 8)
 	{
+		file_stats.failure = "not_png";
 		printf ("%s : not a PNG file\n", filename);
-		fclose (f);
+		close_input (f);
 		return 0;
 	}
 
 	i += 8;
+	file_stats.in_bytes = 8;
 	if (memcmp (buf, png_magic_bytes, 8))
 	{
+		file_stats.failure = "not_png";
 		printf ("%s : not a PNG file\n", filename);
-		fclose (f);
+		close_input (f);
 		return 0;
 	}
 	result = init_chunk (f, length);
 	if (result < 0)
 	{
-		fclose (f);
+		close_input (f);
+		file_stats.failure = chunk_failures[-result];
 		switch (result)
 		{
 			case -1: printf ("%s : invalid chunk size\n", filename); break;
@@ -501,26 +1021,33 @@ int process (char *filename)
 		return 0;
 	}
 
+	file_stats.isPNG = 1;
 	isPhoney = 1;
 	if (pngChunks[0].id != 0x43674249)	/* "CgBI" */
 	{
 		isPhoney = 0;
-		printf ("%s : not an -iphone crushed PNG file\n", filename);
-		if (!flag_Process_Anyway)
+		/* plain PNGs are fine for thumbnails and raw pixels */
+		if (!thumbnail_width && !flag_Raw)
 		{
-			fclose (f);
-			reset_chunks ();
-			return 0;
+			printf ("%s : not an -iphone crushed PNG file\n", filename);
+			if (!flag_Process_Anyway)
+			{
+				file_stats.skipped = 1;
+				close_input (f);
+				reset_chunks ();
+				return 0;
+			}
+			didShowName = 1;
 		}
-		didShowName = 1;
 	}
+	file_stats.isPhoney = isPhoney;
 
 	do
 	{
 		result = init_chunk (f, length);
 		if (result < 0)
 		{
-			fclose (f);
+			close_input (f);
 
 			if (didShowName)
 				printf ("    ");
@@ -529,6 +1056,7 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = result >= -4 ? chunk_failures[-result] : "invalid";
 			switch (result)
 			{
 				case -1: printf ("invalid chunk size\n"); break;
@@ -546,7 +1074,7 @@ int process (char *filename)
 
 	if (pngChunks[num_chunks-1].id != 0x49454E44)	/* "IEND" */
 	{
-		fclose (f);
+		close_input (f);
 
 		if (didShowName)
 			printf ("    ");
@@ -555,6 +1083,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "missing_iend";
 		printf ("missing IEND chunk\n");
 		reset_chunks ();
 		return 0;
@@ -571,7 +1100,7 @@ int process (char *filename)
 		}
 		printf ("Extra data after IEND, very suspicious! Excluded from conversion\n");
 	}
-	fclose (f);
+	close_input (f);
 
 	if (flag_List_Chunks)
 	{
@@ -589,6 +1118,7 @@ int process (char *filename)
 				printf (" --> CRC32 check invalid! Should be %08X", crc);
 				if (!flag_Ignore_CRC32)
 				{
+					file_stats.failure = "crc";
 					printf ("\n");
 					return 0;
 				}
@@ -610,6 +1140,7 @@ int process (char *filename)
 				printf ("    chunk : %c%c%c%c  length %6u  CRC32 %08X", (pngChunks[i].id >> 24) & 0xff,(pngChunks[i].id >> 16) & 0xff, (pngChunks[i].id >> 8) & 0xff,pngChunks[i].id & 0xff, pngChunks[i].length, pngChunks[i].crc32);
 				if (!flag_Ignore_CRC32)
 				{
+					file_stats.failure = "crc";
 					printf (" -> invalid\n");
 					return 0;
 				}
@@ -638,6 +1169,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("no IHDR chunk found\n");
 		reset_chunks ();
 		return 0;
@@ -651,6 +1183,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("IHDR chunk length incorrect\n");
 		reset_chunks ();
 		return 0;
@@ -663,7 +1196,7 @@ int process (char *filename)
 	filter = ihdr_chunk->data[15];
 	interlace = ihdr_chunk->data[16];
 
-	if (imgwidth == 0 || imgheight == 0 || imgwidth > 67108863 || imgheight > 2147483647)
+	if (imgwidth == 0 || imgheight == 0 || imgwidth > MAX_IMAGE_WIDTH || imgheight > MAX_IMAGE_HEIGHT)
 	{
 		if (didShowName)
 			printf ("    ");
@@ -672,6 +1205,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("image dimensions invalid\n");
 		reset_chunks ();
 		return 0;
@@ -685,6 +1219,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("unknown compression type %d\n", compression);
 		reset_chunks ();
 		return 0;
@@ -698,6 +1233,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("unknown filter type %d\n", filter);
 		reset_chunks ();
 		return 0;
@@ -711,6 +1247,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("unknown interlace type %d\n", interlace);
 		reset_chunks ();
 		return 0;
@@ -781,6 +1318,7 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = "invalid_header";
 			printf ("unknown color type %d\n", colortype);
 			reset_chunks ();
 			return 0;
@@ -794,15 +1332,18 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("invalid bit depth %d for color type %d\n", bitdepth, colortype);
 		reset_chunks ();
 		return 0;
 	}
 
-	bytespline = (imgwidth*bitspp+7)/8;
+	bytespline = ((size_t)imgwidth*bitspp+7)/8;
 
 	/* address possible overflow because of malformed imgwidth or bitspp */
-	if (bytespline < imgwidth)
+	/* (below 8 bits per pixel a line is shorter than the width, but cannot overflow) */
+	/* and of the image data size, where size_t is 32 bits */
+	if ((bitspp >= 8 && bytespline < imgwidth) || ((size_t)-1)/2/(bytespline+1) < imgheight)
 	{
 		if (didShowName)
 			printf ("    ");
@@ -811,6 +1352,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "invalid_header";
 		printf ("image dimensions invalid\n");
 		reset_chunks ();
 		return 0;
@@ -835,7 +1377,7 @@ int process (char *filename)
 		printf ("    filter             : %u\n", filter);
 		printf ("    interlace          : %u\n", interlace);
 		printf ("    bits per pixel     : %d\n", bitspp);
-		printf ("    bytes per line     : %u\n", bytespline);
+		printf ("    bytes per line     : %lu\n", (unsigned long)bytespline);
 	}
 
 	row_filter_bytes = imgheight;
@@ -859,8 +1401,8 @@ int process (char *filename)
 	}
 	if (flag_Verbose)
 	{
-		printf ("    row filter bytes   : %u\n", row_filter_bytes);
-		printf ("    expected data size : %u bytes\n", bytespline * imgheight + row_filter_bytes);
+		printf ("    row filter bytes   : %lu\n", (unsigned long)row_filter_bytes);
+		printf ("    expected data size : %lu bytes\n", (unsigned long)(bytespline * imgheight + row_filter_bytes));
 	}
 
 	for (i=0; i<num_chunks; i++)
@@ -880,6 +1422,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "no_idat";
 		printf ("no IDAT chunks found\n");
 		reset_chunks ();
 		return 0;
@@ -909,6 +1452,7 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "no_idat";
 		printf ("IDAT chunks are not consecutive\n");
 		reset_chunks ();
 		return 0;
@@ -923,26 +1467,122 @@ int process (char *filename)
 			didShowName = 1;
 			printf ("%s : ", filename);
 		}
+		file_stats.failure = "no_idat";
 		printf ("all IDAT chunks are empty\n");
 		reset_chunks ();
 		return 0;
 	}
 
+/*	Thumbnails and raw pixels come from the decoded image; no need to rewrite the full image */
+	if (thumbnail_width || flag_Raw)
+	{
+		result = write_pixels (filename, didShowName, isPhoney, imgwidth, imgheight, bitdepth, colortype, interlace);
+		reset_chunks ();
+		return result;
+	}
+
 /*	Only need to re-write the image data for -phone 8 bit RGB and RGBA images */
 /*	Note To Self: Is that true? What about 16 bit images? What about palette images? */
 /*	Okay -- checked the above, it appears these two do NOT get fried. */
 
-/*	Swap BGR to RGB, BGRA to RGBA */
-	if (bitdepth == 8 &&
+/*	Too big to hold in memory at once: do all of the below a row at a time,
+	and write the output as it is made */
+	if (bitdepth == 8 && (colortype == 2 || colortype == 6) &&
+		bytespline * imgheight + row_filter_bytes > memory_budget)
+	{
+		struct stream_dest_t dest;
+		char *temp_file_name = NULL;
+		int flags;
+
+		if (isPhoney && flag_Verbose)
+			printf ("    swapping BGR(A) to RGB(A)\n");
+		if (flag_Verbose)
+			printf ("    repacking row by row, the image data is over the memory budget\n");
+
+		/* -z needs the whole image to try other row filters; only the slowest settings are left */
+		if (flag_MaxCompress)
+			flags = TDEFL_WRITE_ZLIB_HEADER | TDEFL_MAX_PROBES_MASK | TDEFL_PIXEL_HASH | TDEFL_SPLIT_BLOCKS;
+		else
+			flags = flag_FastRepack ? TDEFL_WRITE_ZLIB_HEADER | TDEFL_GREEDY_PARSING_FLAG | TDEFL_PIXEL_HASH | 1 : TDEFL_WRITE_ZLIB_HEADER;
+		/* -A needs to know if the whole image is opaque before writing the IHDR */
+		result = 0;
+		if (flag_DropAlpha)
+			result = opaque_rows (imgwidth, imgheight, interlace, colortype, isPhoney, idat_first_index, &dropped_alpha);
+		dest.f = NULL;
+		dest.chunk = (unsigned char *)malloc ((size_t)repack_IDAT_size+4);
+		if (!result && dest.chunk == NULL)
+			result = -1;
+		if (result)
+		{
+			free (dest.chunk);
+			show_pixel_error (filename, didShowName, result);
+			reset_chunks ();
+			return 0;
+		}
+		memcpy (dest.chunk, "IDAT", 4);
+		if (dropped_alpha)
+			alphaDropped (ihdr_chunk);
+
+		if (flag_Rewrite)
+		{
+			dest.f = start_output (filename, &didShowName, &write_file_name, &temp_file_name);
+			if (!dest.f)
+			{
+				free (dest.chunk);
+				free (write_file_name);
+				free (temp_file_name);
+				reset_chunks ();
+				return 0;
+			}
+			write_png_head (dest.f);
+		}
+
+		result = repack_rows (imgwidth, imgheight, interlace, colortype, isPhoney, idat_first_index, flags, dropped_alpha, &dest, &opaque);
+		free (dest.chunk);
+		if (dest.f)
+		{
+			if (!result)
+				write_png_tail (dest.f, idat_first_index);
+			if (close_output (dest.f) && !result)
+				result = -6;
+			if (temp_file_name)
+			{
+				if (!result && rename (temp_file_name, write_file_name))
+					result = -6;
+				if (result)
+					remove (temp_file_name);
+			}
+		}
+		free (write_file_name);
+		free (temp_file_name);
+		if (result)
+		{
+			show_pixel_error (filename, didShowName, result);
+			reset_chunks ();
+			return 0;
+		}
+
+		if (flag_Verbose)
+		{
+			if (opaque)
+				printf ("    alpha channel      : fully opaque%s\n", dropped_alpha ? ", dropped" : "");
+			printf ("    repacked size: %lu bytes\n", (unsigned long)dest.total);
+		}
+		if (!didShowName)
+			printf ("%s\n", filename);
+		reset_chunks ();
+		return flag_Rewrite;
+	} else if (bitdepth == 8 &&
 		(colortype == 2 ||		/* Each pixel is an R,G,B triple (8 or 16 bits) */
 		colortype == 6))		/* Each pixel is an R,G,B triple, followed by an alpha sample (8 or 16 bits) */
 	{
+	/*	Swap BGR to RGB, BGRA to RGBA */
 		if (isPhoney && flag_Verbose)
 			printf ("    swapping BGR(A) to RGB(A)\n");
 
 	/*** Gather all IDATs into one ***/
 		if (flag_Debug)
-			printf ("    informational : total idat size: %u\n", total_idat_size);
+			printf ("    informational : total idat size: %lu\n", (unsigned long)total_idat_size);
 		all_idat = (unsigned char *)malloc (total_idat_size);
 		if (all_idat == NULL)
 		{
@@ -953,6 +1593,7 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = "out_of_memory";
 			printf ("out of memory\n");
 			reset_chunks ();
 			return 0;
@@ -978,20 +1619,21 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = "out_of_memory";
 			printf ("out of memory\n");
 			reset_chunks ();
 			return 0;
 		}
 
 		if (isPhoney)
-			out_length = tinfl_decompress_mem_to_mem(data_out, bytespline * imgheight + row_filter_bytes, all_idat, total_idat_size, 0);
+			out_length = inflate_to_mem (data_out, bytespline * imgheight + row_filter_bytes, all_idat, total_idat_size, 0);
 		else
-			out_length = tinfl_decompress_mem_to_mem(data_out, bytespline * imgheight + row_filter_bytes, all_idat, total_idat_size, TINFL_FLAG_PARSE_ZLIB_HEADER);
+			out_length = inflate_to_mem (data_out, bytespline * imgheight + row_filter_bytes, all_idat, total_idat_size, TINFL_FLAG_PARSE_ZLIB_HEADER);
 
 		free (all_idat);
 		all_idat = NULL;
 	
-		if (out_length <= 0)
+		if (out_length == 0 || out_length == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED)
 		{
 			free (data_out);
 			if (didShowName)
@@ -1001,6 +1643,7 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = "decompression";
 			printf ("unspecified decompression error\n");
 			reset_chunks ();
 			return 0;
@@ -1015,21 +1658,26 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
-			printf ("decompression error, expected %u but got %u bytes\n", imgheight*bytespline + row_filter_bytes, out_length);
+			file_stats.failure = "decompression";
+			printf ("decompression error, expected %lu but got %lu bytes\n", (unsigned long)(imgheight*bytespline + row_filter_bytes), (unsigned long)out_length);
 			free (data_out);
 			reset_chunks ();
 			return 0;
 		}
 		if (flag_Verbose)
-			printf ("    uncompressed size  : %u bytes\n", bytespline * imgheight + row_filter_bytes);
+			printf ("    uncompressed size  : %lu bytes\n", (unsigned long)(bytespline * imgheight + row_filter_bytes));
+
+		/*	RGBA is un-filtered to de-multiply the alpha, and to see if it is all opaque;
+			an opaque image needs no de-multiplying, and with -A loses its alpha channel */
+		unfilterRGBA = isPhoney && colortype == 6 && (flag_UpdateAlpha || flag_DropAlpha);
 
 		if (isPhoney || flag_Process_Anyway)
 		{
 			if (interlace == 1)		/* needs Adam7 unpacking! */
 			{
-				int x,y, b, row;
+				size_t y, startat, pass_start[7];
+				int row;
 				int pass, w,h;
-				int startat;
 
 			/*	check if all row filters are okay */
 				y = 0;
@@ -1050,6 +1698,7 @@ int process (char *filename)
 								didShowName = 1;
 								printf ("%s : ", filename);
 							}
+							file_stats.failure = "row_filter";
 							printf ("unknown row filter type (%d)\n", data_out[y]);
 							reset_chunks ();
 							return 0;
@@ -1057,12 +1706,13 @@ int process (char *filename)
 						/* skip row filter byte */
 						y++;
 						/* skip rest of row */
-						y += w * bytespp;
+						y += (size_t)w * bytespp;
 						row++;
 					}
 				}
 
 
+				opaque = 255;
 				y = 0;
 				for (pass=0; pass<7; pass++)
 				{
@@ -1070,33 +1720,45 @@ int process (char *filename)
 					w = (imgwidth - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
 					h = (imgheight - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
 					startat = y;
+					pass_start[pass] = startat;
 					row=0;
 					while (row < h)
 					{
 						/* skip row filter byte */
 						y++;
 						/* swap all bytes in this row */
-						x = 0;
-						while (x < w)
-						{
-							b = data_out[y+2];
-							data_out[y+2] = data_out[y];
-							data_out[y] = b;
-							y += bytespp;
-							x++;
-						}
+						swap_pixels (data_out+y, w, bytespp);
+						y += (size_t)w * bytespp;
 						row++;
 					}
-					if (isPhoney && flag_UpdateAlpha && colortype == 6)	// RGBA
+					if (unfilterRGBA)
+						opaque &= removeRowFilters (w, h, 4, data_out+startat);
+				}
+				/* alpha is only known for the entire image after all passes are done */
+				if (unfilterRGBA)
+				{
+					opaque = opaque == 255;
+					dropped_alpha = opaque && flag_DropAlpha;
+					if (dropped_alpha)
+						out_length = 0;
+					for (pass=0; pass<7; pass++)
 					{
-						removeRowFilters (w, h, data_out+startat);
-						demultiplyAlpha (w, h, data_out+startat);
-						applyRowFilters (w, h, data_out+startat);
+						w = (imgwidth - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
+						h = (imgheight - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
+						if (dropped_alpha)
+						{
+							out_length += dropAlpha (w, h, data_out+pass_start[pass], data_out+out_length);
+						} else
+						{
+							if (!opaque && flag_UpdateAlpha)
+								demultiplyAlpha (w, h, data_out+pass_start[pass]);
+							applyRowFilters (w, h, 4, data_out+pass_start[pass]);
+						}
 					}
 				}
 			} else
 			{
-				int x,y, b;
+				size_t y;
 
 				/* check row filters */
 				y = 0;
@@ -1112,6 +1774,7 @@ int process (char *filename)
 							didShowName = 1;
 							printf ("%s : ", filename);
 						}
+						file_stats.failure = "row_filter";
 						printf ("unknown row filter type (%d)\n", data_out[y]);
 						reset_chunks ();
 						return 0;
@@ -1128,27 +1791,28 @@ int process (char *filename)
 					/* skip row filter byte */
 					y++;
 					/* swap all bytes in this row */
-					x = 0;
-					while (x < imgwidth)
-					{
-						b = data_out[y+2];
-						data_out[y+2] = data_out[y];
-						data_out[y] = b;
-						y += bytespp;
-						x++;
-					}
+					swap_pixels (data_out+y, imgwidth, bytespp);
+					y += bytespline;
 				}
-				if (isPhoney && flag_UpdateAlpha && colortype == 6)	// RGBA
+				if (unfilterRGBA)
 				{
-					removeRowFilters (imgwidth, imgheight, data_out);
-					demultiplyAlpha (imgwidth, imgheight, data_out);
-					applyRowFilters (imgwidth, imgheight, data_out);
+					opaque = removeRowFilters (imgwidth, imgheight, 4, data_out) == 255;
+					dropped_alpha = opaque && flag_DropAlpha;
+					if (dropped_alpha)
+						out_length = dropAlpha (imgwidth, imgheight, data_out, data_out);
+					else
+					{
+						if (!opaque && flag_UpdateAlpha)
+							demultiplyAlpha (imgwidth, imgheight, data_out);
+						applyRowFilters (imgwidth, imgheight, 4, data_out);
+					}
 				}
 			}
 		}
 
 	/*	Force VERY conservative repacking size ... */		
-		repack_size = 2*(bytespline * imgheight + row_filter_bytes);
+	/*	(plus room for the zlib header and checksum, which tiny images can't make up for) */
+		repack_size = 2*(bytespline * imgheight + row_filter_bytes) + 64;
 		data_repack = (unsigned char *)malloc (repack_size);
 		if (data_repack == NULL)
 		{
@@ -1160,6 +1824,7 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = "out_of_memory";
 			printf ("out of memory\n");
 			reset_chunks ();
 			return 0;
@@ -1167,7 +1832,13 @@ int process (char *filename)
 
 		/* ouch -- reserve 4 bytes at the start to put "IDAT" in! */
 		/* yeah well, it beats having to re-allocate each block on writing ... */
-		repack_length = tdefl_compress_mem_to_mem(data_repack+4, repack_size-4, data_out, out_length, TDEFL_WRITE_ZLIB_HEADER);
+		/*	-f: one greedy match probe, hashing whole pixels. Faster than plain
+			Huffman coding (the default), and smaller on just about any image. */
+		if (flag_MaxCompress)
+			repack_length = deflate_smallest (data_repack+4, repack_size-4, data_out, out_length, imgwidth, imgheight, interlace, dropped_alpha ? 3 : bytespp);
+		else
+			repack_length = deflate_to_mem (data_repack+4, repack_size-4, data_out, out_length,
+				flag_FastRepack ? TDEFL_WRITE_ZLIB_HEADER | TDEFL_GREEDY_PARSING_FLAG | TDEFL_PIXEL_HASH | 1 : TDEFL_WRITE_ZLIB_HEADER);
 		if (repack_length == 0)
 		{
 			free (data_out);
@@ -1179,109 +1850,114 @@ int process (char *filename)
 				didShowName = 1;
 				printf ("%s : ", filename);
 			}
+			file_stats.failure = "compression";
 			printf ("unspecified compression error\n");
 			reset_chunks ();
 			return 0;
 		}
 
 		if (flag_Verbose)
-			printf ("    repacked size: %u bytes\n", repack_length);
+		{
+			if (opaque)
+				printf ("    alpha channel      : fully opaque%s\n", dropped_alpha ? ", dropped" : "");
+			printf ("    repacked size: %lu bytes\n", (unsigned long)repack_length);
+		}
 
-		free (data_out);
-	}
+		if (dropped_alpha)
+			alphaDropped (ihdr_chunk);
 
-	if (flag_Rewrite)
+		free (data_out);
+	} else if (isPhoney)
 	{
-		if (outputPath && outputPath[0])
-		{
-			char *clipOffPath;
-			clipOffPath = strrchr (filename, '/');
-			if (clipOffPath)
-				clipOffPath++;
-			else
-				clipOffPath = filename;
+	/*	Not fried, but the IDAT data is still raw deflate, which other decoders reject.
+		Give it a zlib header and checksum; the compressed data itself stays the same. */
+		size_t inflated_length, expected_length;
+		int w,h,pass;
 
-			if (suffix && suffix[0])
-				write_file_name = (char *)malloc (strlen(outputPath)+strlen(clipOffPath)+strlen(suffix)+8);
-			else
-				write_file_name = (char *)malloc (strlen(outputPath)+strlen(clipOffPath)+8);
-			if (write_file_name == NULL)
+		/* below 8 bits per pixel, each interlace pass row is rounded up to whole bytes */
+		expected_length = bytespline * imgheight + row_filter_bytes;
+		if (interlace == 1)
+		{
+			expected_length = 0;
+			for (pass=0; pass<7; pass++)
 			{
-				if (didShowName)
-					printf ("    ");
-				else
-				{
-					didShowName = 1;
-					printf ("%s : ", filename);
-				}
-				printf ("failed to allocate memory for output file name ...\n");
-				reset_chunks ();
-				return 0;
+				w = (imgwidth - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
+				h = (imgheight - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
+				if (w)
+					expected_length += (((size_t)w*bitspp+7)/8 + 1) * h;
 			}
-			strcpy (write_file_name, outputPath);
-			strcat (write_file_name, "/");
-			strcat (write_file_name, clipOffPath);
-		} else
+		}
+
+		all_idat = (unsigned char *)malloc (total_idat_size);
+		repack_size = total_idat_size + 4 + 6;
+		data_repack = (unsigned char *)malloc (repack_size);
+		if (all_idat == NULL || data_repack == NULL)
 		{
-			write_file_name = (char *)malloc (strlen(filename)+strlen(suffix)+8);
-			if (write_file_name == NULL)
+			free (all_idat);
+			free (data_repack);
+			if (didShowName)
+				printf ("    ");
+			else
 			{
-				if (didShowName)
-					printf ("    ");
-				else
-				{
-					didShowName = 1;
-					printf ("%s : ", filename);
-				}
-				printf ("failed to allocate memory for output file name ...\n");
-				reset_chunks ();
-				return 0;
+				didShowName = 1;
+				printf ("%s : ", filename);
 			}
-			strcpy (write_file_name, filename);
+			file_stats.failure = "out_of_memory";
+			printf ("out of memory\n");
+			reset_chunks ();
+			return 0;
+		}
+		i = idat_first_index;
+		total_idat_size = 0;
+		while (i < num_chunks && pngChunks[i].id == 0x49444154)	/* "IDAT" */
+		{
+			memcpy (all_idat+total_idat_size, pngChunks[i].data+4, pngChunks[i].length);
+			total_idat_size += pngChunks[i].length;
+			i++;
 		}
-		if (suffix && suffix[0])
+
+		/* ouch -- reserve 4 bytes at the start to put "IDAT" in! (see above) */
+		repack_length = rewrap_zlib (data_repack+4, all_idat, total_idat_size, &inflated_length);
+		free (all_idat);
+		all_idat = NULL;
+
+		if (repack_length == 0 || inflated_length != expected_length)
 		{
-			if (!strcasecmp (write_file_name+strlen(write_file_name)-4, ".png"))
-				strcpy (write_file_name+strlen(write_file_name)-4, suffix);
+			free (data_repack);
+			if (didShowName)
+				printf ("    ");
+			else
+			{
+				didShowName = 1;
+				printf ("%s : ", filename);
+			}
+			file_stats.failure = "decompression";
+			if (repack_length == 0)
+				printf ("unspecified decompression error\n");
 			else
-				strcat (write_file_name, suffix);
-			strcat (write_file_name, ".png");
+				printf ("decompression error, expected %lu but got %lu bytes\n", (unsigned long)expected_length, (unsigned long)inflated_length);
+			reset_chunks ();
+			return 0;
 		}
-	
-		if (!didShowName)
+		if (flag_Verbose)
 		{
-			printf ("%s : ", filename);
+			printf ("    uncompressed size  : %lu bytes\n", (unsigned long)inflated_length);
+			printf ("    rewrapped size: %lu bytes, not recompressed\n", (unsigned long)repack_length);
 		}
-		printf ("writing to file %s\n", write_file_name);
-	
-		write_file = fopen (write_file_name, "wb");
+	}
+
+	if (flag_Rewrite)
+	{
+		write_file = start_output (filename, &didShowName, &write_file_name, NULL);
 		if (!write_file)
 		{
-			printf ("    failed to create output file!\n");
+			free (write_file_name);
+			if (data_repack)
+				free (data_repack);
 			reset_chunks ();
 			return 0;
 		}
-	
-		fwrite (png_magic_bytes, 1, 8, write_file);
-	
-		i = 0;
-		/* need to skip first bogus chunk */
-		/* at this point, I expect the first one to be IHDR! */
-		if (pngChunks[0].id == 0x43674249)	/* "CgBI" */
-			i++;
-		while (i < num_chunks && pngChunks[i].id != 0x49444154)	/* "IDAT" */
-		{
-			fputc ( (pngChunks[i].length >> 24) & 0xff, write_file);
-			fputc ( (pngChunks[i].length >> 16) & 0xff, write_file);
-			fputc ( (pngChunks[i].length >>  8) & 0xff, write_file);
-			fputc ( (pngChunks[i].length      ) & 0xff, write_file);
-			fwrite (pngChunks[i].data, pngChunks[i].length+4, 1, write_file);
-			fputc ( (pngChunks[i].crc32 >> 24) & 0xff, write_file);
-			fputc ( (pngChunks[i].crc32 >> 16) & 0xff, write_file);
-			fputc ( (pngChunks[i].crc32 >>  8) & 0xff, write_file);
-			fputc ( (pngChunks[i].crc32      ) & 0xff, write_file);
-			i++;
-		}
+		write_png_head (write_file);
 
 	/* Did we repack the data, or do we just need to rewrite the file? */
 		if (data_repack)
@@ -1293,74 +1969,35 @@ int process (char *filename)
 				data_repack[4+write_block_size-3] = 'D';
 				data_repack[4+write_block_size-2] = 'A';
 				data_repack[4+write_block_size-1] = 'T';
-				if (repack_length-write_block_size > repack_IDAT_size)
+				if (repack_length-write_block_size > (size_t)repack_IDAT_size)
 				{
-					fputc ( (repack_IDAT_size >> 24) & 0xff, write_file);
-					fputc ( (repack_IDAT_size >> 16) & 0xff, write_file);
-					fputc ( (repack_IDAT_size >>  8) & 0xff, write_file);
-					fputc ( (repack_IDAT_size      ) & 0xff, write_file);
-					fwrite ( data_repack+write_block_size, repack_IDAT_size+4,1, write_file);
 					crc = crc32s (data_repack+write_block_size, repack_IDAT_size+4);
-					fputc ( (crc >> 24) & 0xff, write_file);
-					fputc ( (crc >> 16) & 0xff, write_file);
-					fputc ( (crc >>  8) & 0xff, write_file);
-					fputc ( (crc      ) & 0xff, write_file);
+					write_chunk (write_file, repack_IDAT_size, data_repack+write_block_size, crc);
 					write_block_size += repack_IDAT_size;
 				} else
 				{
-					fputc ( ((repack_length-write_block_size) >> 24) & 0xff, write_file);
-					fputc ( ((repack_length-write_block_size) >> 16) & 0xff, write_file);
-					fputc ( ((repack_length-write_block_size) >>  8) & 0xff, write_file);
-					fputc ( ((repack_length-write_block_size)      ) & 0xff, write_file);
-					fwrite ( data_repack+write_block_size, (repack_length-write_block_size)+4,1, write_file);
 					crc = crc32s (data_repack+write_block_size, (repack_length-write_block_size)+4);
-					fputc ( (crc >> 24) & 0xff, write_file);
-					fputc ( (crc >> 16) & 0xff, write_file);
-					fputc ( (crc >>  8) & 0xff, write_file);
-					fputc ( (crc      ) & 0xff, write_file);
+					write_chunk (write_file, repack_length-write_block_size, data_repack+write_block_size, crc);
 					write_block_size = repack_length;
 				}
 			}
-		
-			/* skip original IDAT chunks */
-			while (i < num_chunks && pngChunks[i].id == 0x49444154)	/* "IDAT" */
-				i++;
 
 			free (data_repack);
 		} else
 		{
 			/* image was not repacked */
 			/* output original IDAT chunks */
+			i = idat_first_index;
 			while (i < num_chunks && pngChunks[i].id == 0x49444154)	/* "IDAT" */
 			{
-				fputc ( (pngChunks[i].length >> 24) & 0xff, write_file);
-				fputc ( (pngChunks[i].length >> 16) & 0xff, write_file);
-				fputc ( (pngChunks[i].length >>  8) & 0xff, write_file);
-				fputc ( (pngChunks[i].length      ) & 0xff, write_file);
-				fwrite (pngChunks[i].data, pngChunks[i].length+4, 1, write_file);
-				fputc ( (pngChunks[i].crc32 >> 24) & 0xff, write_file);
-				fputc ( (pngChunks[i].crc32 >> 16) & 0xff, write_file);
-				fputc ( (pngChunks[i].crc32 >>  8) & 0xff, write_file);
-				fputc ( (pngChunks[i].crc32      ) & 0xff, write_file);
+				write_chunk (write_file, pngChunks[i].length, pngChunks[i].data, pngChunks[i].crc32);
 				i++;
 			}
 		}
 	
 		/* output remaining chunks */
-		while (i < num_chunks)
-		{
-			fputc ( (pngChunks[i].length >> 24) & 0xff, write_file);
-			fputc ( (pngChunks[i].length >> 16) & 0xff, write_file);
-			fputc ( (pngChunks[i].length >>  8) & 0xff, write_file);
-			fputc ( (pngChunks[i].length      ) & 0xff, write_file);
-			fwrite (pngChunks[i].data, pngChunks[i].length+4, 1, write_file);
-			fputc ( (pngChunks[i].crc32 >> 24) & 0xff, write_file);
-			fputc ( (pngChunks[i].crc32 >> 16) & 0xff, write_file);
-			fputc ( (pngChunks[i].crc32 >>  8) & 0xff, write_file);
-			fputc ( (pngChunks[i].crc32      ) & 0xff, write_file);
-			i++;
-		}
-		fclose (write_file);
+		write_png_tail (write_file, idat_first_index);
+		close_output (write_file);
 		free (write_file_name);
 		reset_chunks ();
 
@@ -1383,7 +2020,7 @@ int process (char *filename)
 
 int main (int argc, char **argv)
 {
-	int i, nomoreoptions;
+	int i, nomoreoptions, consumed, walkOnly;
 	int seenFiles = 0, processedFiles = 0;
 
 	if (argc == 1)
@@ -1392,39 +2029,81 @@ int main (int argc, char **argv)
 		printf ("\n");
 		printf ("Removes -iphone specific data chunk, reverses colors from BGRA to RGBA, and de-multiplies alpha\n");
 		printf ("\n");
-		printf ("usage: pngdefry [-soaplvid] file.png [...]\n");
+		printf ("usage: pngdefry [-soaAfzplvVimdt] [--raw|--rawvideo] [--stats=json] file.png [...]\n");
 		printf ("\n");
 		printf ("Options:\n");
 		printf ("  -          use this if your first input file starts with an '-'\n");
+		printf ("             A '-' as the last file name reads the PNG from stdin.\n");
 		printf ("  -s(suffix) append suffix to output file name\n");
-		printf ("  -o(path)   write output file(s) to path\n");
+		printf ("  -o(path)   write output file(s) to path; -o- writes to stdout, with all messages on stderr\n");
 		printf ("             Note: without -s or -o, NO output will be created.\n");
 		printf ("  -a         do NOT de-multiply alpha\n");
-		printf ("  -l         list all chunks\n");
+		printf ("  -A         write -iphone RGBA images without any transparency as RGB\n");
+		printf ("  -f         fast repacking: quicker, and usually smaller output\n");
+		printf ("  -z         smallest repacking: tries several row filters at maximum compression; slow\n");
+		printf ("  -l         list all chunks; by itself it skips the chunk data, and only checks CRCs with -V\n");
 		printf ("  -v         verbose processing\n");
+		printf ("  -V         only validate: check chunks, CRCs, IHDR and the image data of each file, and\n");
+		printf ("             exit with status 1 if any is damaged. Reads each file once; needs little memory.\n");
 		printf ("  -i(value)  max IDAT chunk size in bytes (minimum: 1024; default: %u)\n", repack_IDAT_size);
+		printf ("  -m(MB)     repack images whose image data is larger than this a row at a time (default: 1024)\n");
 		printf ("  -p         process all files, not just -iphone ones (for debugging purposed only)\n");
 		printf ("  -d         very verbose processing (for debugging purposes only)\n");
 		printf ("  -C         ignore bad CRC32 (recommended: do NOT use this, as a bad CRC32 may indicate a deliberately damaged file)\n");
+		printf ("  -t(width)  write a thumbnail at most (width) pixels wide instead; also for regular PNG files\n");
+		printf ("             Note: without -s or -o, the suffix '-thumb' is used.\n");
+		printf ("  --raw      write de-fried 8 bit pixels as a .pam file (a PNM with a short text header) instead\n");
+		printf ("  --rawvideo write de-fried 8 bit pixels to stdout without any header, for ffmpeg -f rawvideo;\n");
+		printf ("             size and pixel format are reported on stderr\n");
+		printf ("  --stats=json  end with per file and batch statistics (sizes, ratios, failures, times)\n");
+		printf ("             as a single line of JSON\n");
+		printf ("\n");
+		printf ("Set PNGDEFRY_CPU to scalar, sse2, ssse3, sse41 or avx2 to limit the processor specific code used.\n");
 		return 0;
 	}
 
+	bind_cpu_variants (getenv ("PNGDEFRY_CPU"));
+
 	nomoreoptions = 0;
 	for (i=1; i<argc; i++)
 	{
 		if (argv[i][0] != '-')
 			break;
+		/* set when the option used up all of its argument, e.g. -s(suffix) */
+		consumed = 0;
 		switch (argv[i][1])
 		{
 			case 0:
-				nomoreoptions = 1;
+				/* a lone '-' at the very end is stdin, anywhere else it ends the options */
+				if (i == argc-1)
+					nomoreoptions = 2;
+				else
+					nomoreoptions = 1;
 				break;
 			case 'd': flag_Debug = 1; flag_Verbose = 1; flag_List_Chunks = 1; break;
 			case 'a': flag_UpdateAlpha = 0; break;
+			case 'A': flag_DropAlpha = 1; break;
+			case 'f': flag_FastRepack = 1; break;
+			case 'z': flag_MaxCompress = 1; break;
 			case 'l': flag_List_Chunks = 1; break;
 			case 'p': flag_Process_Anyway = 1; break;
 			case 'v': flag_Verbose = 1; break;
+			case 'V': flag_Validate = 1; break;
 			case 'C': flag_Ignore_CRC32 = 1; break;
+			case '-':
+				if (!strcmp (argv[i], "--raw"))
+					flag_Raw = 1;
+				else if (!strcmp (argv[i], "--rawvideo"))
+					flag_Raw = 2;
+				else if (!strcmp (argv[i], "--stats=json"))
+					flag_Stats = 1;
+				else
+				{
+					printf ("pngdefry : unknown option '%s'\n", argv[i]);
+					return -1;
+				}
+				consumed = 1;
+				break;
 			case 's':
 				if (argv[i][2])
 				{
@@ -1453,7 +2132,7 @@ int main (int argc, char **argv)
 						return -1;
 					}
 				}
-				argv[i][2] = 0;
+				consumed = 1;
 				flag_Rewrite = 1;
 				break;
 			case 'o':
@@ -1484,7 +2163,7 @@ int main (int argc, char **argv)
 						return -1;
 					}
 				}
-				argv[i][2] = 0;
+				consumed = 1;
 				flag_Rewrite = 1;
 				break;
 			case 'i':
@@ -1497,8 +2176,7 @@ int main (int argc, char **argv)
 						printf ("pngdefry : invalid repack size '%s'\n", argv[i]+2);
 						return -1;
 					}
-					/* yuck. it does circumvent problems down later, thouh, and an extra flag to set/check :( */
-					argv[i][2] = 0;
+					consumed = 1;
 					break;
 				} else
 				{
@@ -1512,8 +2190,7 @@ int main (int argc, char **argv)
 							printf ("pngdefry : invalid repack size '%s'\n", argv[i]);
 							return -1;
 						}
-						/* yuck. it does circumvent problems down later, thouh, and an extra flag to set/check :( */
-						argv[i][2] = 0;
+							consumed = 1;
 					} else
 					{
 						printf ("pngdefry : -i is missing repack size\n");
@@ -1521,6 +2198,68 @@ int main (int argc, char **argv)
 					}
 				}
 				break;
+			case 'm':
+				if (argv[i][2])
+				{
+					char *endptr;
+					memory_budget = (size_t)strtol(argv[i]+2, &endptr, 10) * 1048576;
+					if (*endptr || argv[i][2] == '-')
+					{
+						printf ("pngdefry : invalid memory budget '%s'\n", argv[i]+2);
+						return -1;
+					}
+					consumed = 1;
+				} else
+				{
+					if (i < argc-1)
+					{
+						char *endptr;
+						i++;
+						memory_budget = (size_t)strtol(argv[i], &endptr, 10) * 1048576;
+						if (*endptr || !argv[i][0] || argv[i][0] == '-')
+						{
+							printf ("pngdefry : invalid memory budget '%s'\n", argv[i]);
+							return -1;
+						}
+						consumed = 1;
+					} else
+					{
+						printf ("pngdefry : -m is missing memory budget\n");
+						return -1;
+					}
+				}
+				break;
+			case 't':
+				if (argv[i][2])
+				{
+					char *endptr;
+					thumbnail_width = strtol(argv[i]+2, &endptr, 10);
+					if (*endptr || thumbnail_width < 1)
+					{
+						printf ("pngdefry : invalid thumbnail width '%s'\n", argv[i]+2);
+						return -1;
+					}
+					consumed = 1;
+				} else
+				{
+					if (i < argc-1)
+					{
+						char *endptr;
+						i++;
+						thumbnail_width = strtol(argv[i], &endptr, 10);
+						if (*endptr || thumbnail_width < 1)
+						{
+							printf ("pngdefry : invalid thumbnail width '%s'\n", argv[i]);
+							return -1;
+						}
+						consumed = 1;
+					} else
+					{
+						printf ("pngdefry : -t is missing thumbnail width\n");
+						return -1;
+					}
+				}
+				break;
 			default:
 				printf ("pngdefry : unknown option '%s'\n", argv[i]);
 				return -1;
@@ -1529,11 +2268,12 @@ int main (int argc, char **argv)
 		/* was the last option seen '-' ? */
 		if (nomoreoptions)
 		{
-			i++;
+			if (nomoreoptions == 1)
+				i++;
 			break;
 		}
 
-		if (argv[i][2] != 0)
+		if (!consumed && argv[i][2] != 0)
 		{
 			printf ("pngdefry : unknown option '%s'\n", argv[i]);
 			return -1;
@@ -1544,19 +2284,55 @@ int main (int argc, char **argv)
 		printf ("pngdefry : no file name(s) provided\n");
 		return -1;
 	}
+	if ((thumbnail_width || flag_Raw == 1) && !flag_Rewrite)
+	{
+		if (thumbnail_width)
+			suffix = "-thumb";
+		flag_Rewrite = 1;
+	}
+	if (flag_Raw == 2 || (outputPath && !strcmp (outputPath, "-")))
+	{
+		/* the image data gets stdout to itself; everything else goes to stderr */
+		fflush (stdout);
+		output_stdout = fdopen (dup (1), "wb");
+		if (output_stdout == NULL || dup2 (2, 1) < 0)
+		{
+			printf ("pngdefry : cannot redirect standard output\n");
+			return -1;
+		}
+		if (flag_Raw == 2)
+			flag_Rewrite = 0;
+	}
+	if (flag_Verbose)
+		printf ("pngdefry : using %s code paths\n", cpu_level_names[cpu_level]);
+	if (flag_Debug)
+		printf ("pngdefry : mz_adler32_combine %s\n", check_adler32_combine () ? "checks out" : "does NOT match the Adler-32 of the whole buffer");
 /*	if (flag_Rewrite == 0)
 		printf ("pngdefry : no -s(suffix) or -o(path) provided, files will be processed but not written\n"); */
 
+	/* -V, and -l without anything else to do, only walk over the chunks */
+	walkOnly = flag_Validate || (flag_List_Chunks && !flag_Debug && !flag_Rewrite && !flag_Raw);
+
 	for (; i<argc; i++)
 	{
 		seenFiles++;
-		if (process (argv[i]))
+		stats_begin ();
+		if (walkOnly ? walk_file (argv[i]) : process (argv[i]))
 			processedFiles++;
+		stats_end (argv[i]);
 	}
-	if (flag_Rewrite)
+	if (flag_Validate)
+		printf ("pngdefry : seen %d file(s), %d valid\n", seenFiles, processedFiles);
+	else if (walkOnly)
+		printf ("pngdefry : seen %d file(s), listed %d file(s)\n", seenFiles, processedFiles);
+	else if (flag_Rewrite)
 		printf ("pngdefry : seen %d file(s), wrote %d file(s)\n", seenFiles, processedFiles);
 	else
 		printf ("pngdefry : seen %d file(s), processed %d file(s)\n", seenFiles, processedFiles);
+	if (flag_Stats)
+		print_stats_json ();
+	if (flag_Validate && processedFiles != seenFiles)
+		return 1;
 	return 0;
 }
 
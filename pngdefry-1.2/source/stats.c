@@ -0,0 +1,195 @@
+/* stats.c - per file and batch statistics, for pngdefry's --stats=json option
+   Part of pngdefry; included by pngdefry.c, after dispatch.c.
+
+	process() and walk_file() fill in 'file_stats' for the file at hand: bytes
+	read and written, whether it was -iphone, and what went wrong, if anything.
+	main() wraps each file in stats_begin() and stats_end(), which add the timing
+	and keep a record. At the end, print_stats_json() writes all records and the
+	totals as a single line of JSON, the very last line of output, so a script can
+	simply take the last line.
+
+	Failures are short fixed names, so they can be counted: open, not_png,
+	chunk_size, out_of_memory, truncated, crc, missing_iend, invalid_header,
+	no_idat, decompression, row_filter, compression, output, invalid.
+*/
+
+struct file_stats_t {
+	char *filename;
+	int isPNG;				/* got as far as the first chunk */
+	int isPhoney;
+	int skipped;			/* not an -iphone file, so left alone */
+	const char *failure;	/* NULL if all went well */
+	size_t in_bytes, out_bytes;
+	double wall_seconds, cpu_seconds;
+};
+
+struct file_stats_t file_stats;
+
+struct file_stats_t *all_stats = NULL;
+int num_stats = 0, max_stats = 0;
+
+struct timeval stats_start_time, stats_file_time;
+clock_t stats_file_clock;
+
+double seconds_since (struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday (&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec)/1000000.0;
+}
+
+void stats_begin (void)
+{
+	if (!num_stats)
+		gettimeofday (&stats_start_time, NULL);
+	memset (&file_stats, 0, sizeof(file_stats));
+	gettimeofday (&stats_file_time, NULL);
+	stats_file_clock = clock ();
+}
+
+void stats_end (char *filename)
+{
+	struct file_stats_t *grown;
+
+	if (num_stats >= max_stats)
+	{
+		grown = (struct file_stats_t *)realloc (all_stats, (max_stats+64) * sizeof(struct file_stats_t));
+		/* running out of memory for statistics is no reason to stop */
+		if (grown == NULL)
+			return;
+		all_stats = grown;
+		max_stats += 64;
+	}
+	file_stats.filename = filename;
+	file_stats.wall_seconds = seconds_since (&stats_file_time);
+	file_stats.cpu_seconds = (double)(clock () - stats_file_clock) / CLOCKS_PER_SEC;
+	all_stats[num_stats++] = file_stats;
+}
+
+const char *stats_status (struct file_stats_t *stats)
+{
+	if (stats->failure)
+		return "failed";
+	if (stats->skipped)
+		return "skipped";
+	return stats->out_bytes ? "written" : "ok";
+}
+
+/*	Length of the valid UTF-8 sequence at 'str', or 0 if there isn't one */
+int utf8_length (const unsigned char *str)
+{
+	int len, i;
+
+	if (str[0] < 0x80)
+		return 1;
+	if (str[0] >= 0xc2 && str[0] <= 0xdf)
+		len = 2;
+	else if (str[0] >= 0xe0 && str[0] <= 0xef)
+		len = 3;
+	else if (str[0] >= 0xf0 && str[0] <= 0xf4)
+		len = 4;
+	else
+		return 0;
+	/* this stops at the terminating zero, too */
+	for (i=1; i<len; i++)
+		if ((str[i] & 0xc0) != 0x80)
+			return 0;
+	/* no overlong forms, surrogates or code points past U+10FFFF */
+	if ((str[0] == 0xe0 && str[1] < 0xa0) || (str[0] == 0xed && str[1] >= 0xa0) ||
+		(str[0] == 0xf0 && str[1] < 0x90) || (str[0] == 0xf4 && str[1] >= 0x90))
+		return 0;
+	return len;
+}
+
+/*	File names are only bytes; any that aren't valid UTF-8 are taken as Latin-1
+	and escaped, so the output is always valid JSON */
+void print_json_string (const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	int len;
+
+	putchar ('"');
+	while (*s)
+	{
+		len = utf8_length (s);
+		if (*s == '"' || *s == '\\')
+			printf ("\\%c", *s);
+		else if (*s < 0x20 || len == 0)
+			printf ("\\u%04x", *s);
+		else
+		{
+			fwrite (s, 1, len, stdout);
+			s += len;
+			continue;
+		}
+		s++;
+	}
+	putchar ('"');
+}
+
+/*	Output sizes compared to input sizes, or 0 if nothing was written */
+double stats_ratio (size_t in_bytes, size_t out_bytes)
+{
+	return in_bytes && out_bytes ? (double)out_bytes/in_bytes : 0;
+}
+
+void print_stats_json (void)
+{
+	const char *failure_names[] = { "open", "not_png", "chunk_size", "out_of_memory", "truncated", "crc", "missing_iend",
+		"invalid_header", "no_idat", "decompression", "row_filter", "compression", "output", "invalid" };
+	int failure_counts[14];
+	int i, j, written = 0, failed = 0, skipped = 0, cgbi = 0, plain = 0, comma;
+	unsigned long long in_bytes = 0, out_bytes = 0;
+	double wall_seconds, cpu_seconds = 0;
+
+	wall_seconds = num_stats ? seconds_since (&stats_start_time) : 0;
+	memset (failure_counts, 0, sizeof(failure_counts));
+
+	printf ("{\"files\":[");
+	for (i=0; i<num_stats; i++)
+	{
+		struct file_stats_t *s = &all_stats[i];
+
+		printf ("%s{\"file\":", i ? "," : "");
+		print_json_string (s->filename);
+		printf (",\"status\":\"%s\",\"cgbi\":%s,\"input_bytes\":%lu,\"output_bytes\":%lu,\"ratio\":%.4f,\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f",
+			stats_status (s), s->isPhoney ? "true" : "false", (unsigned long)s->in_bytes, (unsigned long)s->out_bytes,
+			stats_ratio (s->in_bytes, s->out_bytes), s->wall_seconds, s->cpu_seconds);
+		if (s->failure)
+			printf (",\"failure\":\"%s\"", s->failure);
+		printf ("}");
+
+		in_bytes += s->in_bytes;
+		out_bytes += s->out_bytes;
+		cpu_seconds += s->cpu_seconds;
+		cgbi += s->isPhoney;
+		plain += s->isPNG && !s->isPhoney;
+		if (s->failure)
+		{
+			failed++;
+			for (j=0; j<14; j++)
+				if (!strcmp (s->failure, failure_names[j]))
+					failure_counts[j]++;
+		} else if (s->skipped)
+			skipped++;
+		else if (s->out_bytes)
+			written++;
+	}
+	printf ("],\"summary\":{\"files\":%d,\"written\":%d,\"failed\":%d,\"skipped\":%d,\"cgbi\":%d,\"plain\":%d", num_stats, written, failed, skipped, cgbi, plain);
+	printf (",\"input_bytes\":%llu,\"output_bytes\":%llu,\"ratio\":%.4f", in_bytes, out_bytes, stats_ratio (in_bytes, out_bytes));
+	printf (",\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f", wall_seconds, cpu_seconds);
+	printf (",\"files_per_second\":%.3f,\"input_bytes_per_second\":%.0f", wall_seconds > 0 ? num_stats/wall_seconds : 0, wall_seconds > 0 ? in_bytes/wall_seconds : 0);
+	printf (",\"failures\":{");
+	comma = 0;
+	for (j=0; j<14; j++)
+	{
+		if (failure_counts[j])
+		{
+			printf ("%s\"%s\":%d", comma ? "," : "", failure_names[j], failure_counts[j]);
+			comma = 1;
+		}
+	}
+	printf ("}}}\n");
+	free (all_stats);
+}
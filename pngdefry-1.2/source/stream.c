@@ -0,0 +1,289 @@
+/* stream.c - row by row repacking, for images larger than the -m memory budget
+   Part of pngdefry; included by pngdefry.c, before process().
+
+	The IDAT data in the current pngChunks is inflated through the 32K window of
+	the shared inflator, a chunk at a time, and every row is de-fried as soon as
+	it is complete and handed straight to the shared compressor. Only a few rows
+	of the image are ever held, plus the (growing) compressed output.
+
+	Each row goes through the same steps as the in-memory path in process(): swap
+	BGR(A) to RGB(A); for -iphone RGBA, remove the row filter, de-multiply the alpha
+	or drop it (-A), and put the original row filter back on. Un-filtering needs the
+	previous row as it was, re-filtering the previous row as it is now, so both are
+	kept. Interlaced images are a series of sub-images, one per Adam7 pass.
+
+	The compressed output is not kept either: it goes into a single IDAT chunk
+	of at most -i bytes, which is written out as soon as it is full. What is
+	left in memory is the input file's chunks, as read by init_chunk.
+
+	Whether an image is fully opaque is only known at the very end, so for -A the
+	data is inflated twice: once only to look at the alpha (opaque_rows), and once
+	for real.
+*/
+
+struct stream_t {
+	int num_passes;
+	unsigned int pass_wide[7], pass_high[7];
+	int bytespp;		/* 3 or 4 */
+	int unfilter;		/* RGBA that gets de-multiplied, or may lose its alpha */
+	int demultiply, drop_alpha;
+	int scan_only;		/* only find 'alpha', don't compress anything */
+	int alpha;			/* AND of all alpha bytes so far */
+
+/* Rows, filter byte first. The unfiltered and de-fried rows swap with the
+   previous ones after every row */
+	unsigned char *in_row, *prev_plain, *cur_out, *prev_out, *filtered;
+};
+
+struct stream_dest_t {
+	FILE *f;				/* NULL to only count the bytes */
+	unsigned char *chunk;	/* "IDAT" and up to repack_IDAT_size bytes of data */
+	size_t length;			/* of the data in 'chunk' */
+	size_t total;			/* of all data so far */
+};
+
+/*	Write the IDAT chunk in dest->chunk, if there is anything in it */
+void stream_flush (struct stream_dest_t *dest)
+{
+	if (dest->f && dest->length)
+		write_chunk (dest->f, dest->length, dest->chunk, crc32s (dest->chunk, dest->length+4));
+	dest->length = 0;
+}
+
+/*	As deflate_put, but full IDAT chunks are written out right away */
+int stream_put (const void *buf, int len, void *user)
+{
+	struct stream_dest_t *dest = (struct stream_dest_t *)user;
+	const unsigned char *data = (const unsigned char *)buf;
+	size_t piece;
+
+	while (len)
+	{
+		piece = (size_t)repack_IDAT_size - dest->length;
+		if (piece > (size_t)len)
+			piece = len;
+		memcpy (dest->chunk + 4 + dest->length, data, piece);
+		dest->length += piece;
+		dest->total += piece;
+		data += piece;
+		len -= (int)piece;
+		if (dest->length == (size_t)repack_IDAT_size)
+			stream_flush (dest);
+	}
+	return 1;
+}
+
+/*	De-fry one complete row of 'wide' pixels in s->in_row, and compress it.
+	'first' is set for the first row of an image or pass, which has no row above.
+	Returns 0, or -3 for an unknown row filter, -5 for a compression error */
+int stream_row (struct stream_t *s, unsigned int wide, int first)
+{
+	unsigned char *row = s->in_row, *out, *swap;
+	int rowfilter = row[0], out_bytespp;
+	size_t rowbytes = (size_t)wide*s->bytespp;
+
+	if (rowfilter > 4)
+		return -3;
+	swap_pixels (row+1, wide, s->bytespp);
+	if (!s->unfilter)
+	{
+		if (tdefl_compress_buffer (&deflator, row, rowbytes+1, TDEFL_NO_FLUSH) != TDEFL_STATUS_OKAY)
+			return -5;
+		return 0;
+	}
+
+	unfilter_row (rowfilter, row+1, first ? NULL : s->prev_plain+1, rowbytes, 4);
+	if (s->alpha == 255)
+		s->alpha = alpha_and (row+1, wide);
+	if (!s->scan_only)
+	{
+		out = s->cur_out;
+		out[0] = rowfilter;
+		if (s->drop_alpha)
+		{
+			strip_alpha (out+1, row+1, wide);
+			out_bytespp = 3;
+		} else
+		{
+			memcpy (out+1, row+1, rowbytes);
+			if (s->demultiply)
+				demultiply_pixels (out+1, wide);
+			out_bytespp = 4;
+		}
+		memcpy (s->filtered, out, (size_t)wide*out_bytespp+1);
+		refilter_row (rowfilter, s->filtered+1, first ? NULL : s->prev_out+1, wide*out_bytespp, out_bytespp);
+		if (tdefl_compress_buffer (&deflator, s->filtered, (size_t)wide*out_bytespp+1, TDEFL_NO_FLUSH) != TDEFL_STATUS_OKAY)
+			return -5;
+		swap = s->cur_out;
+		s->cur_out = s->prev_out;
+		s->prev_out = swap;
+	}
+	swap = s->in_row;
+	s->in_row = s->prev_plain;
+	s->prev_plain = swap;
+	return 0;
+}
+
+/*	Inflate all IDAT chunks, starting at pngChunks[idat_first_index], and pass
+	every row through stream_row. Returns 0, or -2 for a decompression error
+	(including too much or too little data), or an error from stream_row */
+int stream_image (struct stream_t *s, int idat_first_index, int isPhoney)
+{
+	tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+	size_t in_pos, in_bytes, out_pos = 0, out_bytes, row_pos = 0, rowbytes, piece;
+	unsigned char *out;
+	unsigned int y = 0;
+	int i, pass = 0, result;
+	int flags = TINFL_FLAG_HAS_MORE_INPUT | (isPhoney ? 0 : TINFL_FLAG_PARSE_ZLIB_HEADER);
+
+	/* zero sized passes have no rows at all, not even filter bytes */
+	while (pass < s->num_passes && (s->pass_wide[pass] == 0 || s->pass_high[pass] == 0))
+		pass++;
+	rowbytes = pass < s->num_passes ? (size_t)s->pass_wide[pass]*s->bytespp+1 : 0;
+
+	tinfl_init (&inflator);
+	for (i=idat_first_index; i<num_chunks && pngChunks[i].id == 0x49444154 && status != TINFL_STATUS_DONE; i++)	/* "IDAT" */
+	{
+		in_pos = 0;
+		do
+		{
+			in_bytes = pngChunks[i].length - in_pos;
+			out_bytes = TINFL_LZ_DICT_SIZE - out_pos;
+			status = tinfl_decompress (&inflator, pngChunks[i].data+4+in_pos, &in_bytes, inflate_window, inflate_window+out_pos, &out_bytes, flags);
+			in_pos += in_bytes;
+			if (status < 0)
+				return -2;
+
+			out = inflate_window+out_pos;
+			out_pos = (out_pos + out_bytes) & (TINFL_LZ_DICT_SIZE-1);
+			while (out_bytes)
+			{
+				if (pass == s->num_passes)
+					return -2;
+				piece = rowbytes - row_pos < out_bytes ? rowbytes - row_pos : out_bytes;
+				memcpy (s->in_row+row_pos, out, piece);
+				out += piece;
+				out_bytes -= piece;
+				row_pos += piece;
+				if (row_pos < rowbytes)
+					continue;
+
+				result = stream_row (s, s->pass_wide[pass], y == 0);
+				if (result)
+					return result;
+				row_pos = 0;
+				if (++y == s->pass_high[pass])
+				{
+					y = 0;
+					do
+						pass++;
+					while (pass < s->num_passes && (s->pass_wide[pass] == 0 || s->pass_high[pass] == 0));
+					rowbytes = pass < s->num_passes ? (size_t)s->pass_wide[pass]*s->bytespp+1 : 0;
+				}
+			}
+		} while (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && in_pos < pngChunks[i].length));
+	}
+	if (status != TINFL_STATUS_DONE || pass != s->num_passes)
+		return -2;
+	return 0;
+}
+
+/*	Set up 's' for the 8 bit RGB (colortype 2) or RGBA (colortype 6) image in the
+	current pngChunks. Returns 0, or -1 if out of memory */
+int stream_init (struct stream_t *s, unsigned int imgwidth, unsigned int imgheight, unsigned int interlace, unsigned int colortype, int isPhoney)
+{
+	int Starting_Row [] =  { 0, 0, 4, 0, 2, 0, 1 };
+	int Starting_Col [] =  { 0, 4, 0, 2, 0, 1, 0 };
+	int Row_Increment [] = { 8, 8, 8, 4, 4, 2, 2 };
+	int Col_Increment [] = { 8, 8, 4, 4, 2, 2, 1 };
+	size_t rowsize;
+	int pass;
+
+	memset (s, 0, sizeof(*s));
+	if (interlace == 1)
+	{
+		s->num_passes = 7;
+		for (pass=0; pass<7; pass++)
+		{
+			s->pass_wide[pass] = (imgwidth - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
+			s->pass_high[pass] = (imgheight - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
+		}
+	} else
+	{
+		s->num_passes = 1;
+		s->pass_wide[0] = imgwidth;
+		s->pass_high[0] = imgheight;
+	}
+	s->bytespp = colortype == 6 ? 4 : 3;
+	s->unfilter = isPhoney && colortype == 6 && (flag_UpdateAlpha || flag_DropAlpha);
+	s->alpha = 255;
+
+	rowsize = (size_t)imgwidth*s->bytespp+1;
+	s->in_row = (unsigned char *)malloc (rowsize);
+	s->prev_plain = (unsigned char *)malloc (rowsize);
+	s->cur_out = (unsigned char *)malloc (rowsize);
+	s->prev_out = (unsigned char *)malloc (rowsize);
+	s->filtered = (unsigned char *)malloc (rowsize);
+	if (!s->in_row || !s->prev_plain || !s->cur_out || !s->prev_out || !s->filtered)
+		return -1;
+	return 0;
+}
+
+void stream_free (struct stream_t *s)
+{
+	free (s->in_row);
+	free (s->prev_plain);
+	free (s->cur_out);
+	free (s->prev_out);
+	free (s->filtered);
+}
+
+/*	For -A: find out whether the image is fully opaque, so its alpha can be
+	dropped, before a single row is written. Sets *opaque, or returns an error
+	as repack_rows */
+int opaque_rows (unsigned int imgwidth, unsigned int imgheight, unsigned int interlace, unsigned int colortype, int isPhoney, int idat_first_index, int *opaque)
+{
+	struct stream_t s;
+	int result;
+
+	*opaque = 0;
+	result = stream_init (&s, imgwidth, imgheight, interlace, colortype, isPhoney);
+	if (!result && s.unfilter)
+	{
+		s.scan_only = 1;
+		result = stream_image (&s, idat_first_index, isPhoney);
+		*opaque = s.alpha == 255;
+	}
+	stream_free (&s);
+	return result;
+}
+
+/*	Repack the image in the current pngChunks a row at a time, as process() does
+	in memory, and compress it with 'flags' into IDAT chunks written to dest->f
+	(dest->chunk must have room for repack_IDAT_size+4 bytes). 'drop_alpha' is
+	from opaque_rows; *opaque is set as in process(). The number of compressed
+	bytes is in dest->total. Returns 0, or -1 (out of memory), -2 (decompression
+	error), -3 (unknown row filter) or -5 (compression error) */
+int repack_rows (unsigned int imgwidth, unsigned int imgheight, unsigned int interlace, unsigned int colortype, int isPhoney, int idat_first_index, int flags, int drop_alpha, struct stream_dest_t *dest, int *opaque)
+{
+	struct stream_t s;
+	int result;
+
+	result = stream_init (&s, imgwidth, imgheight, interlace, colortype, isPhoney);
+	if (!result)
+	{
+		s.drop_alpha = s.unfilter && drop_alpha;
+		s.demultiply = s.unfilter && flag_UpdateAlpha && !s.drop_alpha;
+		dest->length = 0;
+		dest->total = 0;
+		tdefl_reinit (&deflator, stream_put, dest, flags);
+		result = stream_image (&s, idat_first_index, isPhoney);
+		if (!result && tdefl_compress_buffer (&deflator, NULL, 0, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+			result = -5;
+		if (!result)
+			stream_flush (dest);
+	}
+	*opaque = s.unfilter && s.alpha == 255;
+	stream_free (&s);
+	return result;
+}
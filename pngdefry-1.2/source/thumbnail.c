@@ -0,0 +1,188 @@
+/* thumbnail.c - small preview images for pngdefry's -t option
+   Part of pngdefry; included by pngdefry.c, after decode.c.
+
+	The rows from decode_image() are shrunk with an area-averaging box filter:
+	each thumbnail pixel is the average of the part of the image it covers, which
+	is what you want when going down by a large factor. Color is averaged weighted
+	by alpha, so the (meaningless) color of transparent pixels does not bleed into
+	the edges. -iphone RGBA data is already stored that way, so it is not
+	de-multiplied first.
+
+	Images are never scaled up; anything not wider than the thumbnail width is
+	converted at its own size.
+*/
+
+struct thumbnail_t {
+	unsigned int src_wide, src_high;
+	int wide, high;
+	int chans;			/* 1..4, as for tdefl_write_image_to_png_file_in_memory */
+	int has_alpha;		/* last channel is alpha */
+	int premultiplied;	/* color is already multiplied by alpha (-iphone RGBA) */
+
+/* Resampling state */
+	int *col_first;			/* per source column: first thumbnail column it covers */
+	double *col_weight;		/* .. and the part of it that goes there; the rest goes to the next */
+	double *row_sums;		/* one source row, summed horizontally */
+	double *sums, *next_sums;	/* current and next thumbnail row */
+	double area;			/* source pixels per thumbnail pixel */
+	unsigned int src_row;
+	int row;
+
+	unsigned char *pixels;
+};
+
+void free_thumbnail (struct thumbnail_t *t)
+{
+	free (t->col_first);
+	free (t->col_weight);
+	free (t->row_sums);
+	free (t->sums);
+	free (t->next_sums);
+	free (t->pixels);
+}
+
+int init_thumbnail (struct thumbnail_t *t, int thumb_wide)
+{
+	unsigned int x;
+	unsigned long long left, edge;
+
+	t->wide = t->src_wide < (unsigned int)thumb_wide ? (int)t->src_wide : thumb_wide;
+	t->high = (int)(((unsigned long long)t->src_high * t->wide + t->src_wide/2) / t->src_wide);
+	if (t->high < 1)
+		t->high = 1;
+	t->area = ((double)t->src_wide/t->wide) * ((double)t->src_high/t->high);
+
+	t->col_first = (int *)malloc (t->src_wide * sizeof(int));
+	t->col_weight = (double *)malloc (t->src_wide * sizeof(double));
+	t->row_sums = (double *)malloc (t->wide * t->chans * sizeof(double));
+	t->sums = (double *)calloc (t->wide * t->chans, sizeof(double));
+	t->next_sums = (double *)calloc (t->wide * t->chans, sizeof(double));
+	t->pixels = (unsigned char *)malloc ((size_t)t->wide * t->high * t->chans);
+	if (!t->col_first || !t->col_weight || !t->row_sums || !t->sums || !t->next_sums || !t->pixels)
+		return 0;
+
+	/*	In units of 1/(src_wide*wide): source column x spans [x*wide, (x+1)*wide),
+		thumbnail column c spans [c*src_wide, (c+1)*src_wide). A source column
+		is never wider than a thumbnail column, so it covers at most two. */
+	for (x=0; x<t->src_wide; x++)
+	{
+		left = (unsigned long long)x * t->wide;
+		t->col_first[x] = (int)(left / t->src_wide);
+		edge = (unsigned long long)(t->col_first[x]+1) * t->src_wide;
+		if (left + t->wide <= edge)
+			t->col_weight[x] = 1.0;
+		else
+			t->col_weight[x] = (double)(edge - left) / t->wide;
+	}
+	t->src_row = 0;
+	t->row = 0;
+	return 1;
+}
+
+/*	Add one row of 8 bit samples; rows must come in top to bottom */
+void thumbnail_add_row (void *user, unsigned char *src)
+{
+	struct thumbnail_t *t = (struct thumbnail_t *)user;
+	unsigned int x;
+	int c, col, chans = t->chans, colors;
+	unsigned int a;
+	double w, v, *sums;
+	unsigned long long top, edge;
+
+	colors = t->has_alpha ? chans-1 : chans;
+
+	memset (t->row_sums, 0, t->wide * chans * sizeof(double));
+	for (x=0; x<t->src_wide; x++)
+	{
+		sums = t->row_sums + t->col_first[x]*chans;
+		w = t->col_weight[x];
+		if (t->has_alpha)
+		{
+			a = src[colors];
+			sums[colors] += w*a;
+			if (w < 1.0)
+				sums[chans+colors] += (1.0-w)*a;
+			/* premultiplied data holds color*alpha/255 */
+			if (t->premultiplied)
+				a = 255;
+		} else
+			a = 1;
+		for (c=0; c<colors; c++)
+		{
+			v = (double)(src[c]*a);
+			sums[c] += w*v;
+			if (w < 1.0)
+				sums[chans+c] += (1.0-w)*v;
+		}
+		src += chans;
+	}
+
+	/* same for rows as for columns above */
+	top = (unsigned long long)t->src_row * t->high;
+	edge = (unsigned long long)(t->row+1) * t->src_high;
+	w = top + t->high <= edge ? 1.0 : (double)(edge - top) / t->high;
+	for (col=0; col<t->wide*chans; col++)
+	{
+		t->sums[col] += w*t->row_sums[col];
+		if (w < 1.0)
+			t->next_sums[col] += (1.0-w)*t->row_sums[col];
+	}
+	t->src_row++;
+
+	if (top + t->high >= edge)
+	{
+		/* thumbnail row done */
+		unsigned char *dst = t->pixels + (size_t)t->row * t->wide * chans;
+		double alpha, *swap;
+
+		sums = t->sums;
+		for (col=0; col<t->wide; col++)
+		{
+			if (t->has_alpha)
+			{
+				alpha = sums[colors];
+				for (c=0; c<colors; c++)
+				{
+					v = alpha > 0 ? sums[c]/alpha : 0;
+					dst[c] = v >= 255 ? 255 : (unsigned char)(v+0.5);
+				}
+				v = alpha/t->area;
+				dst[colors] = v >= 255 ? 255 : (unsigned char)(v+0.5);
+			} else
+			{
+				for (c=0; c<chans; c++)
+				{
+					v = sums[c]/t->area;
+					dst[c] = v >= 255 ? 255 : (unsigned char)(v+0.5);
+				}
+			}
+			sums += chans;
+			dst += chans;
+		}
+		swap = t->sums;
+		t->sums = t->next_sums;
+		t->next_sums = swap;
+		memset (t->next_sums, 0, t->wide * chans * sizeof(double));
+		t->row++;
+	}
+}
+
+/*	Decode and shrink the image. The thumbnail ends up in t->pixels, and t
+	must be released with free_thumbnail(), also after a failure.
+	Returns 0, or one of decode_image()'s error codes */
+int make_thumbnail (struct decoder_t *d, int thumb_wide, struct thumbnail_t *t)
+{
+	memset (t, 0, sizeof(*t));
+	t->src_wide = d->wide;
+	t->src_high = d->high;
+	t->chans = d->chans;
+	t->has_alpha = d->has_alpha;
+	t->premultiplied = d->premultiplied;
+
+	if (!init_thumbnail (t, thumb_wide))
+		return -1;
+	if (flag_Verbose)
+		printf ("    thumbnail          : %d x %d, %d channels\n", t->wide, t->high, t->chans);
+
+	return decode_image (d, thumbnail_add_row, t);
+}
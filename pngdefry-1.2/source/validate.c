@@ -0,0 +1,399 @@
+/* validate.c - walking PNG files without loading them, for pngdefry's -V and -l options
+   Part of pngdefry; included by pngdefry.c, before process().
+
+	Each file is read once, front to back, in pieces of at most VALIDATE_BUFFER_SIZE
+	bytes. Memory use does not depend on the image size at all: chunk data is only
+	looked at as it streams by, and IDAT data is inflated into the 32K wrapping
+	window of the shared inflator and then thrown away.
+
+	Only listing the chunks (-l without -V) does not look at chunk data at all: it
+	is skipped with fseek, so only the chunk headers and CRCs are actually read.
+	Input that cannot seek, such as a pipe, is read and discarded instead.
+
+	Checked are: the PNG signature, every chunk's length, type and CRC, the IHDR
+	values, the chunk order (IHDR first, or right after CgBI; PLTE before the
+	IDATs; IDATs all together; IEND last, and nothing after it), that the image
+	data inflates without errors (including its Adler-32, unless it's -iphone raw
+	deflate), and that it comes to exactly the size the IHDR says.
+*/
+
+#define VALIDATE_BUFFER_SIZE	32768
+
+unsigned char validate_buffer[VALIDATE_BUFFER_SIZE];
+
+struct validator_t {
+	int isPhoney;
+	int num_chunks;
+	int seen_ihdr, seen_plte, seen_idat, idat_done, seen_iend;
+	unsigned int imgwidth, imgheight, bitdepth, colortype, interlace;
+
+/* Inflating state */
+	unsigned long long expected_size, inflated_size;
+	tinfl_status status;
+	size_t out_pos;
+};
+
+/*	Check the 13 bytes of IHDR data and work out how much image data to expect.
+	Returns NULL if all is well, or what is wrong */
+const char *validate_ihdr (struct validator_t *v, const unsigned char *ihdr)
+{
+	int Starting_Row [] =  { 0, 0, 4, 0, 2, 0, 1 };
+	int Starting_Col [] =  { 0, 4, 0, 2, 0, 1, 0 };
+	int Row_Increment [] = { 8, 8, 8, 4, 4, 2, 2 };
+	int Col_Increment [] = { 8, 8, 4, 4, 2, 2, 1 };
+	unsigned long long w, h;
+	unsigned int samples, bitspp;
+	int pass;
+
+	v->imgwidth = read_long ((void *)ihdr);
+	v->imgheight = read_long ((void *)(ihdr+4));
+	v->bitdepth = ihdr[8];
+	v->colortype = ihdr[9];
+	v->interlace = ihdr[12];
+
+	if (v->imgwidth == 0 || v->imgheight == 0 || v->imgwidth > MAX_IMAGE_WIDTH || v->imgheight > MAX_IMAGE_HEIGHT)
+		return "image dimensions invalid";
+	if (ihdr[10] != 0)
+		return "unknown compression type";
+	if (ihdr[11] != 0)
+		return "unknown filter type";
+	if (v->interlace > 1)
+		return "unknown interlace type";
+
+	switch (v->colortype)
+	{
+		case 0: samples = 1; break;
+		case 2: samples = 3; break;
+		case 3: samples = 1; break;
+		case 4: samples = 2; break;
+		case 6: samples = 4; break;
+		default:
+			return "unknown color type";
+	}
+	switch (v->bitdepth)
+	{
+		case 1: case 2: case 4:
+			if (v->colortype != 0 && v->colortype != 3)
+				return "invalid bit depth for color type";
+			break;
+		case 8:
+			break;
+		case 16:
+			if (v->colortype == 3)
+				return "invalid bit depth for color type";
+			break;
+		default:
+			return "invalid bit depth for color type";
+	}
+	bitspp = samples*v->bitdepth;
+
+	/* every row is a filter byte and the pixels, rounded up to whole bytes */
+	if (v->interlace == 1)
+	{
+		v->expected_size = 0;
+		for (pass=0; pass<7; pass++)
+		{
+			w = (v->imgwidth - Starting_Col[pass] + Col_Increment[pass] - 1)/Col_Increment[pass];
+			h = (v->imgheight - Starting_Row[pass] + Row_Increment[pass] - 1)/Row_Increment[pass];
+			if (w)
+				v->expected_size += ((w*bitspp+7)/8 + 1) * h;
+		}
+	} else
+		v->expected_size = (((unsigned long long)v->imgwidth*bitspp+7)/8 + 1) * v->imgheight;
+	return NULL;
+}
+
+/*	Inflate the next piece of IDAT data, keeping nothing but the last 32K.
+	Returns NULL if all is well so far, or what is wrong */
+const char *validate_idat (struct validator_t *v, const unsigned char *data, size_t length)
+{
+	size_t in_bytes, out_bytes;
+	int flags = TINFL_FLAG_HAS_MORE_INPUT | (v->isPhoney ? 0 : TINFL_FLAG_PARSE_ZLIB_HEADER);
+
+	while (length || v->status == TINFL_STATUS_HAS_MORE_OUTPUT)
+	{
+		/* trailing bytes after the end of the stream are harmless */
+		if (v->status == TINFL_STATUS_DONE)
+			return NULL;
+		in_bytes = length;
+		out_bytes = TINFL_LZ_DICT_SIZE - v->out_pos;
+		v->status = tinfl_decompress (&inflator, data, &in_bytes, inflate_window, inflate_window + v->out_pos, &out_bytes, flags);
+		data += in_bytes;
+		length -= in_bytes;
+		v->out_pos = (v->out_pos + out_bytes) & (TINFL_LZ_DICT_SIZE-1);
+		v->inflated_size += out_bytes;
+
+		if (v->status == TINFL_STATUS_ADLER32_MISMATCH)
+			return "image data checksum (Adler-32) invalid";
+		if (v->status < 0)
+			return "image data decompression error";
+		if (v->inflated_size > v->expected_size)
+			return "more image data than the image size needs";
+		if (v->status == TINFL_STATUS_NEEDS_MORE_INPUT && !length)
+			break;
+	}
+	return NULL;
+}
+
+/*	Check one chunk's type and place in the file, before reading its data.
+	Returns NULL if all is well, or what is wrong */
+const char *validate_chunk_order (struct validator_t *v, unsigned int id, unsigned int length)
+{
+	int i;
+
+	for (i=0; i<4; i++)
+	{
+		int c = (id >> (24-8*i)) & 0xff;
+		if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')))
+			return "invalid chunk type";
+	}
+	if (v->seen_iend)
+		return "data after IEND";
+
+	/* the image data must be complete at the first chunk after the IDATs */
+	if (v->seen_idat && !v->idat_done && id != 0x49444154)	/* "IDAT" */
+	{
+		v->idat_done = 1;
+		if (v->status != TINFL_STATUS_DONE)
+			return "image data truncated";
+		if (v->inflated_size != v->expected_size)
+			return "less image data than the image size needs";
+	}
+
+	if (v->num_chunks == 0 && id == 0x43674249)	/* "CgBI" */
+	{
+		v->isPhoney = 1;
+		return NULL;
+	}
+	if (!v->seen_ihdr && id != 0x49484452)	/* "IHDR" */
+		return "no IHDR chunk found";
+
+	switch (id)
+	{
+		case 0x49484452:	/* "IHDR" */
+			if (v->seen_ihdr)
+				return "more than one IHDR chunk";
+			if (length != 13)
+				return "IHDR chunk length incorrect";
+			break;
+		case 0x504C5445:	/* "PLTE" */
+			if (v->seen_plte)
+				return "more than one PLTE chunk";
+			if (v->seen_idat)
+				return "PLTE chunk after IDAT";
+			if (v->colortype == 0 || v->colortype == 4)
+				return "PLTE chunk not allowed for color type";
+			if (length == 0 || length > 768 || length % 3)
+				return "PLTE chunk length incorrect";
+			v->seen_plte = 1;
+			break;
+		case 0x49444154:	/* "IDAT" */
+			if (v->idat_done)
+				return "IDAT chunks are not consecutive";
+			if (!v->seen_idat)
+			{
+				if (v->colortype == 3 && !v->seen_plte)
+					return "missing PLTE chunk";
+				v->seen_idat = 1;
+				tinfl_init (&inflator);
+				v->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+				v->out_pos = 0;
+				v->inflated_size = 0;
+			}
+			break;
+		case 0x49454E44:	/* "IEND" */
+			if (!v->seen_idat)
+				return "no IDAT chunks found";
+			if (length != 0)
+				return "IEND chunk length incorrect";
+			v->seen_iend = 1;
+			break;
+		default:
+			/* a decoder must give up on critical chunks it does not know */
+			if (!(id & 0x20000000))
+				return "unknown critical chunk";
+	}
+	return NULL;
+}
+
+/*	Skip 'length' bytes of chunk data. Returns 0, or -1 at the end of the file */
+int skip_chunk_data (FILE *f, unsigned int length)
+{
+	unsigned int piece;
+
+	if (length && fseek (f, length, SEEK_CUR) == 0)
+		return 0;
+	while (length)
+	{
+		piece = length < VALIDATE_BUFFER_SIZE ? length : VALIDATE_BUFFER_SIZE;
+		if (fread (validate_buffer, 1, piece, f) != piece)
+			return -1;
+		length -= piece;
+	}
+	return 0;
+}
+
+/*	Print one line of the -l chunk list, with the CRC it should have if that was
+	worked out (-V) and is different */
+void list_chunk (char *filename, int *didShowName, unsigned int id, unsigned int length, unsigned int stored_crc, unsigned int crc)
+{
+	if (!flag_List_Chunks)
+		return;
+	if (!*didShowName)
+	{
+		*didShowName = 1;
+		printf ("%s :\n", filename);
+	}
+	printf ("    chunk : %c%c%c%c  length %6u  CRC32 %08X", (id >> 24) & 0xff, (id >> 16) & 0xff, (id >> 8) & 0xff, id & 0xff, length, stored_crc);
+	if (flag_Validate && crc != stored_crc)
+		printf (" --> CRC32 check invalid! Should be %08X", crc);
+	printf ("\n");
+}
+
+/*	Read a file once, listing its chunks for -l, and for -V checking everything
+	listed at the top, without keeping any of it. Prints one line per file: OK,
+	or the first problem found; with -l, the chunks come first.
+	Returns 1 if the file is a valid PNG file, or for -l only, could be read */
+int walk_file (char *filename)
+{
+	FILE *f;
+	struct validator_t v;
+	unsigned char buf[8];
+	unsigned int length, left, id, crc, piece;
+	const char *error = NULL;
+	int didShowName = 0;
+
+	if (!strcmp (filename, "-"))
+	{
+		f = stdin;
+		filename = "stdin";
+	} else
+	{
+		f = fopen (filename, "rb");
+		if (!f)
+		{
+			file_stats.failure = "open";
+			printf ("%s : not found or could not be opened\n", filename);
+			return 0;
+		}
+	}
+
+	memset (&v, 0, sizeof(v));
+	if (fread (buf, 1, 8, f) != 8 || memcmp (buf, png_magic_bytes, 8))
+		error = "not a PNG file";
+	file_stats.in_bytes = 8;
+
+	while (!error)
+	{
+		piece = fread (buf, 1, 8, f);
+		if (piece == 0 && v.seen_iend)
+			break;
+		/* anything after IEND is extra data, also a few stray bytes that don't
+		   make up a chunk header; it is not a cut off or damaged chunk */
+		if (v.seen_iend)
+		{
+			error = flag_Validate ? "data after IEND" : "Extra data after IEND, very suspicious!";
+			break;
+		}
+		if (piece != 8)
+		{
+			error = "premature end of file";
+			break;
+		}
+		length = read_long (buf);
+		id = read_long (buf+4);
+		if (length > MAX_CHUNK_LENGTH)
+		{
+			error = "invalid chunk size";
+			break;
+		}
+		if (flag_Validate)
+			error = validate_chunk_order (&v, id, length);
+		if (error)
+			break;
+		v.num_chunks++;
+		file_stats.in_bytes += length+12;
+		if (id == 0x49454E44)	/* "IEND" */
+			v.seen_iend = 1;
+
+		if (!flag_Validate)
+		{
+			if (skip_chunk_data (f, length) || fread (buf, 1, 4, f) != 4)
+				error = "premature end of file";
+			else
+				list_chunk (filename, &didShowName, id, length, read_long (buf), 0);
+			continue;
+		}
+
+		crc = crc32_block (0xffffffff, buf+4, 4);
+		left = length;
+		do
+		{
+			piece = left < VALIDATE_BUFFER_SIZE ? left : VALIDATE_BUFFER_SIZE;
+			if (fread (validate_buffer, 1, piece, f) != piece)
+			{
+				error = "premature end of file";
+				break;
+			}
+			crc = crc32_block (crc, validate_buffer, piece);
+			/* IHDR is short enough to always come in one piece */
+			if (id == 0x49484452)	/* "IHDR" */
+			{
+				error = validate_ihdr (&v, validate_buffer);
+				v.seen_ihdr = 1;
+			}
+			else if (id == 0x49444154)	/* "IDAT" */
+				error = validate_idat (&v, validate_buffer, piece);
+			left -= piece;
+		} while (left && !error);
+		if (error)
+			break;
+
+		if (fread (buf, 1, 4, f) != 4)
+			error = "premature end of file";
+		else
+		{
+			list_chunk (filename, &didShowName, id, length, read_long (buf), crc ^ 0xffffffff);
+			if ((crc ^ 0xffffffff) != (unsigned int)read_long (buf))
+				error = "invalid CRC";
+		}
+	}
+	close_input (f);
+	file_stats.isPNG = v.num_chunks > 0;
+	file_stats.isPhoney = v.isPhoney;
+
+	if (didShowName)
+		printf ("    ");
+	else
+		printf ("%s : ", filename);
+	if (error)
+	{
+		printf ("%s\n", error);
+		if (!strcmp (error, "not a PNG file"))
+			file_stats.failure = "not_png";
+		else if (!strcmp (error, "premature end of file"))
+			file_stats.failure = "truncated";
+		else if (!strcmp (error, "invalid CRC"))
+			file_stats.failure = "crc";
+		else if (!strcmp (error, "invalid chunk size"))
+			file_stats.failure = "chunk_size";
+		else if (strstr (error, "image data"))
+			file_stats.failure = "decompression";
+		else
+			file_stats.failure = "invalid";
+		return 0;
+	}
+	if (!flag_Validate)
+	{
+		printf ("%d chunks\n", v.num_chunks);
+		return 1;
+	}
+	printf ("OK\n");
+	if (flag_Verbose)
+	{
+		printf ("    %u x %u, bit depth %u, color type %u%s%s\n", v.imgwidth, v.imgheight, v.bitdepth, v.colortype,
+			v.interlace ? ", interlaced" : "", v.isPhoney ? ", -iphone" : "");
+		printf ("    %d chunks, %llu bytes of image data\n", v.num_chunks, v.inflated_size);
+	}
+	return 1;
+}